@@ -0,0 +1,72 @@
+#include "arena.h"
+#include <stdlib.h>
+#include <algorithm>
+#include <new>
+
+const size_t arena_t::chunk_min;
+const size_t arena_t::chunk_max;
+__thread arena_t* arena_t::current_arena = NULL;
+
+arena_t::scope_t::scope_t(arena_t& arena) : previous(current_arena) {
+	current_arena = &arena;
+}
+
+arena_t::scope_t::~scope_t() {
+	current_arena = previous;
+}
+
+arena_t::arena_t() : next(NULL), left(0), total(0) {}
+
+arena_t::~arena_t() {
+	for (size_t ii = 0; ii < chunks.size(); ++ii) {
+		free(chunks[ii]);
+	}
+}
+
+void* arena_t::alloc(size_t size) {
+	size = (size + align - 1) / align * align;
+	if (size > left) {
+		// Chunks double in size as the arena grows, so big queries don't end up with lots of them
+		size_t chunk = std::max(size, std::min(chunk_max, std::max(chunk_min, total)));
+		next = static_cast<char*>(malloc(chunk));
+		if (!next) {
+			throw std::bad_alloc();
+		}
+		chunks.push_back(next);
+		left = chunk;
+		total += chunk;
+	}
+	void* ptr = next;
+	next += size;
+	left -= size;
+	return ptr;
+}
+
+/**
+ * Each object is preceded by the arena it came from, or NULL if it came from the heap. The header
+ * takes a full alignment unit so objects stay aligned.
+ */
+void* arena_object_t::operator new(size_t size) {
+	arena_t* arena = arena_t::current();
+	void* header;
+	if (arena) {
+		header = arena->alloc(size + 16);
+	} else {
+		header = malloc(size + 16);
+		if (!header) {
+			throw std::bad_alloc();
+		}
+	}
+	*static_cast<arena_t**>(header) = arena;
+	return static_cast<char*>(header) + 16;
+}
+
+void arena_object_t::operator delete(void* ptr) {
+	if (!ptr) {
+		return;
+	}
+	void* header = static_cast<char*>(ptr) - 16;
+	if (!*static_cast<arena_t**>(header)) {
+		free(header);
+	}
+}
@@ -0,0 +1,74 @@
+#ifndef ARENA_H
+#define ARENA_H
+#include <stddef.h>
+#include <vector>
+
+/**
+ * Bump allocator for short-lived objects which all go away together, like the iterators built for a
+ * query. Nothing is freed until the arena is destroyed.
+ *
+ * Objects deriving from arena_object_t are allocated from whichever arena has a scope_t open on the
+ * current thread, so code building them doesn't have to know about it. The arena has to outlive
+ * them.
+ */
+class arena_t {
+	public:
+		/**
+		 * Sends arena_object_t allocations on this thread to `arena` until it goes out of scope.
+		 * Scopes nest.
+		 */
+		class scope_t {
+			public:
+				scope_t(arena_t& arena);
+				~scope_t();
+
+			private:
+				arena_t* previous;
+		};
+
+		arena_t();
+		~arena_t();
+
+		void* alloc(size_t size);
+
+		/**
+		 * Memory taken from the system so far.
+		 */
+		size_t bytes() const {
+			return total;
+		}
+
+		/**
+		 * Arena with a scope open on the current thread, if any.
+		 */
+		static arena_t* current() {
+			return current_arena;
+		}
+
+	private:
+		static const size_t chunk_min = 8192;
+		static const size_t chunk_max = 1 << 20;
+		static const size_t align = 16;
+
+		std::vector<char*> chunks;
+		char* next;
+		size_t left;
+		size_t total;
+		static __thread arena_t* current_arena;
+
+		// Non-copyable
+		arena_t(const arena_t&);
+		arena_t& operator=(const arena_t&);
+};
+
+/**
+ * Base for classes which go in the current thread's arena when there is one, and on the heap
+ * otherwise. Deleting them still runs their destructors, only the memory stays put until the arena
+ * goes.
+ */
+struct arena_object_t {
+	static void* operator new(size_t size);
+	static void operator delete(void* ptr);
+};
+
+#endif
@@ -0,0 +1,138 @@
+#include "bitmap.h"
+
+using namespace std;
+
+bitmap_t::bitmap_t() : count(0), published(NULL), dirty(false) {}
+
+bitmap_t::~bitmap_t() {
+	for (size_t ii = 0; ii < working.size(); ++ii) {
+		delete working[ii];
+	}
+	delete published.load(boost::memory_order_relaxed);
+}
+
+bool bitmap_t::set(uint32_t value) {
+	if (test(value)) {
+		return false;
+	}
+	chunk_t& chunk = *writable(value >> 16);
+	uint16_t low = value & 0xffff;
+	if (!chunk.words.empty()) {
+		chunk.words[low >> 6] |= uint64_t(1) << (low & 63);
+	} else {
+		chunk.values.insert(lower_bound(chunk.values.begin(), chunk.values.end(), low), low);
+		if (chunk.values.size() > array_max) {
+			chunk.words.assign(chunk_words, 0);
+			for (size_t ii = 0; ii < chunk.values.size(); ++ii) {
+				chunk.words[chunk.values[ii] >> 6] |= uint64_t(1) << (chunk.values[ii] & 63);
+			}
+			vector<uint16_t>().swap(chunk.values);
+		}
+	}
+	++chunk.count;
+	++count;
+	return true;
+}
+
+bool bitmap_t::reset(uint32_t value) {
+	if (!test(value)) {
+		return false;
+	}
+	size_t index = value >> 16;
+	chunk_t& chunk = *writable(index);
+	uint16_t low = value & 0xffff;
+	--chunk.count;
+	--count;
+	if (chunk.count == 0) {
+		release(&chunk);
+		working[index] = NULL;
+	} else if (!chunk.words.empty()) {
+		chunk.words[low >> 6] &= ~(uint64_t(1) << (low & 63));
+		if (chunk.count < array_max / 2) {
+			chunk.values.reserve(chunk.count);
+			for (size_t ii = 0; ii < chunk_words; ++ii) {
+				for (uint64_t word = chunk.words[ii]; word; word &= word - 1) {
+					chunk.values.push_back(ii * 64 + __builtin_ctzll(word));
+				}
+			}
+			vector<uint64_t>().swap(chunk.words);
+		}
+	} else {
+		chunk.values.erase(lower_bound(chunk.values.begin(), chunk.values.end(), low));
+	}
+	return true;
+}
+
+void bitmap_t::clear() {
+	for (size_t ii = 0; ii < working.size(); ++ii) {
+		release(working[ii]);
+	}
+	working.clear();
+	count = 0;
+	touch();
+}
+
+void bitmap_t::publish() {
+	if (!dirty) {
+		return;
+	}
+	dirty = false;
+	const root_t* prev = published.load(boost::memory_order_relaxed);
+	root_t* next = new root_t;
+	next->chunks.assign(working.begin(), working.end());
+	next->count = count;
+	next->seq = write_txn_t::publishing();
+	next->previous = prev;
+	published.store(next, boost::memory_order_release);
+	epoch_t::retire(const_cast<root_t*>(prev));
+}
+
+bool bitmap_t::test(uint32_t value) const {
+	size_t index = value >> 16;
+	return index < working.size() && working[index] && working[index]->test(value & 0xffff);
+}
+
+/**
+ * The chunk at `index` as one the writer may change, created or copied if need be.
+ */
+bitmap_t::chunk_t* bitmap_t::writable(size_t index) {
+	touch();
+	if (index >= working.size()) {
+		working.resize(index + 1, NULL);
+	}
+	chunk_t* chunk = working[index];
+	if (!chunk) {
+		chunk = new chunk_t;
+		chunk->count = 0;
+	} else if (chunk->txn != write_txn_t::current()) {
+		chunk_t* copy = new chunk_t(*chunk);
+		release(chunk);
+		chunk = copy;
+	} else {
+		return chunk;
+	}
+	chunk->txn = write_txn_t::current();
+	working[index] = chunk;
+	return chunk;
+}
+
+void bitmap_t::touch() {
+	if (!dirty) {
+		dirty = true;
+		write_txn_t::touch(this, &publish_thunk);
+	}
+}
+
+void bitmap_t::release(chunk_t* chunk) {
+	if (!chunk) {
+		return;
+	} else if (chunk->txn == write_txn_t::current()) {
+		delete chunk;
+	} else {
+		epoch_t::retire(chunk);
+	}
+}
+
+void bitmap_t::publish_thunk(void* bitmap) {
+	static_cast<bitmap_t*>(bitmap)->publish();
+}
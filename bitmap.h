@@ -0,0 +1,122 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+#include "rcu.h"
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+#include <boost/atomic.hpp>
+
+/**
+ * Set of 32-bit integers stored as a compressed bitmap, the way Roaring does it. The range is split
+ * into chunks of 2^16 and each chunk is a sorted array of the low 16 bits of its members while
+ * that's smaller, or else a plain 8K bitmap. Empty chunks take no space at all.
+ *
+ * Copy-on-write like posting_list_t: the writer changes chunks it created during the current
+ * write_txn_t in place and copies older ones, and on commit the new directory of chunks is
+ * published. Readers take a view() which stays valid for as long as they hold an epoch_t::guard_t,
+ * and shows the bitmap as of their snapshot_t. Everything except view() is writer only.
+ */
+class bitmap_t {
+	private:
+		// Past this many members a chunk switches to a bitmap, and below half of it back again
+		static const size_t array_max = 4096;
+		static const size_t chunk_words = 1024;
+
+		struct chunk_t {
+			uint64_t txn;
+			std::vector<uint16_t> values;
+			std::vector<uint64_t> words;
+			size_t count;
+
+			bool test(uint16_t low) const {
+				if (!words.empty()) {
+					return (words[low >> 6] >> (low & 63)) & 1;
+				}
+				return std::binary_search(values.begin(), values.end(), low);
+			}
+		};
+
+		/**
+		 * Linked back to the root it replaced, see posting_list_t.
+		 */
+		struct root_t {
+			std::vector<const chunk_t*> chunks;
+			size_t count;
+			uint64_t seq;
+			const root_t* previous;
+		};
+
+	public:
+		class view_t {
+			friend class bitmap_t;
+			const root_t* root;
+
+			view_t(const root_t* root) : root(root) {}
+
+			public:
+				view_t() : root(NULL) {}
+
+				bool test(uint32_t value) const {
+					size_t index = value >> 16;
+					if (!root || index >= root->chunks.size() || !root->chunks[index]) {
+						return false;
+					}
+					return root->chunks[index]->test(value & 0xffff);
+				}
+
+				size_t size() const {
+					return root ? root->count : 0;
+				}
+		};
+
+		bitmap_t();
+		~bitmap_t();
+
+		/**
+		 * Returns false if `value` was already set.
+		 */
+		bool set(uint32_t value);
+
+		/**
+		 * Returns false if `value` wasn't set.
+		 */
+		bool reset(uint32_t value);
+
+		void clear();
+
+		size_t size() const {
+			return count;
+		}
+
+		/**
+		 * Makes the writer's changes visible to views taken from now on. Normally called when the
+		 * write_txn_t commits.
+		 */
+		void publish();
+
+		view_t view() const {
+			const root_t* root = published.load(boost::memory_order_acquire);
+			while (root && !snapshot_t::covers(root->seq)) {
+				root = root->previous;
+			}
+			return view_t(root);
+		}
+
+	private:
+		std::vector<chunk_t*> working;
+		size_t count;
+		boost::atomic<const root_t*> published;
+		bool dirty;
+
+		bool test(uint32_t value) const;
+		chunk_t* writable(size_t index);
+		void touch();
+		static void release(chunk_t* chunk);
+		static void publish_thunk(void* bitmap);
+
+		// Non-copyable
+		bitmap_t(const bitmap_t&);
+		bitmap_t& operator=(const bitmap_t&);
+};
+
+#endif
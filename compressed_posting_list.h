@@ -0,0 +1,667 @@
+#ifndef COMPRESSED_POSTING_LIST_H
+#define COMPRESSED_POSTING_LIST_H
+#include "posting_list.h"
+#include <vector>
+#include <algorithm>
+
+/**
+ * Posting list which keeps most of its entries in immutable delta + varint encoded blocks, with a
+ * small posting_list_t in front absorbing changes. Once the delta buffer fills up it is folded into
+ * the blocks it lands in; blocks which receive nothing are left alone. Stale entries, see
+ * posting_list_t::refile(), are dropped from any block that gets re-encoded.
+ *
+ * Blocks are found through a posting_list_t directory keyed by their last entry, so both the delta
+ * buffer and the directory are copy-on-write and readers see the list through view() the same way
+ * they would a posting_list_t, as of their snapshot_t.
+ *
+ * In addition to what posting_list_t needs, `Traits` must provide:
+ *   static uint32_t ordinal(value_t) -- small integer standing in for a value
+ *   static value_t from_ordinal(uint32_t)
+ * Keys must be unsigned integers which sort descending, i.e. newest timestamp first.
+ */
+template <class Traits>
+class compressed_posting_list_t {
+	public:
+		typedef posting_list_t<Traits> delta_t;
+		typedef typename Traits::key_t key_t;
+		typedef typename Traits::value_t value_t;
+		class const_iterator;
+		class view_t;
+		typedef const_iterator iterator;
+		friend class const_iterator;
+		friend class view_t;
+
+		/**
+		 * Unless `compress` is set the delta buffer is never folded, which makes this a plain
+		 * posting_list_t.
+		 */
+		static bool compress;
+		static size_t delta_max;
+
+	private:
+		static const size_t block_max = 128;
+
+		/**
+		 * Encoded entries follow the header. The first key is stored whole and the rest as the distance
+		 * from the key before it, each followed by the value's ordinal. The last entry is kept unencoded
+		 * so searches can skip over whole blocks.
+		 */
+		struct block_t {
+			key_t last_key;
+			uint32_t count;
+			uint64_t txn;
+			value_t last_value;
+
+			const uint8_t* data() const {
+				return reinterpret_cast<const uint8_t*>(this + 1);
+			}
+
+			static void release(block_t* block) {
+				if (block->txn == write_txn_t::current()) {
+					free(block);
+				} else {
+					epoch_t::retire(block, free);
+				}
+			}
+		};
+
+		struct block_traits {
+			typedef typename Traits::key_t key_t;
+			typedef block_t* value_t;
+
+			static key_t key(const block_t* block) {
+				return block->last_key;
+			}
+
+			static key_t published_key(const block_t* block) {
+				return block->last_key;
+			}
+
+			static bool less(key_t left_key, const block_t* left, key_t right_key, const block_t* right) {
+				return Traits::less(left_key, left->last_value, right_key, right->last_value);
+			}
+		};
+		typedef posting_list_t<block_traits> directory_t;
+
+		struct entry_t {
+			key_t key;
+			value_t value;
+			entry_t(key_t key, value_t value) : key(key), value(value) {}
+			bool operator< (const entry_t& rhs) const {
+				return Traits::less(key, value, rhs.key, rhs.value);
+			}
+		};
+		typedef std::vector<entry_t> entries_t;
+
+		/**
+		 * What readers see, linked back to what it replaced like posting_list_t's roots.
+		 */
+		struct root_t {
+			typename delta_t::view_t delta;
+			typename directory_t::view_t directory;
+			size_t live;
+			bool stale;
+			uint64_t seq;
+			const root_t* previous;
+		};
+
+		delta_t delta;
+		directory_t directory;
+		size_t compressed_length;
+		size_t live;
+		boost::atomic<const root_t*> published;
+		version_t published_version;
+		bool dirty;
+
+		// Non-copyable
+		compressed_posting_list_t(const compressed_posting_list_t&);
+		compressed_posting_list_t& operator=(const compressed_posting_list_t&);
+
+		static void put_varint(std::vector<uint8_t>& out, uint32_t value) {
+			while (value >= 0x80) {
+				out.push_back((value & 0x7f) | 0x80);
+				value >>= 7;
+			}
+			out.push_back(value);
+		}
+
+		static uint32_t get_varint(const uint8_t*& data) {
+			uint32_t value = 0;
+			for (size_t shift = 0;; shift += 7) {
+				uint8_t byte = *data++;
+				value |= uint32_t(byte & 0x7f) << shift;
+				if (!(byte & 0x80)) {
+					return value;
+				}
+			}
+		}
+
+		static block_t* encode(const entry_t* entries, size_t count) {
+			assert(count > 0);
+			std::vector<uint8_t> bytes;
+			bytes.reserve(count * 4);
+			put_varint(bytes, entries[0].key);
+			put_varint(bytes, Traits::ordinal(entries[0].value));
+			for (size_t ii = 1; ii < count; ++ii) {
+				put_varint(bytes, entries[ii - 1].key - entries[ii].key);
+				put_varint(bytes, Traits::ordinal(entries[ii].value));
+			}
+			block_t* block = static_cast<block_t*>(malloc(sizeof(block_t) + bytes.size()));
+			block->last_key = entries[count - 1].key;
+			block->last_value = entries[count - 1].value;
+			block->count = count;
+			block->txn = write_txn_t::current();
+			memcpy(block + 1, &bytes[0], bytes.size());
+			return block;
+		}
+
+		/**
+		 * Whether an entry is filed under a key its value has moved on from, as of the reader's
+		 * snapshot if it was read from a published root.
+		 */
+		static bool is_stale(key_t key, value_t value, bool published) {
+			return (published ? Traits::published_key(value) : Traits::key(value)) != key;
+		}
+
+		bool has_stale() const {
+			return delta.length() + compressed_length != live;
+		}
+
+		static void decode(const block_t* block, entries_t& out) {
+			const uint8_t* data = block->data();
+			key_t key = 0;
+			for (size_t ii = 0; ii < block->count; ++ii) {
+				key = ii ? key - get_varint(data) : get_varint(data);
+				out.push_back(entry_t(key, Traits::from_ordinal(get_varint(data))));
+			}
+		}
+
+		static block_t probe(key_t key, value_t value) {
+			block_t block;
+			block.last_key = key;
+			block.last_value = value;
+			return block;
+		}
+
+		/**
+		 * First block whose last entry is not less than (key, value), or NULL.
+		 */
+		block_t* find_block(key_t key, value_t value) const {
+			block_t search = probe(key, value);
+			typename directory_t::const_iterator it = directory.lower_bound(&search);
+			return it.at_end() ? NULL : *it;
+		}
+
+		/**
+		 * Position of (key, value) within decoded entries, or `entries.size()` if it isn't there.
+		 */
+		static size_t find_entry(const entries_t& entries, key_t key, value_t value) {
+			entry_t search(key, value);
+			typename entries_t::const_iterator ii = std::lower_bound(entries.begin(), entries.end(), search);
+			if (ii == entries.end() || search < *ii) {
+				return entries.size();
+			}
+			return ii - entries.begin();
+		}
+
+		/**
+		 * Encodes `entries` as evenly sized blocks and files them in the directory.
+		 */
+		void flush(const entries_t& entries) {
+			size_t blocks = (entries.size() + block_max - 1) / block_max;
+			for (size_t ii = 0, offset = 0; ii < blocks; ++ii) {
+				size_t count = (entries.size() - offset) / (blocks - ii);
+				directory.insert(encode(&entries[offset], count));
+				compressed_length += count;
+				offset += count;
+			}
+		}
+
+		/**
+		 * Takes a block out of the directory, decoding its live entries into `out`.
+		 */
+		void unfile(block_t* block, entries_t& out) {
+			entries_t entries;
+			entries.reserve(block->count);
+			decode(block, entries);
+			for (size_t ii = 0; ii < entries.size(); ++ii) {
+				if (!is_stale(entries[ii].key, entries[ii].value, false)) {
+					out.push_back(entries[ii]);
+				}
+			}
+			directory.erase(block);
+			compressed_length -= block->count;
+			block_t::release(block);
+		}
+
+		/**
+		 * Folds the delta buffer into the compressed blocks. Only blocks which receive delta entries are
+		 * re-encoded, along with their successor when the result would be tiny.
+		 */
+		void merge() {
+			touch();
+			typename delta_t::const_iterator it = delta.begin();
+			entries_t entries, incoming;
+			while (it != delta.end()) {
+				block_t* block = find_block(it.key(), *it);
+				entries.clear();
+				while (true) {
+					// Merge in this block along with the delta entries up to its last entry
+					incoming.clear();
+					if (block) {
+						block_t last = probe(block->last_key, block->last_value);
+						unfile(block, entries);
+						while (it != delta.end() && !Traits::less(last.last_key, last.last_value, it.key(), *it)) {
+							incoming.push_back(entry_t(it.key(), *it));
+							++it;
+						}
+					} else {
+						for (; it != delta.end(); ++it) {
+							incoming.push_back(entry_t(it.key(), *it));
+						}
+					}
+					size_t middle = entries.size();
+					entries.insert(entries.end(), incoming.begin(), incoming.end());
+					std::inplace_merge(entries.begin(), entries.begin() + middle, entries.end());
+					if (!block || entries.empty() || entries.size() >= block_max / 4) {
+						break;
+					}
+					// Too small to stand alone, pull in the next block as well
+					block = find_block(entries.back().key, entries.back().value);
+					if (!block) {
+						break;
+					}
+				}
+				flush(entries);
+			}
+			delta.clear();
+		}
+
+		/**
+		 * Re-encodes the whole list without its stale entries.
+		 */
+		void compact() {
+			entries_t entries;
+			entries.reserve(live);
+			for (const_iterator it = begin(); it != end(); ++it) {
+				entries.push_back(entry_t(it.key(), *it));
+			}
+			clear();
+			flush(entries);
+			live = entries.size();
+			assert(delta.length() + compressed_length == live);
+		}
+
+		static void publish_thunk(void* list) {
+			static_cast<compressed_posting_list_t*>(list)->publish();
+		}
+
+		void touch() {
+			if (!dirty) {
+				dirty = true;
+				write_txn_t::touch(this, &publish_thunk);
+			}
+		}
+
+		static const_iterator make_iterator(typename delta_t::view_t delta, typename directory_t::view_t directory, bool stale, bool published) {
+			const_iterator it;
+			it.delta_it = delta.begin();
+			it.dir_it = directory.begin();
+			it.stale = stale;
+			it.published = published;
+			it.block_load();
+			it.block_skip_stale();
+			it.choose();
+			return it;
+		}
+
+	public:
+		compressed_posting_list_t() : compressed_length(0), live(0), published(NULL), dirty(false) {}
+
+		~compressed_posting_list_t() {
+			for (typename directory_t::const_iterator it = directory.begin(); it != directory.end(); ++it) {
+				free(*it);
+			}
+			delete published.load(boost::memory_order_relaxed);
+		}
+
+		size_t size() const {
+			return live;
+		}
+
+		bool empty() const {
+			return size() == 0;
+		}
+
+		void clear() {
+			touch();
+			delta.clear();
+			for (typename directory_t::const_iterator it = directory.begin(); it != directory.end(); ++it) {
+				block_t::release(*it);
+			}
+			directory.clear();
+			compressed_length = live = 0;
+		}
+
+		/**
+		 * Builds the list out of sorted, unique, live entries. The list must be empty.
+		 */
+		void assign(const std::vector<key_t>& keys, const std::vector<value_t>& values) {
+			assert(!delta.length() && !compressed_length);
+			touch();
+			if (compress) {
+				entries_t entries;
+				entries.reserve(keys.size());
+				for (size_t ii = 0; ii < keys.size(); ++ii) {
+					entries.push_back(entry_t(keys[ii], values[ii]));
+				}
+				flush(entries);
+			} else {
+				delta.assign(keys, values);
+			}
+			live = keys.size();
+		}
+
+		bool insert(value_t value) {
+			key_t key = Traits::key(value);
+			block_t* block = find_block(key, value);
+			if (block) {
+				entries_t entries;
+				decode(block, entries);
+				if (find_entry(entries, key, value) != entries.size()) {
+					return false;
+				}
+			}
+			if (!delta.insert(value)) {
+				return false;
+			}
+			touch();
+			++live;
+			if (compress && delta.length() > delta_max) {
+				merge();
+			}
+			return true;
+		}
+
+		/**
+		 * See posting_list_t::refile().
+		 */
+		void refile(value_t value, key_t old_key) {
+			touch();
+			if (delta.contains(old_key, value)) {
+				delta.refile(value, old_key);
+			} else {
+				bool filed = delta.insert(value);
+				assert(filed);
+			}
+			if (compress) {
+				size_t length = delta.length() + compressed_length;
+				if ((length - live) * 2 > length && length > block_max) {
+					compact();
+				} else if (delta.length() > delta_max) {
+					merge();
+				}
+			}
+		}
+
+		bool erase(value_t value) {
+			if (delta.erase(value)) {
+				touch();
+				--live;
+				return true;
+			}
+			key_t key = Traits::key(value);
+			block_t* block = find_block(key, value);
+			if (!block) {
+				return false;
+			}
+			entries_t entries;
+			decode(block, entries);
+			size_t pos = find_entry(entries, key, value);
+			if (pos == entries.size()) {
+				return false;
+			}
+			touch();
+			entries.erase(entries.begin() + pos);
+			directory.erase(block);
+			compressed_length -= block->count;
+			block_t::release(block);
+			if (!entries.empty()) {
+				directory.insert(encode(&entries[0], entries.size()));
+				compressed_length += entries.size();
+			}
+			--live;
+			return true;
+		}
+
+		/**
+		 * See posting_list_t::publish().
+		 */
+		void publish() {
+			if (!dirty) {
+				return;
+			}
+			dirty = false;
+			delta.publish();
+			directory.publish();
+			const root_t* prev = published.load(boost::memory_order_relaxed);
+			root_t* next = new root_t;
+			next->delta = delta.view();
+			next->directory = directory.view();
+			next->live = live;
+			next->stale = has_stale();
+			next->seq = write_txn_t::publishing();
+			next->previous = prev;
+			published.store(next, boost::memory_order_release);
+			published_version.publish();
+			epoch_t::retire(const_cast<root_t*>(prev));
+		}
+
+		const version_t& version() const {
+			return published_version;
+		}
+
+		view_t view() const {
+			const root_t* root = published.load(boost::memory_order_acquire);
+			while (root && !snapshot_t::covers(root->seq)) {
+				root = root->previous;
+			}
+			return view_t(root);
+		}
+
+		/**
+		 * Iterates the writer's own state.
+		 */
+		const_iterator begin() const {
+			return make_iterator(delta.working_view(), directory.working_view(), has_stale(), false);
+		}
+
+		const_iterator end() const {
+			return const_iterator();
+		}
+
+		class view_t {
+			friend class compressed_posting_list_t;
+			const root_t* root;
+
+			view_t(const root_t* root) : root(root) {}
+
+			public:
+				view_t() : root(NULL) {}
+
+				size_t size() const {
+					return root ? root->live : 0;
+				}
+
+				bool empty() const {
+					return size() == 0;
+				}
+
+				const_iterator begin() const {
+					return root ? make_iterator(root->delta, root->directory, root->stale, true) : const_iterator();
+				}
+
+				const_iterator end() const {
+					return const_iterator();
+				}
+		};
+
+		/**
+		 * Merges the delta buffer and the block decoder. Only one entry of the current block is decoded
+		 * at a time.
+		 */
+		class const_iterator {
+			friend class compressed_posting_list_t;
+			typename delta_t::const_iterator delta_it;
+			typename directory_t::const_iterator dir_it;
+			const uint8_t* data;
+			uint32_t remaining;
+			key_t block_key;
+			value_t block_value;
+			bool from_delta;
+			bool stale;
+			bool published;
+
+			void block_decode() {
+				const block_t* current = *dir_it;
+				uint32_t bits = get_varint(data);
+				block_key = remaining == current->count ? bits : block_key - bits;
+				block_value = Traits::from_ordinal(get_varint(data));
+				--remaining;
+			}
+
+			void block_load() {
+				remaining = 0;
+				if (!dir_it.at_end()) {
+					data = (*dir_it)->data();
+					remaining = (*dir_it)->count;
+					block_decode();
+				}
+			}
+
+			void block_advance() {
+				if (remaining) {
+					block_decode();
+				} else {
+					++dir_it;
+					block_load();
+				}
+			}
+
+			void block_skip_stale() {
+				if (stale) {
+					while (!block_end() && is_stale(block_key, block_value, published)) {
+						block_advance();
+					}
+				}
+			}
+
+			bool block_end() const {
+				return dir_it.at_end();
+			}
+
+			void block_seek(key_t key, value_t value) {
+				if (block_end() || !Traits::less(block_key, block_value, key, value)) {
+					return;
+				}
+				const block_t* current = *dir_it;
+				if (Traits::less(current->last_key, current->last_value, key, value)) {
+					// Skip whole blocks using their last entries
+					block_t search = probe(key, value);
+					dir_it.seek(&search);
+					block_load();
+				}
+				while (!block_end() && Traits::less(block_key, block_value, key, value)) {
+					block_advance();
+				}
+				block_skip_stale();
+			}
+
+			void choose() {
+				from_delta = !delta_it.at_end() && (block_end() || Traits::less(delta_it.key(), *delta_it, block_key, block_value));
+			}
+
+			public:
+				typedef std::forward_iterator_tag iterator_category;
+				typedef typename Traits::value_t value_type;
+				typedef ptrdiff_t difference_type;
+				typedef const value_type* pointer;
+				typedef value_type reference;
+
+				const_iterator() : data(NULL), remaining(0), block_key(0), block_value(), from_delta(false), stale(false), published(false) {}
+
+				value_type operator* () const {
+					return from_delta ? *delta_it : block_value;
+				}
+
+				key_t key() const {
+					return from_delta ? delta_it.key() : block_key;
+				}
+
+				bool at_end() const {
+					return delta_it.at_end() && block_end();
+				}
+
+				const_iterator& operator++ () {
+					if (from_delta) {
+						++delta_it;
+					} else {
+						block_advance();
+						block_skip_stale();
+					}
+					choose();
+					return *this;
+				}
+
+				const_iterator operator++ (int) {
+					const_iterator tmp(*this);
+					++*this;
+					return tmp;
+				}
+
+				bool operator== (const const_iterator& rhs) const {
+					return delta_it == rhs.delta_it && dir_it == rhs.dir_it && remaining == rhs.remaining;
+				}
+
+				bool operator!= (const const_iterator& rhs) const {
+					return !(*this == rhs);
+				}
+
+				/**
+				 * Same as posting_list_t::const_iterator::read(). Blocks are decoded an entry at a time,
+				 * and once they're used up whatever's left in the delta buffer is copied out directly.
+				 */
+				size_t read(key_t* keys, value_type* values, size_t max) {
+					size_t count = 0;
+					for (; count < max && !block_end(); ++count, ++*this) {
+						keys[count] = key();
+						values[count] = **this;
+					}
+					if (count < max) {
+						count += delta_it.read(keys + count, values + count, max - count);
+						choose();
+					}
+					return count;
+				}
+
+				void seek(value_type value) {
+					seek(published ? Traits::published_key(value) : Traits::key(value), value);
+				}
+
+				void seek(key_t key, value_type value) {
+					if (!delta_it.at_end() && Traits::less(delta_it.key(), *delta_it, key, value)) {
+						delta_it.seek(key, value);
+					}
+					block_seek(key, value);
+					choose();
+				}
+		};
+};
+
+template <class Traits>
+bool compressed_posting_list_t<Traits>::compress = false;
+
+template <class Traits>
+size_t compressed_posting_list_t<Traits>::delta_max = 16;
+
+#endif
@@ -0,0 +1,107 @@
+#include "kernels.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KERNELS_X86
+#endif
+
+static size_t count_greater_scalar(const uint32_t* keys, size_t count, uint32_t key) {
+	size_t ii = 0;
+	while (ii < count && keys[ii] > key) {
+		++ii;
+	}
+	return ii;
+}
+
+#ifdef KERNELS_X86
+__attribute__((target("avx2")))
+static size_t count_greater_avx2(const uint32_t* keys, size_t count, uint32_t key) {
+	// AVX2 only compares signed integers, so flip the sign bits first
+	const __m256i bias = _mm256_set1_epi32(static_cast<int>(0x80000000u));
+	const __m256i needle = _mm256_xor_si256(_mm256_set1_epi32(key), bias);
+	size_t ii = 0;
+	for (; ii + 8 <= count; ii += 8) {
+		__m256i chunk = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + ii)), bias);
+		unsigned mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(chunk, needle)));
+		if (mask != 0xff) {
+			return ii + __builtin_ctz(~mask);
+		}
+	}
+	return ii + count_greater_scalar(keys + ii, count - ii, key);
+}
+
+__attribute__((target("avx512f")))
+static size_t count_greater_avx512(const uint32_t* keys, size_t count, uint32_t key) {
+	const __m512i needle = _mm512_set1_epi32(key);
+	size_t ii = 0;
+	for (; ii + 16 <= count; ii += 16) {
+		unsigned mask = _mm512_cmpgt_epu32_mask(_mm512_loadu_si512(keys + ii), needle);
+		if (mask != 0xffff) {
+			return ii + __builtin_ctz(~mask);
+		}
+	}
+	return ii + count_greater_scalar(keys + ii, count - ii, key);
+}
+#endif
+
+static unsigned match_keys8_scalar(const uint32_t* left, const uint32_t* right) {
+	unsigned mask = 0;
+	for (size_t ii = 0; ii < 8; ++ii) {
+		for (size_t jj = 0; jj < 8; ++jj) {
+			if (left[ii] == right[jj]) {
+				mask |= 1 << ii;
+				break;
+			}
+		}
+	}
+	return mask;
+}
+
+#ifdef KERNELS_X86
+__attribute__((target("avx2")))
+static unsigned match_keys8_avx2(const uint32_t* left, const uint32_t* right) {
+	// Compare against each rotation of `right`, which covers every pair
+	const __m256i rotate = _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 0);
+	__m256i lanes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(left));
+	__m256i other = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(right));
+	__m256i equal = _mm256_cmpeq_epi32(lanes, other);
+	for (size_t ii = 1; ii < 8; ++ii) {
+		other = _mm256_permutevar8x32_epi32(other, rotate);
+		equal = _mm256_or_si256(equal, _mm256_cmpeq_epi32(lanes, other));
+	}
+	return _mm256_movemask_ps(_mm256_castsi256_ps(equal));
+}
+#endif
+
+struct kernels_impl_t {
+	size_t (*count_greater)(const uint32_t*, size_t, uint32_t);
+	unsigned (*match_keys8)(const uint32_t*, const uint32_t*);
+	const char* isa;
+
+	kernels_impl_t() : count_greater(count_greater_scalar), match_keys8(match_keys8_scalar), isa("scalar") {
+#ifdef KERNELS_X86
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2")) {
+			count_greater = count_greater_avx2;
+			match_keys8 = match_keys8_avx2;
+			isa = "avx2";
+		}
+		if (__builtin_cpu_supports("avx512f")) {
+			count_greater = count_greater_avx512;
+			isa = "avx512";
+		}
+#endif
+	}
+};
+static const kernels_impl_t kernels_impl;
+
+size_t count_greater(const uint32_t* keys, size_t count, uint32_t key) {
+	return kernels_impl.count_greater(keys, count, key);
+}
+
+unsigned match_keys8(const uint32_t* left, const uint32_t* right) {
+	return kernels_impl.match_keys8(left, right);
+}
+
+const char* kernels_isa() {
+	return kernels_impl.isa;
+}
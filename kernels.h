@@ -0,0 +1,162 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <cstddef>
+
+/**
+ * Number of leading keys greater than `key` in an array sorted in descending order. Compares 16 or
+ * 8 keys at a time with AVX-512 or AVX2 if the CPU has them, which is checked once at startup.
+ */
+size_t count_greater(const uint32_t* keys, size_t count, uint32_t key);
+
+/**
+ * Bit `ii` of the result is set if `left[ii]` equals any of `right[0]` to `right[7]`.
+ */
+unsigned match_keys8(const uint32_t* left, const uint32_t* right);
+
+/**
+ * Name of the instruction set the kernels ended up with, for stats.
+ */
+const char* kernels_isa();
+
+/**
+ * Run of posting list entries, as an array of keys and an array of values. Entries from `pos` up to
+ * `count` are the ones left to read, or when the run is being written to, the space left to write.
+ */
+template <class Traits>
+struct run_t {
+	typename Traits::key_t* keys;
+	typename Traits::value_t* values;
+	size_t pos;
+	size_t count;
+
+	bool empty() const {
+		return pos == count;
+	}
+
+	size_t remaining() const {
+		return count - pos;
+	}
+};
+
+/**
+ * Set operations over runs sorted the way posting_list_t sorts them. They work through as much of
+ * their input as they can in one go, scanning keys with count_greater() instead of comparing one
+ * entry at a time, and write out runs of results.
+ *
+ * `Traits` is the same as for posting_list_t, except keys must be uint32_t and `less` has to order
+ * by key first, in descending order.
+ */
+template <class Traits>
+struct set_kernels_t {
+	typedef typename Traits::key_t key_t;
+	typedef typename Traits::value_t value_t;
+	typedef run_t<Traits> run_type;
+	static const size_t short_seek = 4;
+
+	/**
+	 * How many of the entries left in `run` come before (key, value).
+	 */
+	static size_t count_before(const run_type& run, key_t key, value_t value) {
+		const key_t* keys = run.keys + run.pos;
+		const value_t* values = run.values + run.pos;
+		size_t count = run.remaining();
+		// Most seeks only go a few entries, so look at those before bothering with count_greater()
+		size_t ii = 0;
+		while (ii < count && ii < short_seek && keys[ii] > key) {
+			++ii;
+		}
+		if (ii == short_seek) {
+			ii += count_greater(keys + ii, count - ii, key);
+		}
+		while (ii < count && Traits::less(keys[ii], values[ii], key, value)) {
+			++ii;
+		}
+		return ii;
+	}
+
+	/**
+	 * Moves `count` entries from `from` to `to`.
+	 */
+	static void copy(run_type& from, run_type& to, size_t count) {
+		if (count < short_seek) {
+			for (size_t ii = 0; ii < count; ++ii) {
+				to.keys[to.pos + ii] = from.keys[from.pos + ii];
+				to.values[to.pos + ii] = from.values[from.pos + ii];
+			}
+		} else {
+			memcpy(to.keys + to.pos, from.keys + from.pos, count * sizeof(key_t));
+			memcpy(to.values + to.pos, from.values + from.pos, count * sizeof(value_t));
+		}
+		from.pos += count;
+		to.pos += count;
+	}
+
+	/**
+	 * Writes entries found in both `left` and `right` to `out`, until either input runs out or `out`
+	 * fills up.
+	 */
+	static void intersect(run_type& left, run_type& right, run_type& out) {
+		// Lists which interleave closely would step one entry at a time below, so compare eight
+		// against eight instead while there's room. Whichever block ends first moves along.
+		while (left.remaining() >= 8 && right.remaining() >= 8 && out.remaining() >= 8) {
+			const key_t* left_keys = left.keys + left.pos;
+			const key_t* right_keys = right.keys + right.pos;
+			const value_t* left_values = left.values + left.pos;
+			const value_t* right_values = right.values + right.pos;
+			for (unsigned mask = match_keys8(left_keys, right_keys); mask; mask &= mask - 1) {
+				size_t ii = __builtin_ctz(mask);
+				for (size_t jj = 0; jj < 8; ++jj) {
+					if (right_values[jj] == left_values[ii] && right_keys[jj] == left_keys[ii]) {
+						out.keys[out.pos] = left_keys[ii];
+						out.values[out.pos] = left_values[ii];
+						++out.pos;
+						break;
+					}
+				}
+			}
+			bool left_done = !Traits::less(right_keys[7], right_values[7], left_keys[7], left_values[7]);
+			bool right_done = !Traits::less(left_keys[7], left_values[7], right_keys[7], right_values[7]);
+			left.pos += left_done ? 8 : 0;
+			right.pos += right_done ? 8 : 0;
+		}
+		while (!left.empty() && !right.empty() && !out.empty()) {
+			key_t left_key = left.keys[left.pos], right_key = right.keys[right.pos];
+			value_t left_value = left.values[left.pos], right_value = right.values[right.pos];
+			if (Traits::less(left_key, left_value, right_key, right_value)) {
+				left.pos += count_before(left, right_key, right_value);
+			} else if (Traits::less(right_key, right_value, left_key, left_value)) {
+				right.pos += count_before(right, left_key, left_value);
+			} else {
+				out.keys[out.pos] = left_key;
+				out.values[out.pos] = left_value;
+				++out.pos;
+				++left.pos;
+				++right.pos;
+			}
+		}
+	}
+
+	/**
+	 * Writes entries in `left` which aren't in `right` to `out`, until either input runs out or `out`
+	 * fills up. Once `right` has run out for good the rest of `left` can just be copied.
+	 */
+	static void subtract(run_type& left, run_type& right, run_type& out) {
+		while (!left.empty() && !right.empty() && !out.empty()) {
+			key_t left_key = left.keys[left.pos], right_key = right.keys[right.pos];
+			value_t left_value = left.values[left.pos], right_value = right.values[right.pos];
+			if (Traits::less(left_key, left_value, right_key, right_value)) {
+				copy(left, out, std::min(count_before(left, right_key, right_value), out.remaining()));
+			} else if (Traits::less(right_key, right_value, left_key, left_value)) {
+				right.pos += count_before(right, left_key, left_value);
+			} else {
+				++left.pos;
+				++right.pos;
+			}
+		}
+	}
+};
+
+#endif
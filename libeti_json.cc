@@ -0,0 +1,275 @@
+#include "libeti_json.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace std;
+
+namespace eti {
+namespace json {
+
+// Nesting deeper than this is treated as malformed rather than risking the stack
+static const size_t max_depth = 256;
+
+static bool match(const char*& pos, const char* end, const char* literal, size_t length) {
+	if (size_t(end - pos) < length || memcmp(pos, literal, length) != 0) {
+		return false;
+	}
+	pos += length;
+	return true;
+}
+
+static bool read_hex(const char*& pos, const char* end, uint32_t& value) {
+	if (end - pos < 4) {
+		return false;
+	}
+	value = 0;
+	for (size_t ii = 0; ii < 4; ++ii) {
+		char digit = *pos++;
+		value <<= 4;
+		if (digit >= '0' && digit <= '9') {
+			value |= digit - '0';
+		} else if (digit >= 'a' && digit <= 'f') {
+			value |= digit - 'a' + 10;
+		} else if (digit >= 'A' && digit <= 'F') {
+			value |= digit - 'A' + 10;
+		} else {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void write_utf8(uint32_t code, string& out) {
+	if (code < 0x80) {
+		out.push_back(code);
+	} else if (code < 0x800) {
+		out.push_back(0xc0 | (code >> 6));
+		out.push_back(0x80 | (code & 0x3f));
+	} else if (code < 0x10000) {
+		out.push_back(0xe0 | (code >> 12));
+		out.push_back(0x80 | ((code >> 6) & 0x3f));
+		out.push_back(0x80 | (code & 0x3f));
+	} else {
+		out.push_back(0xf0 | (code >> 18));
+		out.push_back(0x80 | ((code >> 12) & 0x3f));
+		out.push_back(0x80 | ((code >> 6) & 0x3f));
+		out.push_back(0x80 | (code & 0x3f));
+	}
+}
+
+bool read_string(const char*& pos, const char* end, string& value) {
+	if (pos == end || *pos != '"') {
+		return false;
+	}
+	++pos;
+
+	// Most strings have no escapes and are copied out in one go
+	const char* run = pos;
+	while (pos != end && *pos != '"' && *pos != '\\') {
+		++pos;
+	}
+	value.assign(run, pos);
+	while (pos != end) {
+		if (*pos == '"') {
+			++pos;
+			return true;
+		}
+		++pos;
+		if (pos == end) {
+			return false;
+		}
+		switch (*pos++) {
+			case '"': value.push_back('"'); break;
+			case '\\': value.push_back('\\'); break;
+			case '/': value.push_back('/'); break;
+			case 'b': value.push_back('\b'); break;
+			case 'f': value.push_back('\f'); break;
+			case 'n': value.push_back('\n'); break;
+			case 'r': value.push_back('\r'); break;
+			case 't': value.push_back('\t'); break;
+			case 'u': {
+				uint32_t code;
+				if (!read_hex(pos, end, code)) {
+					return false;
+				}
+				if (code >= 0xd800 && code < 0xdc00 && end - pos >= 6 && pos[0] == '\\' && pos[1] == 'u') {
+					// Surrogate pair
+					const char* low_pos = pos + 2;
+					uint32_t low;
+					if (read_hex(low_pos, end, low) && low >= 0xdc00 && low < 0xe000) {
+						code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+						pos = low_pos;
+					}
+				}
+				write_utf8(code, value);
+				break;
+			}
+			default:
+				return false;
+		}
+		run = pos;
+		while (pos != end && *pos != '"' && *pos != '\\') {
+			++pos;
+		}
+		value.append(run, pos);
+	}
+	return false;
+}
+
+/**
+ * Integers are kept as integers when they fit in 64 bits, same as json_spirit: signed unless they're
+ * too big for that. Anything else is a double.
+ */
+static bool read_number(const char*& pos, const char* end, value_t& value) {
+	static const uint64_t max_signed = ~uint64_t(0) >> 1;
+	const char* start = pos;
+	bool negative = pos != end && *pos == '-';
+	if (negative) {
+		++pos;
+	}
+	const char* digits = pos;
+	uint64_t number = 0;
+	bool overflow = false;
+	while (pos != end && *pos >= '0' && *pos <= '9') {
+		uint64_t digit = *pos++ - '0';
+		if (number > (~uint64_t(0) - digit) / 10) {
+			overflow = true;
+		}
+		number = number * 10 + digit;
+	}
+	if (pos == digits) {
+		return false;
+	}
+	bool real = overflow;
+	if (pos != end && *pos == '.') {
+		real = true;
+		++pos;
+		while (pos != end && *pos >= '0' && *pos <= '9') {
+			++pos;
+		}
+	}
+	if (pos != end && (*pos == 'e' || *pos == 'E')) {
+		real = true;
+		++pos;
+		if (pos != end && (*pos == '+' || *pos == '-')) {
+			++pos;
+		}
+		while (pos != end && *pos >= '0' && *pos <= '9') {
+			++pos;
+		}
+	}
+	if (!real) {
+		if (!negative && number > max_signed) {
+			value = value_t(static_cast<uint64_t>(number));
+			return true;
+		} else if (!negative || number <= max_signed + 1) {
+			value = value_t(static_cast<int64_t>(negative ? -number : number));
+			return true;
+		}
+	}
+
+	// strtod needs a terminated string and the buffer isn't one
+	string text(start, pos);
+	char* parsed;
+	double number_real = strtod(text.c_str(), &parsed);
+	if (parsed != text.c_str() + text.length()) {
+		return false;
+	}
+	value = value_t(number_real);
+	return true;
+}
+
+static bool read(const char*& pos, const char* end, value_t& value, size_t depth) {
+	pos = skip_space(pos, end);
+	if (pos == end || depth > max_depth) {
+		return false;
+	}
+	switch (*pos) {
+		case '"': {
+			string str;
+			if (!read_string(pos, end, str)) {
+				return false;
+			}
+			value = value_t(str);
+			return true;
+		}
+		case '[': {
+			++pos;
+			value = value_t(json_spirit::mArray());
+			json_spirit::mArray& array = value.get_array();
+			pos = skip_space(pos, end);
+			if (pos != end && *pos == ']') {
+				++pos;
+				return true;
+			}
+			while (true) {
+				array.push_back(value_t());
+				if (!read(pos, end, array.back(), depth + 1)) {
+					return false;
+				}
+				pos = skip_space(pos, end);
+				if (pos == end) {
+					return false;
+				} else if (*pos == ',') {
+					++pos;
+				} else if (*pos == ']') {
+					++pos;
+					return true;
+				} else {
+					return false;
+				}
+			}
+		}
+		case '{': {
+			++pos;
+			value = value_t(json_spirit::mObject());
+			json_spirit::mObject& obj = value.get_obj();
+			pos = skip_space(pos, end);
+			if (pos != end && *pos == '}') {
+				++pos;
+				return true;
+			}
+			string key;
+			while (true) {
+				pos = skip_space(pos, end);
+				if (!read_string(pos, end, key)) {
+					return false;
+				}
+				pos = skip_space(pos, end);
+				if (pos == end || *pos++ != ':' || !read(pos, end, obj[key], depth + 1)) {
+					return false;
+				}
+				pos = skip_space(pos, end);
+				if (pos == end) {
+					return false;
+				} else if (*pos == ',') {
+					++pos;
+				} else if (*pos == '}') {
+					++pos;
+					return true;
+				} else {
+					return false;
+				}
+			}
+		}
+		case 't':
+			value = value_t(true);
+			return match(pos, end, "true", 4);
+		case 'f':
+			value = value_t(false);
+			return match(pos, end, "false", 5);
+		case 'n':
+			value = value_t();
+			return match(pos, end, "null", 4);
+		default:
+			return read_number(pos, end, value);
+	}
+}
+
+bool read(const char*& pos, const char* end, value_t& value) {
+	return read(pos, end, value, 0);
+}
+
+}
+}
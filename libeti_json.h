@@ -0,0 +1,39 @@
+#ifndef LIBETI_JSON_H
+#define LIBETI_JSON_H
+#include <string>
+#include <json_spirit.h>
+
+namespace eti {
+
+/**
+ * Hand-rolled JSON reader for the request stream. It works straight off the receive buffer in a single
+ * pass with no backtracking, which is a lot cheaper than json_spirit's parser. The envelope of each
+ * payload can be picked apart with skip_space() and read_string() so only the arguments are built
+ * into values.
+ */
+namespace json {
+
+typedef json_spirit::mValue value_t;
+
+/**
+ * Decodes one value starting at `pos`, which is moved past it. Returns false if the text is
+ * truncated or malformed, in which case `pos` is left somewhere in the middle.
+ */
+bool read(const char*& pos, const char* end, value_t& value);
+
+/**
+ * Decodes a string, `pos` must be at its opening quote.
+ */
+bool read_string(const char*& pos, const char* end, std::string& value);
+
+inline const char* skip_space(const char* pos, const char* end) {
+	while (pos != end && (*pos == ' ' || *pos == '\t' || *pos == '\r' || *pos == '\n')) {
+		++pos;
+	}
+	return pos;
+}
+
+}
+}
+
+#endif
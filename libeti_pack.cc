@@ -0,0 +1,220 @@
+#include "libeti_pack.h"
+#include <string.h>
+#include <boost/foreach.hpp>
+#define foreach BOOST_FOREACH
+
+using namespace std;
+
+namespace eti {
+namespace pack {
+
+enum type_t {
+	null_value,
+	false_value,
+	true_value,
+	int_value, // zigzag encoded
+	uint64_value,
+	real_value,
+	str_value,
+	array_value,
+	obj_value,
+	uint64_array_value // array of only uint64s, no type byte per item
+};
+
+// Nesting deeper than this is treated as malformed rather than risking the stack
+static const size_t max_depth = 256;
+
+void write_varint(uint64_t value, string& out) {
+	while (value >= 0x80) {
+		out.push_back((value & 0x7f) | 0x80);
+		value >>= 7;
+	}
+	out.push_back(value);
+}
+
+bool read_varint(const char*& pos, const char* end, uint64_t& value) {
+	value = 0;
+	for (size_t shift = 0; shift < 64 && pos != end; shift += 7) {
+		uint8_t byte = *pos++;
+		value |= uint64_t(byte & 0x7f) << shift;
+		if (!(byte & 0x80)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void write_str(const string& value, string& out) {
+	write_varint(value.length(), out);
+	out.append(value);
+}
+
+bool read_str(const char*& pos, const char* end, string& value) {
+	uint64_t length;
+	if (!read_varint(pos, end, length) || uint64_t(end - pos) < length) {
+		return false;
+	}
+	value.assign(pos, length);
+	pos += length;
+	return true;
+}
+
+void write(const value_t& value, string& out) {
+	switch (value.type()) {
+		case json_spirit::null_type:
+			out.push_back(null_value);
+			break;
+		case json_spirit::bool_type:
+			out.push_back(value.get_bool() ? true_value : false_value);
+			break;
+		case json_spirit::int_type:
+			if (value.is_uint64()) {
+				out.push_back(uint64_value);
+				write_varint(value.get_uint64(), out);
+			} else {
+				int64_t number = value.get_int64();
+				out.push_back(int_value);
+				write_varint((uint64_t(number) << 1) ^ uint64_t(number >> 63), out);
+			}
+			break;
+		case json_spirit::real_type: {
+			double number = value.get_real();
+			out.push_back(real_value);
+			out.append(reinterpret_cast<const char*>(&number), sizeof(number));
+			break;
+		}
+		case json_spirit::str_type:
+			out.push_back(str_value);
+			write_str(value.get_str(), out);
+			break;
+		case json_spirit::array_type: {
+			const json_spirit::mArray& array = value.get_array();
+			bool uint64_array = !array.empty();
+			foreach (const value_t& item, array) {
+				if (item.type() != json_spirit::int_type || !item.is_uint64()) {
+					uint64_array = false;
+					break;
+				}
+			}
+			out.push_back(uint64_array ? uint64_array_value : array_value);
+			write_varint(array.size(), out);
+			foreach (const value_t& item, array) {
+				if (uint64_array) {
+					write_varint(item.get_uint64(), out);
+				} else {
+					write(item, out);
+				}
+			}
+			break;
+		}
+		case json_spirit::obj_type: {
+			typedef pair<const string, value_t> pair_t;
+			out.push_back(obj_value);
+			write_varint(value.get_obj().size(), out);
+			foreach (const pair_t& item, value.get_obj()) {
+				write_str(item.first, out);
+				write(item.second, out);
+			}
+			break;
+		}
+	}
+}
+
+static bool read(const char*& pos, const char* end, value_t& value, size_t depth) {
+	if (pos == end || depth > max_depth) {
+		return false;
+	}
+	uint64_t number;
+	switch (*pos++) {
+		case null_value:
+			value = value_t();
+			return true;
+		case false_value:
+			value = value_t(false);
+			return true;
+		case true_value:
+			value = value_t(true);
+			return true;
+		case int_value:
+			if (!read_varint(pos, end, number)) {
+				return false;
+			}
+			value = value_t(static_cast<int64_t>((number >> 1) ^ -(number & 1)));
+			return true;
+		case uint64_value:
+			if (!read_varint(pos, end, number)) {
+				return false;
+			}
+			value = value_t(static_cast<uint64_t>(number));
+			return true;
+		case real_value: {
+			double real;
+			if (size_t(end - pos) < sizeof(real)) {
+				return false;
+			}
+			memcpy(&real, pos, sizeof(real));
+			pos += sizeof(real);
+			value = value_t(real);
+			return true;
+		}
+		case str_value: {
+			string str;
+			if (!read_str(pos, end, str)) {
+				return false;
+			}
+			value = value_t(str);
+			return true;
+		}
+		case array_value: {
+			if (!read_varint(pos, end, number) || number > uint64_t(end - pos)) {
+				return false;
+			}
+			value = value_t(json_spirit::mArray(number));
+			json_spirit::mArray& array = value.get_array();
+			for (size_t ii = 0; ii < number; ++ii) {
+				if (!read(pos, end, array[ii], depth + 1)) {
+					return false;
+				}
+			}
+			return true;
+		}
+		case uint64_array_value: {
+			if (!read_varint(pos, end, number) || number > uint64_t(end - pos)) {
+				return false;
+			}
+			value = value_t(json_spirit::mArray(number));
+			json_spirit::mArray& array = value.get_array();
+			for (size_t ii = 0; ii < number; ++ii) {
+				uint64_t item;
+				if (!read_varint(pos, end, item)) {
+					return false;
+				}
+				array[ii] = value_t(static_cast<uint64_t>(item));
+			}
+			return true;
+		}
+		case obj_value: {
+			if (!read_varint(pos, end, number) || number > uint64_t(end - pos)) {
+				return false;
+			}
+			value = value_t(json_spirit::mObject());
+			json_spirit::mObject& obj = value.get_obj();
+			for (size_t ii = 0; ii < number; ++ii) {
+				string key;
+				if (!read_str(pos, end, key) || !read(pos, end, obj[key], depth + 1)) {
+					return false;
+				}
+			}
+			return true;
+		}
+		default:
+			return false;
+	}
+}
+
+bool read(const char*& pos, const char* end, value_t& value) {
+	return read(pos, end, value, 0);
+}
+
+}
+}
@@ -0,0 +1,42 @@
+#ifndef LIBETI_PACK_H
+#define LIBETI_PACK_H
+#include <string>
+#include <stdint.h>
+#include <json_spirit.h>
+
+namespace eti {
+
+/**
+ * Compact binary encoding of JSON values. Each value is a type byte followed by its data; integers
+ * and lengths are varints, so small numbers cost a byte. Arrays of nothing but uint64s, like lists of
+ * ids, leave out the type byte on each item. It's much cheaper to produce and parse than
+ * JSON text, which makes it a good fit for logs and anything else that isn't read by people.
+ */
+namespace pack {
+
+typedef json_spirit::mValue value_t;
+
+/**
+ * Appends the encoding of `value` to `out`.
+ */
+void write(const value_t& value, std::string& out);
+
+/**
+ * Decodes one value starting at `pos`, which is moved past it. Returns false if the data is
+ * truncated or malformed, in which case `pos` is left somewhere in the middle.
+ */
+bool read(const char*& pos, const char* end, value_t& value);
+
+void write_varint(uint64_t value, std::string& out);
+bool read_varint(const char*& pos, const char* end, uint64_t& value);
+
+/**
+ * Length-prefixed strings, the same as string values but without the type byte.
+ */
+void write_str(const std::string& value, std::string& out);
+bool read_str(const char*& pos, const char* end, std::string& value);
+
+}
+}
+
+#endif
@@ -0,0 +1,110 @@
+#include "libeti_scheduler.h"
+#include <algorithm>
+#include <boost/bind.hpp>
+
+using namespace std;
+
+namespace eti {
+
+Scheduler::Scheduler(size_t thread_count) : current(forget), next_thread(0), sleeping(0), stop(false) {
+	if (!thread_count) {
+		thread_count = max(1u, boost::thread::hardware_concurrency());
+	}
+	for (size_t ii = 0; ii < thread_count; ++ii) {
+		threads.push_back(new thread_t);
+	}
+	for (size_t ii = 0; ii < thread_count; ++ii) {
+		group.create_thread(boost::bind(&Scheduler::run, this, ii));
+	}
+}
+
+Scheduler::~Scheduler() {
+	{
+		boost::lock_guard<boost::mutex> lock(idle_lock);
+		stop = true;
+	}
+	idle.notify_all();
+	group.join_all();
+}
+
+void Scheduler::schedule(const task_t& task, lane_t lane) {
+	thread_t* thread = current.get();
+	if (!thread) {
+		thread = &threads[size_t(++next_thread) % threads.size()];
+	}
+	{
+		boost::lock_guard<boost::mutex> lock(thread->lock);
+		thread->lanes[lane].push_back(task);
+	}
+	++queued[lane].value;
+
+	// Sleepers check `queued` under this lock before waiting, so they can't miss the notify
+	boost::lock_guard<boost::mutex> lock(idle_lock);
+	if (sleeping) {
+		idle.notify_one();
+	}
+}
+
+Scheduler::stats_t Scheduler::stats() const {
+	stats_t stats;
+	stats.threads = threads.size();
+	for (size_t lane = 0; lane < lane_count; ++lane) {
+		// `queued` goes briefly negative when a task is taken before schedule() counted it
+		stats.queued[lane] = max(0L, long(queued[lane].value));
+		stats.executed[lane] = executed[lane].value;
+		stats.stolen[lane] = stolen[lane].value;
+	}
+	return stats;
+}
+
+/**
+ * Takes the next task for the thread at `index`: the oldest in its own highest non-empty lane, else
+ * the oldest in that lane of the first other thread that has one. Both ends of a queue are behind the
+ * same lock, so stealing from the front costs nothing extra and keeps tasks roughly in order.
+ */
+bool Scheduler::take(size_t index, task_t& task) {
+	for (size_t lane = 0; lane < lane_count; ++lane) {
+		if (queued[lane].value <= 0) {
+			continue;
+		}
+		for (size_t ii = 0; ii < threads.size(); ++ii) {
+			thread_t& thread = threads[(index + ii) % threads.size()];
+			boost::lock_guard<boost::mutex> lock(thread.lock);
+			deque<task_t>& tasks = thread.lanes[lane];
+			if (!tasks.empty()) {
+				task.swap(tasks.front());
+				tasks.pop_front();
+				--queued[lane].value;
+				++executed[lane].value;
+				if (ii) {
+					++stolen[lane].value;
+				}
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+void Scheduler::run(size_t index) {
+	current.reset(&threads[index]);
+	task_t task;
+	while (true) {
+		if (take(index, task)) {
+			task();
+			task.clear();
+			continue;
+		}
+		boost::unique_lock<boost::mutex> lock(idle_lock);
+		while (!stop && queued[high].value <= 0 && queued[low].value <= 0) {
+			++sleeping;
+			idle.wait(lock);
+			--sleeping;
+		}
+		if (stop && queued[high].value <= 0 && queued[low].value <= 0) {
+			return;
+		}
+	}
+}
+
+}
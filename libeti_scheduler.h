@@ -0,0 +1,91 @@
+#ifndef LIBETI_SCHEDULER_H
+#define LIBETI_SCHEDULER_H
+#include <deque>
+#include <boost/function.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/tss.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
+#include <boost/detail/atomic_count.hpp>
+
+namespace eti {
+
+/**
+ * Fixed pool of threads which run tasks handed to them by the server.
+ *
+ * Each thread has its own queues instead of everyone contending on a single one. Tasks scheduled from
+ * one of the pool's threads go on that thread's queue, anything else is dealt out round robin, and a
+ * thread that runs out of work steals from the others. Every queue is split into priority lanes and
+ * nothing is taken from a lower lane while there's work left in a higher one anywhere in the pool.
+ */
+class Scheduler {
+	public:
+		typedef boost::function<void()> task_t;
+
+		enum lane_t {
+			high,
+			low,
+			lane_count
+		};
+
+		struct stats_t {
+			size_t threads;
+			size_t queued[lane_count];
+			size_t executed[lane_count];
+			size_t stolen[lane_count];
+		};
+
+		/**
+		 * Starts `thread_count` threads, or one per core if 0.
+		 */
+		Scheduler(size_t thread_count = 0);
+
+		/**
+		 * Runs everything that's already been scheduled and then joins the threads.
+		 */
+		~Scheduler();
+
+		void schedule(const task_t& task, lane_t lane = high);
+
+		/**
+		 * Counters for monitoring. They're read without stopping anything so they're only approximate.
+		 */
+		stats_t stats() const;
+
+	private:
+		struct thread_t {
+			boost::mutex lock;
+			std::deque<task_t> lanes[lane_count];
+		};
+
+		struct counter_t {
+			boost::detail::atomic_count value;
+			counter_t() : value(0) {}
+		};
+
+		boost::ptr_vector<thread_t> threads;
+		boost::thread_group group;
+		boost::thread_specific_ptr<thread_t> current;
+		boost::detail::atomic_count next_thread;
+		counter_t queued[lane_count];
+		counter_t executed[lane_count];
+		counter_t stolen[lane_count];
+
+		boost::mutex idle_lock;
+		boost::condition_variable idle;
+		size_t sleeping;
+		bool stop;
+
+		void run(size_t index);
+		bool take(size_t index, task_t& task);
+		static void forget(thread_t*) {}
+
+		// Non-copyable
+		Scheduler(const Scheduler&);
+		Scheduler& operator=(const Scheduler&);
+};
+
+}
+
+#endif
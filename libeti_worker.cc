@@ -1,6 +1,10 @@
 #include "libeti_worker.h"
+#include "libeti_json.h"
+#include "libeti_pack.h"
 #include <errno.h>
+#include <stdint.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <boost/bind.hpp>
 #include <boost/foreach.hpp>
@@ -10,11 +14,14 @@ using namespace std;
 using namespace eti;
 
 struct ev_loop* Worker::my_loop = ev_default_loop(0);
+const char Worker::binary_magic[4] = {'\0', 'e', 't', 'i'};
+boost::mutex Worker::chunk_lock;
+std::vector<Worker::chunk_t*> Worker::free_chunks;
 
 /**
  * Listen on a unix socket. Returns a Worker::Server.
  */
-Worker::Server::ptr Worker::listen(const std::string& path) {
+Worker::Server::ptr Worker::listen(const std::string& path, size_t io_threads, size_t threads) {
 	int fd;
 	fd = socket(AF_UNIX, SOCK_STREAM, 0);
 	if (fd < 0) {
@@ -34,7 +41,54 @@ Worker::Server::ptr Worker::listen(const std::string& path) {
 		throw runtime_error("listen() error");
 	}
 
-	return Server::ptr(new Server(fd));
+	if (!io_threads) {
+		io_threads = max(1u, boost::thread::hardware_concurrency());
+	}
+	return Server::ptr(new Server(fd, io_threads, threads));
+}
+
+Worker::io_loop_t::io_loop_t(Server& server, struct ev_loop* loop) : loop(loop), server(server) {
+	ev_async_init(&wakeup, wakeup_cb);
+	wakeup.data = this;
+	ev_async_start(loop, &wakeup);
+}
+
+/**
+ * Runs one of the extra loops. The async watcher keeps it alive while there's nothing connected.
+ */
+void Worker::io_loop_t::run(struct ev_loop* loop) {
+	ev_loop(loop, 0);
+}
+
+/**
+ * Hands a newly accepted connection to this loop.
+ */
+void Worker::io_loop_t::post(int fd) {
+	{
+		boost::lock_guard<boost::mutex> guard(lock);
+		accepted.push_back(fd);
+	}
+	ev_async_send(loop, &wakeup);
+}
+
+/**
+ * Private function called by libev on the loop's own thread after another thread posted to it.
+ */
+void Worker::io_loop_t::wakeup_cb(struct ev_loop* loop, struct ev_async* watcher, int revents) {
+	io_loop_t& that = *static_cast<io_loop_t*>(watcher->data);
+	vector<int> my_accepted;
+	vector<Worker*> my_ready;
+	{
+		boost::lock_guard<boost::mutex> guard(that.lock);
+		my_accepted.swap(that.accepted);
+		my_ready.swap(that.ready);
+	}
+	foreach (int fd, my_accepted) {
+		new Worker(that, fd);
+	}
+	foreach (Worker* worker, my_ready) {
+		worker->flush();
+	}
 }
 
 /**
@@ -53,7 +107,7 @@ void Worker::Server::accept_cb(struct ev_loop* loop, struct ev_io* watcher, int
 		throw runtime_error("accept() error");
 	}
 
-	new Worker(that, client_fd);
+	that.loops[that.next_loop++ % that.loops.size()].post(client_fd);
 }
 
 /**
@@ -65,12 +119,15 @@ void Worker::fd_cb(struct ev_loop* loop, struct ev_io* watcher, int revents) {
 	}
 	Worker& that = *static_cast<Worker*>(watcher->data);
 
+	// Writes go first since a read can free the worker
+	if (revents & EV_WRITE) {
+		if (!that.write_cb()) {
+			return;
+		}
+	}
 	if (revents & EV_READ) {
 		that.read_cb();
 	}
-	if (revents & EV_WRITE) {
-		that.write_cb();
-	}
 }
 
 /**
@@ -78,9 +135,11 @@ void Worker::fd_cb(struct ev_loop* loop, struct ev_io* watcher, int revents) {
  */
 void Worker::read_cb() {
 
-	// Read data from the stream
-	char buf[read_size];
-	ssize_t len = recv(fd, buf, read_size, MSG_DONTWAIT);
+	// Read straight onto the end of whatever's left over from last time
+	if (read_buffer.size() < read_length + read_size) {
+		read_buffer.resize(read_length + read_size);
+	}
+	ssize_t len = recv(fd, &read_buffer[read_length], read_size, MSG_DONTWAIT);
 	if (!len) {
 		become_zombie();
 		return;
@@ -94,148 +153,536 @@ void Worker::read_cb() {
 		return;
 	}
 
-	// Loop through the read data looking for newline. If newline is found parse that and invoke a
-	// handler. Continue until no more newlines are around and then put that data in the buffer.
-	char* pos = buf;
-	for (size_t ii = 0; ii < len;) {
-		if (pos[ii] == '\n') {
-			value_t arguments;
-			read_buffer.append(pos, ii);
-			if (!json_spirit::read(read_buffer, arguments)) {
-				cerr <<"invalid payload\n";
-				read_buffer.clear();
-			} else {
-				read_buffer.clear();
-				handle_payload(arguments);
+	// A client that fills every read is streaming, so take bigger bites. Drop back down once it isn't.
+	if (size_t(len) == read_size && read_size < max_read_size) {
+		read_size *= 2;
+	} else if (size_t(len) < read_size / 4 && read_size > min_read_size) {
+		read_size /= 2;
+	}
+
+	read_length += len;
+	consume();
+}
+
+/**
+ * Handles the complete lines or frames in the read buffer, each parsed right out of it, and moves
+ * what's left of an incomplete one to the front. Stops and pauses reading if the connection goes over
+ * its limits. A line can hold any number of payloads, so they're counted against the limits one by
+ * one and the rest of a line which goes over waits in `pending_payloads`, ahead of anything else.
+ * Runs on the owning loop. Returns false if the connection was closed.
+ */
+bool Worker::consume() {
+	if (!dispatch_pending()) {
+		pause_reading();
+		return true;
+	}
+	if (!read_length) {
+		return true;
+	}
+	if (protocol == unknown_protocol) {
+		negotiate();
+		if (protocol == unknown_protocol) {
+			return true;
+		}
+	}
+
+	const char* data = &read_buffer[0];
+	const char* pos = data;
+	const char* end = data + read_length;
+	bool over = false;
+	if (protocol == binary_protocol) {
+		while (end - pos >= 4 && !(over = over_limit())) {
+			const uint8_t* header = reinterpret_cast<const uint8_t*>(pos);
+			size_t length = header[0] | (header[1] << 8) | (header[2] << 16) | (uint32_t(header[3]) << 24);
+			if (length > max_frame_size) {
+				cerr <<"frame too large\n";
+				become_zombie();
+				return false;
 			}
-			pos += ii + 1;
-			len -= ii + 1;
-			ii = 0;
-			continue;
-		} else {
-			++ii;
+			if (size_t(end - pos) - 4 < length) {
+				break;
+			}
+			handle_frame(pos + 4, pos + 4 + length);
+			pos += 4 + length;
+		}
+	} else {
+		// Only data that came in since last time needs to be searched for newlines
+		const char* scan = data + read_scanned;
+		while (!(over = over_limit())) {
+			const char* newline = static_cast<const char*>(memchr(scan, '\n', end - scan));
+			if (!newline) {
+				break;
+			}
+			bool done = handle_line(pos, newline);
+			pos = scan = newline + 1;
+			if (!done) {
+				over = true;
+				break;
+			}
+		}
+		if (!over && size_t(end - pos) > max_frame_size) {
+			cerr <<"line too long\n";
+			become_zombie();
+			return false;
 		}
 	}
-	if (len) {
-		read_buffer.append(pos, len);
+	read_length = end - pos;
+	read_scanned = over ? 0 : read_length;
+	if (pos != data && read_length) {
+		memmove(&read_buffer[0], pos, read_length);
+	}
+	if (read_buffer.size() > 2 * max_read_size && read_length < max_read_size) {
+		// Don't hang on to the memory from an unusually long line
+		std::vector<char>(read_buffer.begin(), read_buffer.begin() + read_length).swap(read_buffer);
+	}
+
+	if (over) {
+		pause_reading();
 	}
+	return true;
 }
 
 /**
- * send() is ok to call.
+ * Handles payloads held back from a line while the connection is under its limits. Returns false if
+ * some are still waiting.
  */
-void Worker::write_cb() {
+bool Worker::dispatch_pending() {
+	while (!pending_payloads.empty()) {
+		if (over_limit()) {
+			return false;
+		}
+		payload_t payload = pending_payloads.front();
+		pending_payloads.pop_front();
+		handle_payload(payload);
+	}
+	return true;
+}
+
+/**
+ * Stops reading until responses are written out. Checks again under the lock since a response might
+ * have gone out in the meantime, and after this respond() will see `paused` and wake us. If one did,
+ * drain() picks up where consume() stopped straight away.
+ */
+void Worker::pause_reading() {
 	boost::lock_guard<boost::mutex> lock(write_lock);
+	paused = true;
+	if (over_limit()) {
+		update_watcher();
+	} else {
+		post();
+	}
+}
+
+/**
+ * Whether the client has more requests in flight or more output waiting to be read than it's
+ * allowed.
+ */
+bool Worker::over_limit() const {
+	return
+		size_t(outstanding_reqs) >= server.max_outstanding ||
+		output_bytes.load(boost::memory_order_relaxed) >= server.max_output;
+}
+
+/**
+ * send() is ok to call. Returns false if the connection was closed.
+ */
+bool Worker::write_cb() {
+	boost::unique_lock<boost::mutex> lock(write_lock);
+	return drain(lock);
+}
+
+/**
+ * Sends queued output and goes back to reading if that brought a paused connection back under its
+ * limits. Runs on the owning loop with write_lock held, and releases it. Returns false if the
+ * connection was closed.
+ */
+bool Worker::drain(boost::unique_lock<boost::mutex>& lock) {
+	if (!write_out()) {
+		lock.unlock();
+		become_zombie();
+		return false;
+	}
+	bool resume = paused && !over_limit();
+	if (resume) {
+		paused = false;
+	}
+	update_watcher();
+	lock.unlock();
+	if (resume) {
+		// Requests which came in before the pause are still sitting in the read buffer
+		return consume();
+	}
+	return true;
+}
+
+/**
+ * Sends as much of the queued output as the socket will take, up to `max_iov` chunks per syscall.
+ * Called on the owning loop with write_lock held. Returns false if the connection is broken.
+ */
+bool Worker::write_out() {
 	while (!write_buffer.empty()) {
-		buffer_t& buffer = write_buffer.front();
-		ssize_t wrote = send(fd, buffer.data + buffer.offset, buffer.length, MSG_DONTWAIT);
-		if (wrote != buffer.length) {
-			if (wrote == -1) {
-				if (errno == EAGAIN) {
-					wrote = 0;
-				} else {
-					cerr <<"send err: " <<errno <<"\n";
-					become_zombie();
-					return;
-				}
+		struct iovec iov[max_iov];
+		size_t count = 0;
+		for (deque<chunk_t*>::iterator ii = write_buffer.begin(); ii != write_buffer.end() && count < max_iov; ++ii) {
+			iov[count].iov_base = (*ii)->data + (*ii)->begin;
+			iov[count].iov_len = (*ii)->end - (*ii)->begin;
+			++count;
+		}
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
+		ssize_t wrote = sendmsg(fd, &msg, MSG_DONTWAIT);
+		if (wrote == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return true;
+			} else if (errno == EINTR) {
+				continue;
 			}
-			buffer.offset += wrote;
-			buffer.length -= wrote;
-			return;
-		} else {
+			cerr <<"send err: " <<errno <<"\n";
+			return false;
+		}
+
+		// Recycle the chunks that went out completely
+		output_bytes.fetch_sub(wrote, boost::memory_order_relaxed);
+		size_t remaining = wrote;
+		while (remaining) {
+			chunk_t* chunk = write_buffer.front();
+			size_t length = chunk->end - chunk->begin;
+			if (remaining < length) {
+				chunk->begin += remaining;
+				break;
+			}
+			remaining -= length;
 			write_buffer.pop_front();
+			release_chunk(chunk);
+		}
+	}
+	return true;
+}
+
+/**
+ * Watches for reads unless the connection is paused, and for writability only while there's output
+ * the socket hasn't taken yet. Called on the owning loop with write_lock held.
+ */
+void Worker::update_watcher() {
+	int events = (paused ? 0 : EV_READ) | (write_buffer.empty() ? 0 : EV_WRITE);
+	if (events != watching) {
+		watching = events;
+		ev_io_stop(io.loop, &fd_watcher);
+		if (events) {
+			ev_io_set(&fd_watcher, fd, events);
+			ev_io_start(io.loop, &fd_watcher);
+		}
+	}
+}
+
+Worker::chunk_t* Worker::allocate_chunk() {
+	chunk_t* chunk = NULL;
+	{
+		boost::lock_guard<boost::mutex> lock(chunk_lock);
+		if (!free_chunks.empty()) {
+			chunk = free_chunks.back();
+			free_chunks.pop_back();
+		}
+	}
+	if (!chunk) {
+		chunk = new chunk_t;
+	}
+	chunk->begin = chunk->end = 0;
+	return chunk;
+}
+
+void Worker::release_chunk(chunk_t* chunk) {
+	{
+		boost::lock_guard<boost::mutex> lock(chunk_lock);
+		if (free_chunks.size() < max_free_chunks) {
+			free_chunks.push_back(chunk);
+			return;
 		}
 	}
-	ev_io_stop(my_loop, &fd_watcher);
-	ev_io_set(&fd_watcher, fd, EV_READ);
-	ev_io_start(my_loop, &fd_watcher);
+	delete chunk;
 }
 
-void Worker::handle_payload(const value_t& value) {
-	const vector<value_t>& payloads = value.get_array();
-	foreach (const value_t& payload, payloads) {
-		const string& type = payload.get_obj().find("type")->second.get_str();
-		const string& name = payload.get_obj().find("name")->second.get_str();
-		const vector<value_t>& args = payload.get_obj().find("data")->second.get_array();
-		if (type == "request") {
-			map<const string, Server::request_handler_t>::iterator ii = server.request_handlers.find(name);
-			if (ii == server.request_handlers.end()) {
-				throw runtime_error("unknown request received");
+/**
+ * Asks the owning loop to call flush(). Called with write_lock held from any thread.
+ */
+void Worker::post() {
+	{
+		boost::lock_guard<boost::mutex> lock(io.lock);
+		if (queued) {
+			return;
+		}
+		queued = true;
+		io.ready.push_back(this);
+	}
+	ev_async_send(io.loop, &io.wakeup);
+}
+
+/**
+ * Runs on the owning loop after post(). Sends everything responded since the last time, watching for
+ * writability if the socket doesn't take all of it, or finishes off a closed connection once nothing
+ * refers to it anymore.
+ */
+void Worker::flush() {
+	boost::unique_lock<boost::mutex> lock(write_lock);
+	{
+		boost::lock_guard<boost::mutex> io_lock(io.lock);
+		queued = false;
+	}
+	if (closed) {
+		if (!outstanding_reqs) {
+			lock.unlock();
+			delete this;
+		}
+		return;
+	}
+	drain(lock);
+}
+
+/**
+ * Picks apart the payloads in a line: an array of objects with "type", "name", "data" and, for
+ * requests, "uniq". Only the "data" of each is built into values, and that's moved into the arguments
+ * rather than copied. Returns false if the line is malformed.
+ */
+bool Worker::read_payloads(const char* pos, const char* end, vector<payload_t>& payloads) {
+	pos = json::skip_space(pos, end);
+	if (pos == end || *pos++ != '[') {
+		return false;
+	}
+	pos = json::skip_space(pos, end);
+	if (pos != end && *pos == ']') {
+		return json::skip_space(pos + 1, end) == end;
+	}
+	string key;
+	while (true) {
+		pos = json::skip_space(pos, end);
+		if (pos == end || *pos++ != '{') {
+			return false;
+		}
+		payloads.push_back(payload_t());
+		payload_t& payload = payloads.back();
+		bool has_args = false;
+		while (true) {
+			pos = json::skip_space(pos, end);
+			if (!json::read_string(pos, end, key)) {
+				return false;
 			}
-			++this->outstanding_reqs;
-			server.threads.schedule(boost::bind(
-				Worker::Server::request_wrapper,
-				ii->second,
-				this,
-				payload.get_obj().find("uniq")->second.get_str(),
-				args
-			));
-		} else if (type == "message") {
-			map<const string, Server::message_handler_t>::iterator ii = server.message_handlers.find(name);
-			if (ii == server.message_handlers.end()) {
-				throw runtime_error("unknown message received");
+			pos = json::skip_space(pos, end);
+			if (pos == end || *pos++ != ':') {
+				return false;
+			}
+			pos = json::skip_space(pos, end);
+			bool ok;
+			if (key == "type") {
+				ok = json::read_string(pos, end, payload.type);
+			} else if (key == "name") {
+				ok = json::read_string(pos, end, payload.name);
+			} else if (key == "uniq") {
+				ok = json::read_string(pos, end, payload.uniq);
+			} else {
+				Worker::value_t value;
+				ok = json::read(pos, end, value);
+				if (ok && key == "data") {
+					if (value.type() != json_spirit::array_type) {
+						return false;
+					}
+					std::vector<Worker::value_t>* args = new std::vector<Worker::value_t>;
+					payload.args.reset(args);
+					args->swap(value.get_array());
+					has_args = true;
+				}
 			}
+			if (!ok) {
+				return false;
+			}
+			pos = json::skip_space(pos, end);
+			if (pos == end) {
+				return false;
+			} else if (*pos == ',') {
+				++pos;
+			} else if (*pos++ == '}') {
+				break;
+			} else {
+				return false;
+			}
+		}
+		if (!has_args) {
+			return false;
+		}
+		pos = json::skip_space(pos, end);
+		if (pos == end) {
+			return false;
+		} else if (*pos == ',') {
+			++pos;
+		} else if (*pos++ == ']') {
+			return json::skip_space(pos, end) == end;
+		} else {
+			return false;
+		}
+	}
+}
+
+/**
+ * Decides which protocol the connection speaks from the first bytes it sent.
+ */
+void Worker::negotiate() {
+	size_t length = min(read_length, sizeof(binary_magic));
+	if (memcmp(&read_buffer[0], binary_magic, length) != 0) {
+		protocol = json_protocol;
+	} else if (length == sizeof(binary_magic)) {
+		protocol = binary_protocol;
+		read_length -= length;
+		memmove(&read_buffer[0], &read_buffer[length], read_length);
+		boost::lock_guard<boost::mutex> lock(write_lock);
+		queue_write(string(binary_magic, sizeof(binary_magic)));
+	}
+}
+
+/**
+ * Handles the payloads on a line while the connection is under its limits. Returns false if that ran
+ * out before the end of the line, in which case the rest are left in `pending_payloads`.
+ */
+bool Worker::handle_line(const char* pos, const char* end) {
+	vector<payload_t> payloads;
+	if (!read_payloads(pos, end, payloads)) {
+		cerr <<"invalid payload\n";
+		return true;
+	}
+	pending_payloads.insert(pending_payloads.end(), payloads.begin(), payloads.end());
+	return dispatch_pending();
+}
+
+void Worker::handle_frame(const char* pos, const char* end) {
+	payload_t payload;
+	uint8_t type = pos == end ? 0xff : *pos++;
+	value_t data;
+	if (
+		(type != request_frame && type != message_frame) ||
+		!pack::read_str(pos, end, payload.name) ||
+		!pack::read_str(pos, end, payload.uniq) ||
+		!pack::read(pos, end, data) ||
+		data.type() != json_spirit::array_type ||
+		pos != end
+	) {
+		cerr <<"invalid frame\n";
+		return;
+	}
+	payload.type = type == request_frame ? "request" : "message";
+	std::vector<value_t>* args = new std::vector<value_t>;
+	payload.args.reset(args);
+	args->swap(data.get_array());
+	handle_payload(payload);
+}
+
+void Worker::handle_payload(const payload_t& payload) {
+	if (payload.type == "request") {
+		map<const string, Server::request_handler_t>::iterator ii = server.request_handlers.find(payload.name);
+		if (ii == server.request_handlers.end()) {
+			throw runtime_error("unknown request received");
+		}
+		++this->outstanding_reqs;
+		server.threads.schedule(boost::bind(
+			Worker::Server::request_wrapper,
+			ii->second,
+			this,
+			payload.uniq,
+			payload.args
+		), Scheduler::high);
+	} else if (payload.type == "message") {
+		map<const string, pair<Server::message_handler_t, Server::dispatch_t> >::iterator ii = server.message_handlers.find(payload.name);
+		if (ii == server.message_handlers.end()) {
+			throw runtime_error("unknown message received");
+		}
+		if (ii->second.second == Server::immediate) {
+			Worker::Server::message_wrapper(ii->second.first, this, payload.args);
+		} else {
 			server.threads.schedule(boost::bind(
 				Worker::Server::message_wrapper,
-				ii->second,
+				ii->second.first,
 				this,
-				args)
-			);
-		} else {
-			throw runtime_error("unknown payload received");
+				payload.args
+			), Scheduler::low);
 		}
+	} else {
+		throw runtime_error("unknown payload received");
 	}
 }
 
-void Worker::Server::request_wrapper(request_handler_t fn, Worker* worker, const request_handle_t handle, const std::vector<value_t> args) {
+void Worker::Server::request_wrapper(request_handler_t fn, Worker* worker, const request_handle_t handle, shared_args_t args) {
 	try {
-		fn(*worker, handle, args);
+		fn(*worker, handle, *args);
 	} catch (runtime_error const &err) {
 		worker->respond(handle, err.what(), true);
 	}
 }
 
-void Worker::Server::message_wrapper(message_handler_t fn, Worker* worker, const std::vector<value_t> args) {
-	fn(*worker, args);
+void Worker::Server::message_wrapper(message_handler_t fn, Worker* worker, shared_args_t args) {
+	try {
+		fn(*worker, *args);
+	} catch (runtime_error const &err) {
+		cerr <<"message err: " <<err.what() <<"\n";
+	}
 }
 
 void Worker::respond(const request_handle_t& handle, const value_t& value, bool threw) {
-	string response(threw ? "[{\"type\":\"threw\",\"uniq\":\"" : "[{\"type\":\"resolved\",\"uniq\":\"");
-	response += handle + "\",\"data\":";
-	response += json_spirit::write(value);
-	response += "}]\n";
-	const char* buf = response.c_str();
+	string response;
+	if (protocol == binary_protocol) {
+		response.resize(4);
+		response.push_back(threw ? threw_frame : resolved_frame);
+		pack::write_str(handle, response);
+		pack::write(value, response);
+		uint32_t length = response.size() - 4;
+		for (size_t ii = 0; ii < 4; ++ii) {
+			response[ii] = length >> (ii * 8);
+		}
+	} else {
+		response = threw ? "[{\"type\":\"threw\",\"uniq\":\"" : "[{\"type\":\"resolved\",\"uniq\":\"";
+		response += handle + "\",\"data\":";
+		response += json_spirit::write(value);
+		response += "}]\n";
+	}
 	{
 		boost::unique_lock<boost::mutex> lock(write_lock);
 		assert(--this->outstanding_reqs >= 0);
+		if (paused && !over_limit()) {
+			post();
+		}
 		if (closed) {
 			// This check to outstanding_reqs is *not* thread safe. However, since this code is only
 			// invoked in the `closed` case, no threads will be incrementing outstanding_reqs, only the
-			// decrement above which is blocked with an exclusive lock.
+			// decrement above which is blocked with an exclusive lock. The owning loop does the delete so
+			// it can't happen while it's still holding on to us.
 			if (!this->outstanding_reqs) {
-				lock.unlock();
-				delete this;
+				post();
 			}
 			return;
 		}
-		ssize_t wrote = 0;
-		if (write_buffer.empty()) {
-			wrote = send(fd, buf, response.length(), MSG_DONTWAIT);
-		}
-		if (wrote != response.length()) {
-			if (wrote == -1) {
-				if (errno == EAGAIN) {
-					wrote = 0;
-				} else {
-					close(fd);
-					cerr <<"send err: " <<errno <<"\n";
-					return;
-				}
-			}
-			write_buffer.push_back(new buffer_t(buf + wrote, response.length() - wrote));
-			ev_io_stop(my_loop, &fd_watcher);
-			ev_io_set(&fd_watcher, fd, EV_READ | EV_WRITE);
-			ev_io_start(my_loop, &fd_watcher);
+		queue_write(response);
+	}
+}
+
+/**
+ * Copies `data` onto the end of the output and has the owning loop send it. Everything queued before
+ * the loop gets to it goes out together. Called with write_lock held.
+ */
+void Worker::queue_write(const string& data) {
+	const char* pos = data.data();
+	size_t remaining = data.length();
+	while (remaining) {
+		if (write_buffer.empty() || write_buffer.back()->end == chunk_size) {
+			write_buffer.push_back(allocate_chunk());
 		}
+		chunk_t& chunk = *write_buffer.back();
+		size_t length = min(remaining, chunk_size - chunk.end);
+		memcpy(chunk.data + chunk.end, pos, length);
+		chunk.end += length;
+		pos += length;
+		remaining -= length;
+	}
+	output_bytes.fetch_add(data.length(), boost::memory_order_relaxed);
+	if (!(watching & EV_WRITE)) {
+		// Otherwise the write watcher will pick it up
+		post();
 	}
 }
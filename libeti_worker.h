@@ -1,9 +1,21 @@
+#include "libeti_scheduler.h"
+#include <deque>
 #include <string>
 #include <string.h>
-#include <boost/threadpool.hpp>
+#include <signal.h>
+#include <iostream>
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/thread/mutex.hpp>
-#include <boost/ptr_container/ptr_deque.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
 #include <boost/detail/atomic_count.hpp>
+#include <boost/atomic.hpp>
 #include <ev.h>
 #include <json_spirit.h>
 
@@ -14,53 +26,146 @@ class Worker {
 		class Server;
 		typedef json_spirit::mValue value_t;
 		typedef std::string request_handle_t;
+		typedef boost::shared_ptr<const std::vector<value_t> > shared_args_t;
 
 	private:
-		struct buffer_t {
-			char* data;
-			size_t offset;
-			size_t length;
-			buffer_t(const char* my_data, size_t length) : offset(0), length(length) {
-				data = new char[length];
-				memcpy(data, my_data, length);
-			};
-			~buffer_t() {
-				delete[] data;
-			}
+		/**
+		 * Piece of a connection's output. Responses are copied onto the end of the last chunk and the
+		 * owning loop sends out as many chunks as it can in one syscall. Chunks are recycled through a
+		 * free list shared by all connections instead of going back to the allocator.
+		 */
+		static const size_t chunk_size = 16 * 1024;
+		static const size_t max_free_chunks = 1024;
+		static const size_t max_iov = 64;
+		struct chunk_t {
+			size_t begin;
+			size_t end;
+			char data[chunk_size];
+		};
+		static boost::mutex chunk_lock;
+		static std::vector<chunk_t*> free_chunks;
+		static chunk_t* allocate_chunk();
+		static void release_chunk(chunk_t* chunk);
+
+		/**
+		 * An event loop and the thread which runs it. Connections are spread over several of these so
+		 * reading and writing scale with cores. A connection's watcher is only ever touched from the
+		 * thread of the loop which owns it; other threads hand it work through `wakeup`.
+		 */
+		struct io_loop_t {
+			struct ev_loop* loop;
+			Server& server;
+			ev_async wakeup;
+			boost::mutex lock;
+			std::vector<int> accepted;
+			std::vector<Worker*> ready;
+
+			io_loop_t(Server& server, struct ev_loop* loop);
+			void post(int fd);
+			static void run(struct ev_loop* loop);
+			static void wakeup_cb(struct ev_loop* loop, struct ev_async* watcher, int revents);
 		};
 
-		static const size_t read_size = 4096;
-		std::string read_buffer;
-		boost::ptr_deque<buffer_t> write_buffer;
+		/**
+		 * Connections speak newline-delimited JSON unless the first thing they send is `binary_magic`.
+		 * The server sends it back and then both sides switch to length-prefixed frames: a 4 byte
+		 * little-endian length and then a frame type byte, the name (requests and messages only) and
+		 * the uniq as length-prefixed strings, and the data in eti::pack encoding.
+		 */
+		enum protocol_t {
+			unknown_protocol,
+			json_protocol,
+			binary_protocol
+		};
+		enum frame_type_t {
+			request_frame,
+			message_frame,
+			resolved_frame,
+			threw_frame
+		};
+		static const char binary_magic[4];
+		static const size_t max_frame_size = 64 * 1024 * 1024;
+		protocol_t protocol;
+
+		struct payload_t {
+			std::string type;
+			std::string name;
+			std::string uniq;
+			shared_args_t args;
+		};
+
+		// recv() sizes adapt between these depending on how much data the client is sending
+		static const size_t min_read_size = 4096;
+		static const size_t max_read_size = 256 * 1024;
+		std::vector<char> read_buffer;
+		size_t read_length;
+		size_t read_scanned;
+		size_t read_size;
+		// What's left of a line whose payloads took the connection over its limits, see consume()
+		std::deque<payload_t> pending_payloads;
+		std::deque<chunk_t*> write_buffer;
+		boost::atomic<size_t> output_bytes;
 		boost::mutex write_lock;
 
 		static struct ev_loop* my_loop;
 		int fd;
 		Server& server;
+		io_loop_t& io;
 		struct ev_io fd_watcher;
 		boost::detail::atomic_count outstanding_reqs;
 		bool closed;
+		bool queued;
+		bool paused;
+		int watching;
 
 		static void fd_cb(struct ev_loop* loop, struct ev_io* watcher, int revents);
 		void read_cb();
-		void write_cb();
-		void handle_payload(const value_t& value);
+		bool write_cb();
+		bool write_out();
+		bool drain(boost::unique_lock<boost::mutex>& lock);
+		bool consume();
+		bool dispatch_pending();
+		void pause_reading();
+		bool over_limit() const;
+		void update_watcher();
+		void post();
+		void flush();
+		void queue_write(const std::string& data);
+		void negotiate();
+		bool handle_line(const char* pos, const char* end);
+		void handle_frame(const char* pos, const char* end);
+		void handle_payload(const payload_t& payload);
+		static bool read_payloads(const char* pos, const char* end, std::vector<payload_t>& payloads);
 
 		/**
-		 * Private constructer called by Server.
+		 * Private constructer called on the thread of the loop which will own this connection.
 		 */
-		Worker(Server& server, int fd) : server(server), fd(fd), outstanding_reqs(0), closed(false) {
+		Worker(io_loop_t& io, int fd) : protocol(unknown_protocol), read_length(0), read_scanned(0), read_size(min_read_size), output_bytes(0), fd(fd), server(io.server), io(io), outstanding_reqs(0), closed(false), queued(false), paused(false), watching(EV_READ) {
 			ev_io_init(&fd_watcher, fd_cb, fd, EV_READ);
 			fd_watcher.data = this;
-			ev_io_start(Worker::my_loop, &fd_watcher);
+			ev_io_start(io.loop, &fd_watcher);
+		}
+
+		~Worker() {
+			while (!write_buffer.empty()) {
+				release_chunk(write_buffer.front());
+				write_buffer.pop_front();
+			}
 		}
 
 		void become_zombie() {
 			boost::unique_lock<boost::mutex> lock(write_lock);
 			closed = true;
-			ev_io_stop(my_loop, &fd_watcher);
+			ev_io_stop(io.loop, &fd_watcher);
 			close(fd);
 			if (!outstanding_reqs) {
+				{
+					// A pending flush() still holds a pointer to us and will clean up instead
+					boost::lock_guard<boost::mutex> io_lock(io.lock);
+					if (queued) {
+						return;
+					}
+				}
 				lock.unlock();
 				delete this;
 			}
@@ -76,23 +181,40 @@ class Worker {
 				typedef void (*request_handler_t)(Worker& worker, const request_handle_t& handle, const std::vector<value_t>& args);
 				typedef void (*message_handler_t)(Worker& worker, const std::vector<value_t>& args);
 
+				/**
+				 * Where a message handler runs. `pooled` handlers run on the thread pool and may take their
+				 * time, but messages can be handled out of order. `immediate` handlers run on the connection's
+				 * own event loop in the order the messages arrived, and should only queue up the real work.
+				 */
+				enum dispatch_t {
+					pooled,
+					immediate
+				};
+
 			private:
 				int fd;
 				struct ev_io accept_watcher;
-				boost::threadpool::pool threads;
+				boost::ptr_vector<io_loop_t> loops;
+				size_t next_loop;
+				boost::thread_group io_threads;
+				Scheduler threads;
+				size_t max_outstanding;
+				size_t max_output;
 
 				std::map<const std::string, request_handler_t> request_handlers;
-				std::map<const std::string, message_handler_t> message_handlers;
+				std::map<const std::string, std::pair<message_handler_t, dispatch_t> > message_handlers;
 
 				static void accept_cb(struct ev_loop* loop, struct ev_io* watcher, int revents);
-				static void request_wrapper(request_handler_t fn, Worker* worker, const request_handle_t handle, const std::vector<value_t> args);
-				static void message_wrapper(message_handler_t fn, Worker* worker, const std::vector<value_t> args);
+				static void request_wrapper(request_handler_t fn, Worker* worker, const request_handle_t handle, shared_args_t args);
+				static void message_wrapper(message_handler_t fn, Worker* worker, shared_args_t args);
 
 				/**
 				 * Takes an existing listening fd and accepts new connections. Each new connection is allocated its
-				 * own Worker instance with event handlers inherited from the server.
+				 * own Worker instance with event handlers inherited from the server, and handed to one of
+				 * `loop_count` event loops in turn. The default loop is one of them and runs on the thread which
+				 * calls Worker::loop(); the rest get their own threads. Handlers run on `thread_count` threads.
 				 */
-				Server(int fd) : fd(fd), threads(10) {
+				Server(int fd, size_t loop_count, size_t thread_count) : fd(fd), next_loop(0), threads(thread_count), max_outstanding(1024), max_output(32 * 1024 * 1024) {
 					// Ignore SIGPIPE. The internet says it's safe/recommended to do this.
 					struct sigaction sa;
 					sa.sa_handler = SIG_IGN;
@@ -104,6 +226,16 @@ class Worker {
 					ev_io_init(&accept_watcher, accept_cb, fd, EV_READ);
 					accept_watcher.data = this;
 					ev_io_start(Worker::my_loop, &accept_watcher);
+
+					loops.push_back(new io_loop_t(*this, Worker::my_loop));
+					for (size_t ii = 1; ii < loop_count; ++ii) {
+						struct ev_loop* loop = ev_loop_new(EVFLAG_AUTO);
+						if (!loop) {
+							throw std::runtime_error("ev_loop_new() error");
+						}
+						loops.push_back(new io_loop_t(*this, loop));
+						io_threads.create_thread(boost::bind(io_loop_t::run, loop));
+					}
 				}
 
 			public:
@@ -111,15 +243,33 @@ class Worker {
 					request_handlers[request] = handler;
 				}
 
-				void register_handler(const std::string& message, const message_handler_t& handler) {
-					message_handlers[message] = handler;
+				void register_handler(const std::string& message, const message_handler_t& handler, dispatch_t dispatch = pooled) {
+					message_handlers[message] = std::make_pair(handler, dispatch);
+				}
+
+				/**
+				 * A connection with `max_outstanding` requests in flight, or `max_output` bytes of responses
+				 * it hasn't read yet, isn't read from until it's back under both. Call before Worker::loop().
+				 */
+				void set_limits(size_t max_outstanding, size_t max_output) {
+					this->max_outstanding = std::max<size_t>(max_outstanding, 1);
+					this->max_output = std::max<size_t>(max_output, 1);
+				}
+
+				Scheduler::stats_t stats() const {
+					return threads.stats();
 				}
 		};
 
 		/**
-		 * Factory which generates a worker listening on a unix file socket.
+		 * Factory which generates a worker listening on a unix file socket. Connections are served by
+		 * `io_threads` event loops and handlers run on `threads` threads, one per core for either if 0.
 		 */
-		static Server::ptr listen(const std::string& path);
+		static Server::ptr listen(const std::string& path, size_t io_threads = 0, size_t threads = 0);
+
+		const Server& get_server() const {
+			return server;
+		}
 
 		/**
 		 * Respond to a request from request_handler via the request_handle.
@@ -127,7 +277,7 @@ class Worker {
 		void respond(const request_handle_t& handle, const value_t& value, bool threw = false);
 
 		/**
-		 * Run the ev_loop
+		 * Run the default ev_loop, which accepts connections and serves its share of them
 		 */
 		static void loop() {
 			ev_loop(Worker::my_loop, 0);
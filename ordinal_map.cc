@@ -0,0 +1,56 @@
+#include "ordinal_map.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <new>
+
+const size_t ordinal_map_t::initial_bits;
+
+ordinal_map_t::ordinal_map_t() : slots(NULL), mask(0), shift(64), length(0), reserved(0) {
+	resize(initial_bits);
+}
+
+ordinal_map_t::~ordinal_map_t() {
+	free(slots);
+}
+
+void ordinal_map_t::insert(key_t key, ord_t ord) {
+	assert(ord != 0);
+	if ((length + 1) * 2 > mask + 1) {
+		resize(64 - shift + 1);
+	}
+	size_t ii = slot(key);
+	while (slots[ii].ord != 0) {
+		assert(slots[ii].key != key);
+		ii = (ii + 1) & mask;
+	}
+	slots[ii].key = key;
+	slots[ii].ord = ord;
+	++length;
+}
+
+/**
+ * Moves everything over to a table of 2^bits slots.
+ */
+void ordinal_map_t::resize(size_t bits) {
+	size_t capacity = size_t(1) << bits;
+	slot_t* resized = static_cast<slot_t*>(calloc(capacity, sizeof(slot_t)));
+	if (!resized) {
+		throw std::bad_alloc();
+	}
+	slot_t* previous = slots;
+	size_t previous_capacity = previous ? mask + 1 : 0;
+	slots = resized;
+	mask = capacity - 1;
+	shift = 64 - bits;
+	for (size_t ii = 0; ii < previous_capacity; ++ii) {
+		if (previous[ii].ord != 0) {
+			size_t jj = slot(previous[ii].key);
+			while (slots[jj].ord != 0) {
+				jj = (jj + 1) & mask;
+			}
+			slots[jj] = previous[ii];
+		}
+	}
+	free(previous);
+	reserved.store(capacity * sizeof(slot_t), boost::memory_order_relaxed);
+}
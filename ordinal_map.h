@@ -0,0 +1,79 @@
+#ifndef ORDINAL_MAP_H
+#define ORDINAL_MAP_H
+#include <stdint.h>
+#include <stddef.h>
+#include <boost/atomic.hpp>
+
+/**
+ * Hash table from 64-bit ids to the dense 32-bit ordinals standing in for them. Slots are one flat
+ * array probed linearly from the id's hash, so a lookup is usually a single cache miss. Ordinal 0
+ * marks an empty slot and can't be stored. Entries are never removed, and the table doubles once
+ * it's half full.
+ *
+ * Writer only, apart from bytes().
+ */
+class ordinal_map_t {
+	public:
+		typedef uint64_t key_t;
+		typedef uint32_t ord_t;
+
+		ordinal_map_t();
+		~ordinal_map_t();
+
+		/**
+		 * Ordinal stored for `key`, or 0 if there isn't one.
+		 */
+		ord_t find(key_t key) const {
+			for (size_t ii = slot(key);; ii = (ii + 1) & mask) {
+				if (slots[ii].ord == 0 || slots[ii].key == key) {
+					return slots[ii].ord;
+				}
+			}
+		}
+
+		/**
+		 * Adds `key`, which mustn't be there already.
+		 */
+		void insert(key_t key, ord_t ord);
+
+		size_t size() const {
+			return length;
+		}
+
+		/**
+		 * Memory taken by the slots.
+		 */
+		size_t bytes() const {
+			return reserved.load(boost::memory_order_relaxed);
+		}
+
+	private:
+		static const size_t initial_bits = 10;
+
+		struct slot_t {
+			key_t key;
+			ord_t ord;
+		};
+
+		slot_t* slots;
+		size_t mask;
+		size_t shift;
+		size_t length;
+		boost::atomic<size_t> reserved;
+
+		/**
+		 * Fibonacci hashing, the top bits of the id times 2^64 / phi. Ids are mostly sequential, which
+		 * this spreads out evenly.
+		 */
+		size_t slot(key_t key) const {
+			return (key * 0x9e3779b97f4a7c15ull) >> shift;
+		}
+
+		void resize(size_t bits);
+
+		// Non-copyable
+		ordinal_map_t(const ordinal_map_t&);
+		ordinal_map_t& operator=(const ordinal_map_t&);
+};
+
+#endif
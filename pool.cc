@@ -0,0 +1,73 @@
+#include "pool.h"
+#include <stdlib.h>
+#include <algorithm>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+
+const size_t pool_t::chunk_size;
+
+/**
+ * Every pool, for stats(). Leaked on purpose like the pools themselves.
+ */
+struct pool_registry_t {
+	boost::mutex lock;
+	std::vector<pool_t*> pools;
+};
+
+static pool_registry_t& registry() {
+	static pool_registry_t* registry = new pool_registry_t;
+	return *registry;
+}
+
+pool_t::pool_t(const char* name, size_t size, size_t align) :
+	name(name), align(std::max(align, sizeof(void*))), free_list(NULL), next(NULL), left(0), objects(0), bytes(0) {
+	// Slots are at least big enough to link into the free list
+	this->size = (std::max(size, sizeof(void*)) + this->align - 1) / this->align * this->align;
+	boost::lock_guard<boost::mutex> lock(registry().lock);
+	registry().pools.push_back(this);
+}
+
+void* pool_t::alloc() {
+	void* ptr;
+	if (free_list) {
+		ptr = free_list;
+		free_list = *static_cast<void**>(free_list);
+	} else {
+		if (size > left) {
+			void* chunk;
+			size_t chunk_bytes = std::max(chunk_size, size);
+			if (posix_memalign(&chunk, std::max(align, static_cast<size_t>(64)), chunk_bytes) != 0) {
+				throw std::bad_alloc();
+			}
+			next = static_cast<char*>(chunk);
+			left = chunk_bytes;
+			bytes.fetch_add(chunk_bytes, boost::memory_order_relaxed);
+		}
+		ptr = next;
+		next += size;
+		left -= size;
+	}
+	objects.fetch_add(1, boost::memory_order_relaxed);
+	return ptr;
+}
+
+void pool_t::free(void* ptr) {
+	*static_cast<void**>(ptr) = free_list;
+	free_list = ptr;
+	objects.fetch_sub(1, boost::memory_order_relaxed);
+}
+
+std::vector<pool_t::stats_t> pool_t::stats() {
+	std::vector<stats_t> stats;
+	boost::lock_guard<boost::mutex> lock(registry().lock);
+	for (size_t ii = 0; ii < registry().pools.size(); ++ii) {
+		const pool_t& pool = *registry().pools[ii];
+		stats_t entry;
+		entry.name = pool.name;
+		entry.size = pool.size;
+		entry.objects = pool.objects.load(boost::memory_order_relaxed);
+		entry.bytes = pool.bytes.load(boost::memory_order_relaxed);
+		stats.push_back(entry);
+	}
+	return stats;
+}
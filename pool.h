@@ -0,0 +1,165 @@
+#ifndef POOL_H
+#define POOL_H
+#include <stddef.h>
+#include <limits>
+#include <new>
+#include <vector>
+#include <boost/atomic.hpp>
+
+/**
+ * Slab allocator for objects of one size. Slots are carved out of big aligned chunks and freed ones
+ * go on a free list for the next allocation, so millions of small objects sit packed together
+ * instead of scattered across the heap. Chunks are never given back.
+ *
+ * Pools aren't locked, they're meant for the index structures which only the writer allocates. The
+ * counters can be read from any thread.
+ */
+class pool_t {
+	public:
+		struct stats_t {
+			const char* name;
+			size_t size;
+			size_t objects;
+			size_t bytes;
+		};
+
+		/**
+		 * `name` is what the pool shows up as in stats(), and has to stay around.
+		 */
+		pool_t(const char* name, size_t size, size_t align);
+
+		void* alloc();
+		void free(void* ptr);
+
+		/**
+		 * Counters for every pool created so far.
+		 */
+		static std::vector<stats_t> stats();
+
+	private:
+		static const size_t chunk_size = 1 << 18;
+
+		const char* name;
+		size_t size;
+		size_t align;
+		void* free_list;
+		char* next;
+		size_t left;
+		boost::atomic<size_t> objects;
+		boost::atomic<size_t> bytes;
+
+		// Non-copyable
+		pool_t(const pool_t&);
+		pool_t& operator=(const pool_t&);
+};
+
+/**
+ * STL allocator which takes single objects from a pool_t, for node-based containers. Every
+ * type it's rebound to gets its own pool, all named after `Tag::name()`. Arrays go to the heap.
+ */
+template <class T, class Tag>
+class pool_allocator_t {
+	public:
+		typedef T value_type;
+		typedef T* pointer;
+		typedef const T* const_pointer;
+		typedef T& reference;
+		typedef const T& const_reference;
+		typedef size_t size_type;
+		typedef ptrdiff_t difference_type;
+
+		template <class U>
+		struct rebind {
+			typedef pool_allocator_t<U, Tag> other;
+		};
+
+		pool_allocator_t() {}
+		template <class U>
+		pool_allocator_t(const pool_allocator_t<U, Tag>&) {}
+
+		static pool_t& pool() {
+			// Never destroyed, containers with static storage can outlive anything else
+			static pool_t* pool = new pool_t(Tag::name(), sizeof(T), __alignof__(T));
+			return *pool;
+		}
+
+		pointer allocate(size_type count, const void* = 0) {
+			if (count == 1) {
+				return static_cast<pointer>(pool().alloc());
+			}
+			return static_cast<pointer>(::operator new(count * sizeof(T)));
+		}
+
+		void deallocate(pointer ptr, size_type count) {
+			if (count == 1) {
+				pool().free(ptr);
+			} else {
+				::operator delete(ptr);
+			}
+		}
+
+		void construct(pointer ptr, const T& value) {
+			new(static_cast<void*>(ptr)) T(value);
+		}
+
+		void destroy(pointer ptr) {
+			ptr->~T();
+		}
+
+		pointer address(reference value) const {
+			return &value;
+		}
+
+		const_pointer address(const_reference value) const {
+			return &value;
+		}
+
+		size_type max_size() const {
+			return std::numeric_limits<size_type>::max() / sizeof(T);
+		}
+};
+
+template <class T, class U, class Tag>
+bool operator==(const pool_allocator_t<T, Tag>&, const pool_allocator_t<U, Tag>&) {
+	return true;
+}
+
+template <class T, class U, class Tag>
+bool operator!=(const pool_allocator_t<T, Tag>&, const pool_allocator_t<U, Tag>&) {
+	return false;
+}
+
+/**
+ * Base for classes whose instances come from a pool_t of their own, each on its own cache lines.
+ * `T` is the deriving class.
+ */
+template <class T, class Tag>
+struct pooled_t {
+	static pool_t& pool() {
+		static pool_t* pool = new pool_t(Tag::name(), sizeof(T), 64);
+		return *pool;
+	}
+
+	/**
+	 * Anything deriving further from `T` doesn't fit the pool's slots and goes to the heap instead.
+	 */
+	static void* operator new(size_t size) {
+		if (size != sizeof(T)) {
+			return ::operator new(size);
+		}
+		return pool().alloc();
+	}
+
+	static void operator delete(void* ptr, size_t size) {
+		if (!ptr) {
+			return;
+		}
+		if (size != sizeof(T)) {
+			::operator delete(ptr);
+		} else {
+			pool().free(ptr);
+		}
+	}
+};
+
+#endif
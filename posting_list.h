@@ -0,0 +1,893 @@
+#ifndef POSTING_LIST_H
+#define POSTING_LIST_H
+#include "rcu.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <vector>
+#include <boost/type_traits/alignment_of.hpp>
+
+/**
+ * Ordered set stored as a shallow B+tree of sorted arrays. Each leaf keeps its keys and values in
+ * two contiguous arrays so scans and searches walk sequential memory instead of chasing tree nodes.
+ *
+ * A value's key may move forward without the list being told right away, see refile(). The entry
+ * under the old key is then stale: iterators skip it, and it is dropped once stale entries make up
+ * half the list.
+ *
+ * The tree is copy-on-write. The writer changes nodes it created during the current write_txn_t in
+ * place and copies anything older, and on commit the new root is published. Readers take a view()
+ * which stays valid for as long as they hold an epoch_t::guard_t. Each published root links back to
+ * the one it replaced, so a view shows the list as of the reader's snapshot_t, and entries in it
+ * are told stale by their key as of the snapshot too. Everything except view() and its iterators
+ * is writer only.
+ *
+ * `Traits` must provide:
+ *   key_t, value_t -- trivially copyable types stored in the leaves
+ *   static key_t key(value_t) -- the key a value should currently be filed under
+ *   static key_t published_key(value_t) -- the same as of the calling thread's snapshot
+ *   static bool less(key_t, value_t, key_t, value_t) -- strict weak ordering of entries
+ */
+template <class Traits>
+class posting_list_t {
+	public:
+		typedef typename Traits::key_t key_t;
+		typedef typename Traits::value_t value_t;
+		class const_iterator;
+		class view_t;
+		typedef const_iterator iterator;
+		friend class const_iterator;
+		friend class view_t;
+
+	private:
+		static const size_t leaf_max = 64;
+		static const size_t branch_max = 64;
+		static const size_t max_depth = 8;
+
+		/**
+		 * Leaves are allocated with just enough room for their entries, doubling up to `leaf_max`. Most
+		 * lists are tiny so this matters more than anything else for memory.
+		 */
+		struct leaf_t {
+			uint32_t count;
+			uint32_t capacity;
+			uint64_t txn;
+
+			static size_t values_offset(size_t capacity) {
+				const size_t align = boost::alignment_of<value_t>::value;
+				return (sizeof(leaf_t) + capacity * sizeof(key_t) + align - 1) / align * align;
+			}
+
+			static leaf_t* alloc(size_t capacity) {
+				leaf_t* leaf = static_cast<leaf_t*>(malloc(values_offset(capacity) + capacity * sizeof(value_t)));
+				leaf->count = 0;
+				leaf->capacity = capacity;
+				leaf->txn = write_txn_t::current();
+				return leaf;
+			}
+
+			static leaf_t* resize(leaf_t* leaf, size_t capacity) {
+				leaf_t* resized = alloc(capacity);
+				resized->count = leaf->count;
+				memcpy(resized->keys(), leaf->keys(), leaf->count * sizeof(key_t));
+				memcpy(resized->values(), leaf->values(), leaf->count * sizeof(value_t));
+				release(leaf);
+				return resized;
+			}
+
+			static leaf_t* writable(leaf_t* leaf) {
+				return leaf->txn == write_txn_t::current() ? leaf : resize(leaf, leaf->capacity);
+			}
+
+			static void release(leaf_t* leaf) {
+				if (leaf->txn == write_txn_t::current()) {
+					free(leaf);
+				} else {
+					epoch_t::retire(leaf, free);
+				}
+			}
+
+			key_t* keys() {
+				return reinterpret_cast<key_t*>(this + 1);
+			}
+
+			value_t* values() {
+				return reinterpret_cast<value_t*>(reinterpret_cast<char*>(this) + values_offset(capacity));
+			}
+		};
+
+		/**
+		 * Branches hold a copy of the last entry of each child, which is all lower_bound needs.
+		 */
+		struct branch_t {
+			uint32_t count;
+			uint64_t txn;
+			key_t keys[branch_max];
+			value_t values[branch_max];
+			void* children[branch_max];
+
+			static branch_t* alloc() {
+				branch_t* branch = new branch_t;
+				branch->count = 0;
+				branch->txn = write_txn_t::current();
+				return branch;
+			}
+
+			static branch_t* writable(branch_t* branch) {
+				if (branch->txn == write_txn_t::current()) {
+					return branch;
+				}
+				branch_t* copy = new branch_t(*branch);
+				copy->txn = write_txn_t::current();
+				release(branch);
+				return copy;
+			}
+
+			static void release(branch_t* branch) {
+				if (branch->txn == write_txn_t::current()) {
+					delete branch;
+				} else {
+					epoch_t::retire(branch);
+				}
+			}
+		};
+
+		struct root_t {
+			void* node;
+			uint32_t depth;
+			uint32_t length;
+			uint32_t live;
+			bool published;
+			root_t() : node(NULL), depth(0), length(0), live(0), published(false) {}
+		};
+
+		/**
+		 * Published roots are never changed. `seq` is the commit which published one and `previous`
+		 * the root it replaced, which is retired at the same time and so only reachable by readers
+		 * whose snapshot began before `seq`.
+		 */
+		struct published_root_t: public root_t {
+			uint64_t seq;
+			const published_root_t* previous;
+		};
+
+		root_t working;
+		boost::atomic<const published_root_t*> published;
+		version_t published_version;
+		bool dirty;
+
+		// Non-copyable
+		posting_list_t(const posting_list_t&);
+		posting_list_t& operator=(const posting_list_t&);
+
+		/**
+		 * Index of the first entry not less than (key, value).
+		 */
+		static size_t search(const key_t* keys, const value_t* values, size_t count, key_t key, value_t value) {
+			size_t lo = 0, hi = count;
+			while (lo < hi) {
+				size_t mid = (lo + hi) / 2;
+				if (Traits::less(keys[mid], values[mid], key, value)) {
+					lo = mid + 1;
+				} else {
+					hi = mid;
+				}
+			}
+			return lo;
+		}
+
+		static void last_entry(void* node, bool is_leaf, key_t& key, value_t& value) {
+			if (is_leaf) {
+				leaf_t* leaf = static_cast<leaf_t*>(node);
+				key = leaf->keys()[leaf->count - 1];
+				value = leaf->values()[leaf->count - 1];
+			} else {
+				branch_t* branch = static_cast<branch_t*>(node);
+				key = branch->keys[branch->count - 1];
+				value = branch->values[branch->count - 1];
+			}
+		}
+
+		static size_t node_count(void* node, bool is_leaf) {
+			return is_leaf ? static_cast<leaf_t*>(node)->count : static_cast<branch_t*>(node)->count;
+		}
+
+		/**
+		 * Inserts into a leaf. The leaf may be copied, and if it was full `split` will receive the new
+		 * right half.
+		 */
+		static void insert_leaf(leaf_t*& leaf, key_t key, value_t value, void*& split) {
+			size_t pos = search(leaf->keys(), leaf->values(), leaf->count, key, value);
+			assert(pos == leaf->count || Traits::less(key, value, leaf->keys()[pos], leaf->values()[pos]));
+			if (leaf->count == leaf->capacity) {
+				if (leaf->capacity < leaf_max) {
+					leaf = leaf_t::resize(leaf, leaf->capacity * 2);
+				} else {
+					// Split in half and insert into whichever side `pos` landed on
+					leaf = leaf_t::writable(leaf);
+					leaf_t* right = leaf_t::alloc(leaf_max);
+					size_t half = leaf->count / 2;
+					right->count = leaf->count - half;
+					memcpy(right->keys(), leaf->keys() + half, right->count * sizeof(key_t));
+					memcpy(right->values(), leaf->values() + half, right->count * sizeof(value_t));
+					leaf->count = half;
+					split = right;
+					if (pos > half) {
+						leaf_insert_at(right, pos - half, key, value);
+						return;
+					}
+				}
+			} else {
+				leaf = leaf_t::writable(leaf);
+			}
+			leaf_insert_at(leaf, pos, key, value);
+		}
+
+		static void leaf_insert_at(leaf_t* leaf, size_t pos, key_t key, value_t value) {
+			memmove(leaf->keys() + pos + 1, leaf->keys() + pos, (leaf->count - pos) * sizeof(key_t));
+			memmove(leaf->values() + pos + 1, leaf->values() + pos, (leaf->count - pos) * sizeof(value_t));
+			leaf->keys()[pos] = key;
+			leaf->values()[pos] = value;
+			++leaf->count;
+		}
+
+		static void branch_set(branch_t* branch, size_t pos, void* child, bool child_is_leaf) {
+			branch->children[pos] = child;
+			last_entry(child, child_is_leaf, branch->keys[pos], branch->values[pos]);
+		}
+
+		static void branch_insert(branch_t* branch, size_t pos, void* child, bool child_is_leaf) {
+			memmove(branch->keys + pos + 1, branch->keys + pos, (branch->count - pos) * sizeof(key_t));
+			memmove(branch->values + pos + 1, branch->values + pos, (branch->count - pos) * sizeof(value_t));
+			memmove(branch->children + pos + 1, branch->children + pos, (branch->count - pos) * sizeof(void*));
+			++branch->count;
+			branch_set(branch, pos, child, child_is_leaf);
+		}
+
+		static void branch_remove(branch_t* branch, size_t pos) {
+			--branch->count;
+			memmove(branch->keys + pos, branch->keys + pos + 1, (branch->count - pos) * sizeof(key_t));
+			memmove(branch->values + pos, branch->values + pos + 1, (branch->count - pos) * sizeof(value_t));
+			memmove(branch->children + pos, branch->children + pos + 1, (branch->count - pos) * sizeof(void*));
+		}
+
+		/**
+		 * Inserts an entry known not to be present, copying every node on the way down.
+		 */
+		static void insert_node(void*& node, size_t levels, key_t key, value_t value, void*& split) {
+			if (levels == 0) {
+				leaf_t* leaf = static_cast<leaf_t*>(node);
+				insert_leaf(leaf, key, value, split);
+				node = leaf;
+				return;
+			}
+			branch_t* branch = branch_t::writable(static_cast<branch_t*>(node));
+			node = branch;
+			size_t pos = search(branch->keys, branch->values, branch->count, key, value);
+			if (pos == branch->count) {
+				// New last entry, goes into the last child
+				--pos;
+			}
+			void* child_split = NULL;
+			insert_node(branch->children[pos], levels - 1, key, value, child_split);
+			branch_set(branch, pos, branch->children[pos], levels == 1);
+			if (child_split) {
+				if (branch->count == branch_max) {
+					branch_t* right = branch_t::alloc();
+					size_t half = branch->count / 2;
+					right->count = branch->count - half;
+					memcpy(right->keys, branch->keys + half, right->count * sizeof(key_t));
+					memcpy(right->values, branch->values + half, right->count * sizeof(value_t));
+					memcpy(right->children, branch->children + half, right->count * sizeof(void*));
+					branch->count = half;
+					split = right;
+					if (pos >= half) {
+						branch_insert(right, pos - half + 1, child_split, levels == 1);
+						return;
+					}
+				}
+				branch_insert(branch, pos + 1, child_split, levels == 1);
+			}
+		}
+
+		/**
+		 * Erases an entry known to be present, copying every node on the way down.
+		 */
+		static void erase_node(void*& node, size_t levels, key_t key, value_t value) {
+			if (levels == 0) {
+				leaf_t* leaf = leaf_t::writable(static_cast<leaf_t*>(node));
+				node = leaf;
+				size_t pos = search(leaf->keys(), leaf->values(), leaf->count, key, value);
+				assert(pos < leaf->count);
+				--leaf->count;
+				memmove(leaf->keys() + pos, leaf->keys() + pos + 1, (leaf->count - pos) * sizeof(key_t));
+				memmove(leaf->values() + pos, leaf->values() + pos + 1, (leaf->count - pos) * sizeof(value_t));
+				return;
+			}
+			branch_t* branch = branch_t::writable(static_cast<branch_t*>(node));
+			node = branch;
+			size_t pos = search(branch->keys, branch->values, branch->count, key, value);
+			assert(pos < branch->count);
+			erase_node(branch->children[pos], levels - 1, key, value);
+			void* child = branch->children[pos];
+			if (node_count(child, levels == 1) == 0) {
+				release_node(child, levels - 1);
+				branch_remove(branch, pos);
+				return;
+			}
+			branch_set(branch, pos, child, levels == 1);
+			if (levels == 1 && pos + 1 < branch->count) {
+				// Fold sparse neighbouring leaves together so scans stay dense
+				leaf_t* left = static_cast<leaf_t*>(child);
+				leaf_t* right = static_cast<leaf_t*>(branch->children[pos + 1]);
+				if (left->count + right->count <= leaf_max / 2) {
+					memcpy(left->keys() + left->count, right->keys(), right->count * sizeof(key_t));
+					memcpy(left->values() + left->count, right->values(), right->count * sizeof(value_t));
+					left->count += right->count;
+					leaf_t::release(right);
+					branch_remove(branch, pos + 1);
+					branch_set(branch, pos, left, true);
+				}
+			}
+		}
+
+		/**
+		 * Releases a subtree. Nodes readers may still see are retired rather than freed.
+		 */
+		static void release_node(void* node, size_t levels) {
+			if (levels == 0) {
+				leaf_t::release(static_cast<leaf_t*>(node));
+				return;
+			}
+			branch_t* branch = static_cast<branch_t*>(node);
+			for (size_t ii = 0; ii < branch->count; ++ii) {
+				release_node(branch->children[ii], levels - 1);
+			}
+			branch_t::release(branch);
+		}
+
+		/**
+		 * Frees a subtree right away, only safe when no reader can be looking.
+		 */
+		static void destroy_node(void* node, size_t levels) {
+			if (levels == 0) {
+				free(node);
+				return;
+			}
+			branch_t* branch = static_cast<branch_t*>(node);
+			for (size_t ii = 0; ii < branch->count; ++ii) {
+				destroy_node(branch->children[ii], levels - 1);
+			}
+			delete branch;
+		}
+
+		static void publish_thunk(void* list) {
+			static_cast<posting_list_t*>(list)->publish();
+		}
+
+		void touch() {
+			if (!dirty) {
+				dirty = true;
+				write_txn_t::touch(this, &publish_thunk);
+			}
+		}
+
+		/**
+		 * The key `value` should be filed under in `root`, as of the reader's snapshot if it's a
+		 * published one.
+		 */
+		static key_t filed_key(const root_t* root, value_t value) {
+			return root && root->published ? Traits::published_key(value) : Traits::key(value);
+		}
+
+		static void descend(const root_t* root, key_t key, value_t value, const_iterator& it) {
+			it.root = root;
+			it.leaf = NULL;
+			it.pos = 0;
+			if (!root->node) {
+				return;
+			}
+			void* node = root->node;
+			for (size_t ii = 0; ii < root->depth; ++ii) {
+				branch_t* branch = static_cast<branch_t*>(node);
+				size_t pos = search(branch->keys, branch->values, branch->count, key, value);
+				if (pos == branch->count) {
+					return;
+				}
+				it.path[ii] = branch;
+				it.path_pos[ii] = pos;
+				node = branch->children[pos];
+			}
+			leaf_t* leaf = static_cast<leaf_t*>(node);
+			size_t pos = search(leaf->keys(), leaf->values(), leaf->count, key, value);
+			if (pos < leaf->count) {
+				it.leaf = leaf;
+				it.pos = pos;
+			}
+		}
+
+		void file(value_t value) {
+			touch();
+			key_t key = Traits::key(value);
+			if (!working.node) {
+				leaf_t* leaf = leaf_t::alloc(2);
+				leaf_insert_at(leaf, 0, key, value);
+				working.node = leaf;
+				working.length = 1;
+				return;
+			}
+			if (working.depth) {
+				// Fast path for new first entries. Branches only record the last entry of each child so
+				// nothing changes except the nodes along the leftmost edge.
+				void* node = working.node;
+				for (size_t ii = 0; ii < working.depth; ++ii) {
+					node = static_cast<branch_t*>(node)->children[0];
+				}
+				leaf_t* leaf = static_cast<leaf_t*>(node);
+				if (leaf->count < leaf->capacity && Traits::less(key, value, leaf->keys()[0], leaf->values()[0])) {
+					void** slot = &working.node;
+					for (size_t ii = 0; ii < working.depth; ++ii) {
+						branch_t* branch = branch_t::writable(static_cast<branch_t*>(*slot));
+						*slot = branch;
+						slot = &branch->children[0];
+					}
+					leaf = leaf_t::writable(leaf);
+					*slot = leaf;
+					leaf_insert_at(leaf, 0, key, value);
+					++working.length;
+					return;
+				}
+			}
+			void* split = NULL;
+			insert_node(working.node, working.depth, key, value, split);
+			if (split) {
+				// Grow a new root
+				branch_t* branch = branch_t::alloc();
+				branch->count = 2;
+				branch_set(branch, 0, working.node, working.depth == 0);
+				branch_set(branch, 1, split, working.depth == 0);
+				working.node = branch;
+				++working.depth;
+				assert(working.depth < max_depth);
+			}
+			++working.length;
+		}
+
+	public:
+		posting_list_t() : published(NULL), dirty(false) {}
+
+		~posting_list_t() {
+			if (working.node) {
+				destroy_node(working.node, working.depth);
+			}
+			delete published.load(boost::memory_order_relaxed);
+		}
+
+		/**
+		 * Number of live entries.
+		 */
+		size_t size() const {
+			return working.live;
+		}
+
+		bool empty() const {
+			return working.live == 0;
+		}
+
+		/**
+		 * Number of entries, including stale ones left behind by refile() which haven't been compacted
+		 * away yet.
+		 */
+		size_t length() const {
+			return working.length;
+		}
+
+		void clear() {
+			if (working.node) {
+				touch();
+				release_node(working.node, working.depth);
+				working = root_t();
+			}
+		}
+
+		/**
+		 * Inserts `value` filed under its current key. Returns false if it was already present.
+		 */
+		bool insert(value_t value) {
+			if (contains(Traits::key(value), value)) {
+				return false;
+			}
+			file(value);
+			++working.live;
+			return true;
+		}
+
+		/**
+		 * Files a value which is already in the list under the key it just moved forward to. The entry
+		 * under `old_key` is left where it is and skipped from now on. Usually the new key is the newest
+		 * in the list, so this only touches the leftmost edge of the tree.
+		 */
+		void refile(value_t value, key_t old_key) {
+			assert(contains(old_key, value));
+			assert(!contains(Traits::key(value), value));
+			file(value);
+			if ((working.length - working.live) * 2 > working.length && working.length > leaf_max) {
+				compact();
+			}
+		}
+
+		/**
+		 * Removes `value` filed under its current key. Returns false if it wasn't there.
+		 */
+		bool erase(value_t value) {
+			key_t key = Traits::key(value);
+			if (!contains(key, value)) {
+				return false;
+			}
+			touch();
+			erase_node(working.node, working.depth, key, value);
+			--working.length;
+			--working.live;
+			if (node_count(working.node, working.depth == 0) == 0) {
+				release_node(working.node, working.depth);
+				working = root_t();
+			} else if (working.depth == 0) {
+				leaf_t* leaf = static_cast<leaf_t*>(working.node);
+				if (leaf->capacity > 2 && leaf->count * 4 <= leaf->capacity) {
+					working.node = leaf_t::resize(leaf, leaf->capacity / 2);
+				}
+			} else {
+				while (working.depth && static_cast<branch_t*>(working.node)->count == 1) {
+					// Collapse single-child roots
+					branch_t* branch = static_cast<branch_t*>(working.node);
+					working.node = branch->children[0];
+					branch_t::release(branch);
+					--working.depth;
+				}
+			}
+			return true;
+		}
+
+		/**
+		 * True if there is an entry for `value` under `key`, stale or not.
+		 */
+		bool contains(key_t key, value_t value) const {
+			const_iterator it;
+			descend(&working, key, value, it);
+			return it.leaf && !Traits::less(key, value, it.key(), *it);
+		}
+
+		/**
+		 * Drops stale entries and repacks the leaves.
+		 */
+		void compact() {
+			std::vector<key_t> keys;
+			std::vector<value_t> values;
+			keys.reserve(working.live);
+			values.reserve(working.live);
+			for (const_iterator it = begin(); it != end(); ++it) {
+				keys.push_back(it.key());
+				values.push_back(*it);
+			}
+			clear();
+			assign(keys, values);
+		}
+
+		/**
+		 * Builds a tree out of sorted, unique entries. The list must be empty.
+		 */
+		void assign(const std::vector<key_t>& keys, const std::vector<value_t>& values) {
+			assert(!working.node);
+			size_t count = keys.size();
+			if (!count) {
+				return;
+			}
+			touch();
+			std::vector<void*> nodes;
+			if (count <= leaf_max) {
+				size_t capacity = 2;
+				while (capacity < count) {
+					capacity *= 2;
+				}
+				nodes.push_back(leaf_t::alloc(capacity));
+			}
+			for (size_t offset = 0; offset < count; offset += leaf_max) {
+				if (count > leaf_max) {
+					nodes.push_back(leaf_t::alloc(leaf_max));
+				}
+				leaf_t* leaf = static_cast<leaf_t*>(nodes.back());
+				leaf->count = count - offset < leaf_max ? count - offset : leaf_max;
+				memcpy(leaf->keys(), &keys[offset], leaf->count * sizeof(key_t));
+				memcpy(leaf->values(), &values[offset], leaf->count * sizeof(value_t));
+			}
+			size_t levels = 0;
+			while (nodes.size() > 1) {
+				std::vector<void*> parents;
+				for (size_t ii = 0; ii < nodes.size(); ++ii) {
+					if (ii % branch_max == 0) {
+						parents.push_back(branch_t::alloc());
+					}
+					branch_insert(static_cast<branch_t*>(parents.back()), ii % branch_max, nodes[ii], levels == 0);
+				}
+				nodes.swap(parents);
+				++levels;
+			}
+			working.node = nodes[0];
+			working.depth = levels;
+			working.length = working.live = count;
+		}
+
+		/**
+		 * Makes the writer's changes visible to views taken from now on. Normally called when the
+		 * write_txn_t commits.
+		 */
+		void publish() {
+			if (!dirty) {
+				return;
+			}
+			dirty = false;
+			const published_root_t* prev = published.load(boost::memory_order_relaxed);
+			published_root_t* next = new published_root_t;
+			static_cast<root_t&>(*next) = working;
+			next->published = true;
+			next->seq = write_txn_t::publishing();
+			next->previous = prev;
+			published.store(next, boost::memory_order_release);
+			published_version.publish();
+			epoch_t::retire(const_cast<published_root_t*>(prev));
+		}
+
+		/**
+		 * Bumped every time a change is published.
+		 */
+		const version_t& version() const {
+			return published_version;
+		}
+
+		/**
+		 * Published state of the list as of the reader's snapshot.
+		 */
+		view_t view() const {
+			const published_root_t* root = published.load(boost::memory_order_acquire);
+			while (root && !snapshot_t::covers(root->seq)) {
+				root = root->previous;
+			}
+			return view_t(root);
+		}
+
+		/**
+		 * The writer's own state, including unpublished changes.
+		 */
+		view_t working_view() const {
+			return view_t(&working);
+		}
+
+		const_iterator begin() const {
+			return working_view().begin();
+		}
+
+		const_iterator end() const {
+			return const_iterator();
+		}
+
+		/**
+		 * First entry which is not less than `value` filed under its current key.
+		 */
+		const_iterator lower_bound(value_t value) const {
+			return working_view().lower_bound(value);
+		}
+
+		class view_t {
+			friend class posting_list_t;
+			const root_t* root;
+
+			view_t(const root_t* root) : root(root) {}
+
+			public:
+				view_t() : root(NULL) {}
+
+				size_t size() const {
+					return root ? root->live : 0;
+				}
+
+				bool empty() const {
+					return size() == 0;
+				}
+
+				const_iterator begin() const {
+					const_iterator it;
+					if (root && root->node) {
+						it.root = root;
+						void* node = root->node;
+						for (size_t ii = 0; ii < root->depth; ++ii) {
+							it.path[ii] = static_cast<branch_t*>(node);
+							it.path_pos[ii] = 0;
+							node = it.path[ii]->children[0];
+						}
+						it.leaf = static_cast<leaf_t*>(node);
+						it.skip_stale();
+					}
+					return it;
+				}
+
+				const_iterator end() const {
+					return const_iterator();
+				}
+
+				const_iterator lower_bound(value_t value) const {
+					return lower_bound(filed_key(root, value), value);
+				}
+
+				/**
+				 * Same as above, but for a probe whose key doesn't come from the value.
+				 */
+				const_iterator lower_bound(key_t key, value_t value) const {
+					const_iterator it;
+					if (root) {
+						descend(root, key, value, it);
+						it.skip_stale();
+					}
+					return it;
+				}
+		};
+
+		class const_iterator {
+			friend class posting_list_t;
+			friend class view_t;
+			const root_t* root;
+			leaf_t* leaf;
+			size_t pos;
+			branch_t* path[max_depth];
+			uint32_t path_pos[max_depth];
+
+			void next_leaf() {
+				for (size_t ii = root->depth; ii > 0; --ii) {
+					branch_t* branch = path[ii - 1];
+					if (++path_pos[ii - 1] < branch->count) {
+						void* node = branch->children[path_pos[ii - 1]];
+						for (size_t jj = ii; jj < root->depth; ++jj) {
+							path[jj] = static_cast<branch_t*>(node);
+							path_pos[jj] = 0;
+							node = path[jj]->children[0];
+						}
+						leaf = static_cast<leaf_t*>(node);
+						pos = 0;
+						return;
+					}
+				}
+				leaf = NULL;
+				pos = 0;
+			}
+
+			void step() {
+				if (++pos == leaf->count) {
+					next_leaf();
+				}
+			}
+
+			void skip_stale() {
+				if (root && root->length != root->live) {
+					while (leaf && filed_key(root, leaf->values()[pos]) != leaf->keys()[pos]) {
+						step();
+					}
+				}
+			}
+
+			public:
+				typedef std::forward_iterator_tag iterator_category;
+				typedef typename Traits::value_t value_type;
+				typedef ptrdiff_t difference_type;
+				typedef const value_type* pointer;
+				typedef value_type reference;
+
+				const_iterator() : root(NULL), leaf(NULL), pos(0) {}
+
+				value_type operator* () const {
+					return leaf->values()[pos];
+				}
+
+				/**
+				 * The key this entry was filed under.
+				 */
+				key_t key() const {
+					return leaf->keys()[pos];
+				}
+
+				bool at_end() const {
+					return leaf == NULL;
+				}
+
+				const_iterator& operator++ () {
+					step();
+					skip_stale();
+					return *this;
+				}
+
+				const_iterator operator++ (int) {
+					const_iterator tmp(*this);
+					++*this;
+					return tmp;
+				}
+
+				bool operator== (const const_iterator& rhs) const {
+					return leaf == rhs.leaf && pos == rhs.pos;
+				}
+
+				bool operator!= (const const_iterator& rhs) const {
+					return !(*this == rhs);
+				}
+
+				/**
+				 * Copies out up to `max` entries from here on and moves past them. Returns how many were
+				 * copied, which is only less than `max` at the end of the list. Leaves without stale
+				 * entries are copied whole.
+				 */
+				size_t read(key_t* keys, value_type* values, size_t max) {
+					size_t count = 0;
+					while (leaf && count < max) {
+						size_t take = std::min<size_t>(leaf->count - pos, max - count);
+						if (root->length == root->live) {
+							memcpy(keys + count, leaf->keys() + pos, take * sizeof(key_t));
+							memcpy(values + count, leaf->values() + pos, take * sizeof(value_type));
+							count += take;
+						} else {
+							const key_t* leaf_keys = leaf->keys();
+							const value_type* leaf_values = leaf->values();
+							for (size_t ii = pos; ii < pos + take; ++ii) {
+								if (filed_key(root, leaf_values[ii]) == leaf_keys[ii]) {
+									keys[count] = leaf_keys[ii];
+									values[count] = leaf_values[ii];
+									++count;
+								}
+							}
+						}
+						pos += take;
+						if (pos == leaf->count) {
+							next_leaf();
+						}
+					}
+					skip_stale();
+					return count;
+				}
+
+				/**
+				 * Moves forward to the first entry not less than `value` filed under its current key.
+				 */
+				void seek(value_type value) {
+					if (leaf) {
+						seek(filed_key(root, value), value);
+					}
+				}
+
+				/**
+				 * Moves forward to the first entry not less than (`key`, `value`). Searches the current
+				 * leaf first since fast-forwards during intersections are usually short hops.
+				 */
+				void seek(key_t key, value_type value) {
+					if (!leaf) {
+						return;
+					}
+					key_t* keys = leaf->keys();
+					value_type* values = leaf->values();
+					if (!Traits::less(keys[leaf->count - 1], values[leaf->count - 1], key, value)) {
+						// Intersections mostly seek a short way ahead, so gallop out from the current
+						// position to bracket the target before searching
+						size_t remaining = leaf->count - pos, lo = 0, hi = 1;
+						while (hi < remaining && Traits::less(keys[pos + hi - 1], values[pos + hi - 1], key, value)) {
+							lo = hi;
+							hi = std::min(hi * 2, remaining);
+						}
+						pos += lo + search(keys + pos + lo, values + pos + lo, hi - lo, key, value);
+					} else {
+						descend(root, key, value, *this);
+					}
+					skip_stale();
+				}
+		};
+};
+
+#endif
@@ -0,0 +1,91 @@
+#include "rcu.h"
+#include <assert.h>
+#include <boost/thread/thread.hpp>
+
+boost::atomic<uint64_t> epoch_t::global(0);
+epoch_t::slot_t epoch_t::slots[epoch_t::max_threads];
+boost::atomic<size_t> epoch_t::slot_count(0);
+__thread epoch_t::slot_t* epoch_t::my_slot = NULL;
+std::deque<epoch_t::retired_t> epoch_t::retired;
+
+boost::mutex write_txn_t::lock;
+uint64_t write_txn_t::txn = 1;
+std::vector<std::pair<void*, write_txn_t::publish_t> > write_txn_t::dirty;
+boost::atomic<uint64_t> write_txn_t::seq(0);
+__thread snapshot_t* snapshot_t::current = NULL;
+
+epoch_t::guard_t::guard_t() {
+	slot_t* slot = my_slot;
+	if (!slot) {
+		// First time this thread reads anything, grab a slot. Threads live for the life of the server
+		// so slots are never given back.
+		size_t index = slot_count.fetch_add(1);
+		assert(index < max_threads);
+		slot = my_slot = &slots[index];
+	}
+	if (slot->depth++ == 0) {
+		slot->epoch.store(global.load());
+	}
+}
+
+epoch_t::guard_t::~guard_t() {
+	slot_t* slot = my_slot;
+	if (--slot->depth == 0) {
+		slot->epoch.store(idle, boost::memory_order_release);
+	}
+}
+
+void epoch_t::retire(void* ptr, void (*release)(void*)) {
+	if (!ptr) {
+		return;
+	}
+	retired_t item;
+	item.ptr = ptr;
+	item.release = release;
+	item.epoch = global.load(boost::memory_order_relaxed);
+	retired.push_back(item);
+}
+
+void epoch_t::advance() {
+	global.fetch_add(1);
+}
+
+void epoch_t::collect() {
+	uint64_t oldest = global.load();
+	size_t count = slot_count.load();
+	for (size_t ii = 0; ii < count; ++ii) {
+		uint64_t epoch = slots[ii].epoch.load();
+		if (epoch < oldest) {
+			oldest = epoch;
+		}
+	}
+	while (!retired.empty() && retired.front().epoch < oldest) {
+		retired.front().release(retired.front().ptr);
+		retired.pop_front();
+	}
+}
+
+write_txn_t::write_txn_t() : guard(lock) {}
+
+write_txn_t::~write_txn_t() {
+	if (!dirty.empty()) {
+		seq.fetch_add(1);
+		for (size_t ii = 0; ii < dirty.size(); ++ii) {
+			dirty[ii].second(dirty[ii].first);
+		}
+		dirty.clear();
+		seq.fetch_add(1);
+		epoch_t::advance();
+	}
+	++txn;
+	epoch_t::collect();
+}
+
+uint64_t snapshot_t::wait() {
+	uint64_t seq;
+	while ((seq = write_txn_t::sequence()) & 1) {
+		// A commit is swapping pointers, this is very short
+		boost::this_thread::yield();
+	}
+	return seq;
+}
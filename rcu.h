@@ -0,0 +1,282 @@
+#ifndef RCU_H
+#define RCU_H
+#include <stdint.h>
+#include <stdlib.h>
+#include <deque>
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+
+/**
+ * Epoch based reclamation. Readers pin the current epoch for as long as they hold pointers into
+ * shared structures, and memory retired by the writer is only released once every pinned epoch has
+ * moved past the point it was retired at.
+ */
+class epoch_t {
+	public:
+		static const size_t max_threads = 256;
+
+		/**
+		 * Pins the epoch for the calling thread. Guards nest.
+		 */
+		class guard_t {
+			public:
+				guard_t();
+				~guard_t();
+		};
+
+		/**
+		 * Hands memory which readers may still see over to be released later. Writer only.
+		 */
+		static void retire(void* ptr, void (*release)(void*));
+
+		template <class T>
+		static void retire(T* ptr) {
+			retire(ptr, &destroy<T>);
+		}
+
+		/**
+		 * Moves the epoch forward. Called after publishing, so anything retired before this can't be
+		 * reached by readers pinning afterwards.
+		 */
+		static void advance();
+
+		/**
+		 * Releases whatever no pinned reader can still see.
+		 */
+		static void collect();
+
+		/**
+		 * Number of allocations waiting on readers.
+		 */
+		static size_t pending() {
+			return retired.size();
+		}
+
+	private:
+		struct slot_t {
+			boost::atomic<uint64_t> epoch;
+			size_t depth;
+			char padding[64 - sizeof(boost::atomic<uint64_t>) - sizeof(size_t)];
+			slot_t() : epoch(idle), depth(0) {}
+		};
+
+		struct retired_t {
+			void* ptr;
+			void (*release)(void*);
+			uint64_t epoch;
+		};
+
+		static const uint64_t idle = ~uint64_t(0);
+		static boost::atomic<uint64_t> global;
+		static slot_t slots[max_threads];
+		static boost::atomic<size_t> slot_count;
+		static __thread slot_t* my_slot;
+		static std::deque<retired_t> retired;
+
+		template <class T>
+		static void destroy(void* ptr) {
+			delete static_cast<T*>(ptr);
+		}
+};
+
+/**
+ * Write transaction. Writers are serialized, and everything they touch is published to readers in
+ * one step when the transaction goes out of scope.
+ */
+class write_txn_t {
+	public:
+		typedef void (*publish_t)(void*);
+
+		write_txn_t();
+		~write_txn_t();
+
+		/**
+		 * Id of the open transaction. Nodes stamped with it haven't been published yet, so the writer
+		 * may change them in place.
+		 */
+		static uint64_t current() {
+			return txn;
+		}
+
+		/**
+		 * Registers a structure to be published on commit.
+		 */
+		static void touch(void* object, publish_t publish) {
+			dirty.push_back(std::make_pair(object, publish));
+		}
+
+		/**
+		 * Commit counter, odd while a commit is publishing.
+		 */
+		static uint64_t sequence() {
+			return seq.load(boost::memory_order_acquire);
+		}
+
+		/**
+		 * What sequence() will be once the commit being published is done, which is what readers
+		 * know it by. Writer only, while publishing.
+		 */
+		static uint64_t publishing() {
+			return seq.load(boost::memory_order_relaxed) + 1;
+		}
+
+		/**
+		 * Waits for the transaction in progress, if any.
+		 */
+		static void sync() {
+			boost::lock_guard<boost::mutex> guard(lock);
+		}
+
+	private:
+		static boost::mutex lock;
+		static uint64_t txn;
+		static std::vector<std::pair<void*, publish_t> > dirty;
+		static boost::atomic<uint64_t> seq;
+		boost::lock_guard<boost::mutex> guard;
+
+		// Non-copyable
+		write_txn_t(const write_txn_t&);
+		write_txn_t& operator=(const write_txn_t&);
+};
+
+/**
+ * Id of the transaction which last published a structure. Readers which hang on to something they
+ * worked out from it can check this later to see whether it's changed since.
+ */
+class version_t {
+	public:
+		version_t() : txn(0) {}
+
+		uint64_t load() const {
+			return txn.load(boost::memory_order_acquire);
+		}
+
+		/**
+		 * Writer only, while publishing.
+		 */
+		void publish() {
+			txn.store(write_txn_t::current(), boost::memory_order_release);
+		}
+
+	private:
+		boost::atomic<uint64_t> txn;
+
+		// Non-copyable
+		version_t(const version_t&);
+		version_t& operator=(const version_t&);
+};
+
+/**
+ * Read side of a query. Pins the epoch, and validate() tells the reader whether a commit landed
+ * while it was picking up views of the structures it needs, in which case it should pick them up
+ * again.
+ *
+ * While a snapshot is open on a thread, views taken on that thread show the state as of the commit
+ * it began at, even once later commits have replaced it. Published structures keep a link back to
+ * what they replaced, and since the snapshot's epoch was pinned before those commits the older
+ * versions are still around. See covers().
+ */
+class snapshot_t {
+	public:
+		snapshot_t() : previous(current) {
+			begin = wait();
+			current = this;
+		}
+
+		~snapshot_t() {
+			current = previous;
+		}
+
+		bool validate() {
+			uint64_t end = write_txn_t::sequence();
+			if (end == begin) {
+				return true;
+			}
+			begin = wait();
+			return false;
+		}
+
+		/**
+		 * Whether something published by commit `seq`, see write_txn_t::publishing(), is part of the
+		 * calling thread's innermost snapshot. Without one open, everything published so far is.
+		 * Commits are counted in 64 bits so this never wraps.
+		 */
+		static bool covers(uint64_t seq) {
+			const snapshot_t* snapshot = current;
+			return !snapshot || seq <= snapshot->begin;
+		}
+
+	private:
+		epoch_t::guard_t guard;
+		uint64_t begin;
+		snapshot_t* previous;
+		static __thread snapshot_t* current;
+
+		static uint64_t wait();
+
+		// Non-copyable
+		snapshot_t(const snapshot_t&);
+		snapshot_t& operator=(const snapshot_t&);
+};
+
+/**
+ * Two level table whose entries never move, so readers can index it while the writer appends.
+ */
+template <class T, size_t chunk_bits = 16>
+class chunked_table_t {
+	public:
+		static const size_t chunk_size = size_t(1) << chunk_bits;
+		static const size_t max_chunks = size_t(1) << (32 - chunk_bits);
+
+		/**
+		 * The first `reserved` entries start out as T(), e.g. to keep index 0 free.
+		 */
+		chunked_table_t(size_t reserved = 0) : length(reserved) {
+			for (size_t ii = 0; ii < max_chunks; ++ii) {
+				chunks[ii].store(NULL, boost::memory_order_relaxed);
+			}
+		}
+
+		size_t size() const {
+			return length.load(boost::memory_order_acquire);
+		}
+
+		T get(size_t index) const {
+			boost::atomic<T>* chunk = chunks[index >> chunk_bits].load(boost::memory_order_acquire);
+			return chunk ? chunk[index & (chunk_size - 1)].load(boost::memory_order_acquire) : T();
+		}
+
+		/**
+		 * Writer only.
+		 */
+		void set(size_t index, T value) {
+			boost::atomic<T>* chunk = chunks[index >> chunk_bits].load(boost::memory_order_relaxed);
+			if (!chunk) {
+				chunk = new boost::atomic<T>[chunk_size];
+				for (size_t ii = 0; ii < chunk_size; ++ii) {
+					chunk[ii].store(T(), boost::memory_order_relaxed);
+				}
+				chunks[index >> chunk_bits].store(chunk, boost::memory_order_release);
+			}
+			chunk[index & (chunk_size - 1)].store(value, boost::memory_order_release);
+			if (index >= length.load(boost::memory_order_relaxed)) {
+				length.store(index + 1, boost::memory_order_release);
+			}
+		}
+
+		void push_back(T value) {
+			set(size(), value);
+		}
+
+	private:
+		boost::atomic<boost::atomic<T>*> chunks[max_chunks];
+		boost::atomic<size_t> length;
+
+		// Non-copyable
+		chunked_table_t(const chunked_table_t&);
+		chunked_table_t& operator=(const chunked_table_t&);
+};
+
+#endif
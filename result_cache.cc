@@ -0,0 +1,114 @@
+#include "result_cache.h"
+#include <boost/foreach.hpp>
+#define foreach BOOST_FOREACH
+
+using namespace std;
+
+// Rough per-node overhead of the standard containers, for the memory budget
+static const size_t node_overhead = 4 * sizeof(void*);
+
+result_cache_t::result_cache_t(size_t budget) :
+	budget(budget), bytes(0), hits(0), misses(0), stale(0), evictions(0) {}
+
+void result_cache_t::set_budget(size_t budget) {
+	boost::lock_guard<boost::mutex> guard(lock);
+	this->budget = budget;
+	evict();
+}
+
+bool result_cache_t::find(const string& key, value_t& value) {
+	boost::lock_guard<boost::mutex> guard(lock);
+	map<string, lru_t::iterator>::iterator ii = index.find(key);
+	if (ii == index.end()) {
+		++misses;
+		return false;
+	}
+	lru_t::iterator entry = ii->second;
+	for (size_t jj = 0; jj < entry->deps.versions.size(); ++jj) {
+		if (entry->deps.versions[jj].first->load() != entry->deps.versions[jj].second) {
+			erase(entry);
+			++stale;
+			++misses;
+			return false;
+		}
+	}
+	entries.splice(entries.begin(), entries, entry);
+	value = entry->value;
+	++hits;
+	return true;
+}
+
+void result_cache_t::insert(const string& key, const value_t& value, const deps_t& deps) {
+	if (!deps.cacheable) {
+		return;
+	}
+	size_t size =
+		sizeof(entry_t) + 2 * node_overhead + 2 * key.size() +
+		deps.versions.size() * sizeof(deps.versions[0]) + value_size(value);
+
+	boost::lock_guard<boost::mutex> guard(lock);
+	if (size > budget) {
+		return;
+	}
+	map<string, lru_t::iterator>::iterator ii = index.find(key);
+	if (ii != index.end()) {
+		erase(ii->second);
+	}
+	entries.push_front(entry_t());
+	entry_t& entry = entries.front();
+	entry.key = key;
+	entry.value = value;
+	entry.deps = deps;
+	entry.bytes = size;
+	index.insert(make_pair(key, entries.begin()));
+	bytes += size;
+	evict();
+}
+
+result_cache_t::stats_t result_cache_t::stats() const {
+	boost::lock_guard<boost::mutex> guard(lock);
+	stats_t stats;
+	stats.entries = index.size();
+	stats.bytes = bytes;
+	stats.budget = budget;
+	stats.hits = hits;
+	stats.misses = misses;
+	stats.stale = stale;
+	stats.evictions = evictions;
+	return stats;
+}
+
+void result_cache_t::erase(lru_t::iterator entry) {
+	bytes -= entry->bytes;
+	index.erase(entry->key);
+	entries.erase(entry);
+}
+
+void result_cache_t::evict() {
+	while (bytes > budget) {
+		erase(--entries.end());
+		++evictions;
+	}
+}
+
+size_t result_cache_t::value_size(const value_t& value) {
+	size_t size = sizeof(value_t);
+	switch (value.type()) {
+		case json_spirit::str_type:
+			size += value.get_str().size();
+			break;
+		case json_spirit::array_type:
+			foreach (const value_t& item, value.get_array()) {
+				size += value_size(item);
+			}
+			break;
+		case json_spirit::obj_type:
+			for (json_spirit::mObject::const_iterator ii = value.get_obj().begin(); ii != value.get_obj().end(); ++ii) {
+				size += node_overhead + sizeof(string) + ii->first.size() + value_size(ii->second);
+			}
+			break;
+		default:
+			break;
+	}
+	return size;
+}
@@ -0,0 +1,114 @@
+#ifndef RESULT_CACHE_H
+#define RESULT_CACHE_H
+#include "rcu.h"
+#include <stdint.h>
+#include <list>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include <json_spirit.h>
+#include <boost/thread/mutex.hpp>
+
+/**
+ * Least recently used cache of query results, held to a memory budget.
+ *
+ * Each result remembers the version of every structure it was worked out from, and a lookup only
+ * hits if none of them have published a change since. So there's nothing to invalidate on write,
+ * and a result is only thrown away when something it actually read has changed. Safe to use from
+ * any thread.
+ */
+class result_cache_t {
+	public:
+		typedef json_spirit::mValue value_t;
+
+		/**
+		 * Versions a result depends on. Add each structure as it's read, while the reader's snapshot
+		 * is open. Anything read which can't be tracked should mark the result uncacheable.
+		 */
+		class deps_t {
+			public:
+				deps_t() : cacheable(true) {}
+
+				void depend(const version_t& version) {
+					versions.push_back(std::make_pair(&version, version.load()));
+				}
+
+				void uncacheable() {
+					cacheable = false;
+				}
+
+				void clear() {
+					versions.clear();
+					cacheable = true;
+				}
+
+			private:
+				friend class result_cache_t;
+				std::vector<std::pair<const version_t*, uint64_t> > versions;
+				bool cacheable;
+		};
+
+		struct stats_t {
+			size_t entries;
+			size_t bytes;
+			size_t budget;
+			uint64_t hits;
+			uint64_t misses;
+			uint64_t stale;
+			uint64_t evictions;
+		};
+
+		/**
+		 * `budget` is in bytes, 0 turns the cache off.
+		 */
+		result_cache_t(size_t budget = 0);
+
+		void set_budget(size_t budget);
+
+		/**
+		 * Copies out the result under `key` if there is one and it's still current.
+		 */
+		bool find(const std::string& key, value_t& value);
+
+		/**
+		 * Stores a result, replacing whatever was under `key`. The least recently used results are
+		 * evicted to make room.
+		 */
+		void insert(const std::string& key, const value_t& value, const deps_t& deps);
+
+		/**
+		 * Counters for monitoring. `stale` counts lookups which found a result that had to be thrown
+		 * away, and they're also counted as misses.
+		 */
+		stats_t stats() const;
+
+	private:
+		struct entry_t {
+			std::string key;
+			value_t value;
+			deps_t deps;
+			size_t bytes;
+		};
+		typedef std::list<entry_t> lru_t;
+
+		mutable boost::mutex lock;
+		lru_t entries; // most recently used first
+		std::map<std::string, lru_t::iterator> index;
+		size_t budget;
+		size_t bytes;
+		uint64_t hits;
+		uint64_t misses;
+		uint64_t stale;
+		uint64_t evictions;
+
+		void erase(lru_t::iterator entry);
+		void evict();
+		static size_t value_size(const value_t& value);
+
+		// Non-copyable
+		result_cache_t(const result_cache_t&);
+		result_cache_t& operator=(const result_cache_t&);
+};
+
+#endif
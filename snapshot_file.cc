@@ -0,0 +1,137 @@
+#include "snapshot_file.h"
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdexcept>
+
+using namespace std;
+
+snapshot_writer_t::snapshot_writer_t(const string& path) : path(path), tmp_path(path + ".tmp") {
+	file = fopen(tmp_path.c_str(), "wb");
+	if (!file) {
+		throw runtime_error("fopen() error");
+	}
+}
+
+snapshot_writer_t::~snapshot_writer_t() {
+	if (file) {
+		// Never committed
+		fclose(file);
+		unlink(tmp_path.c_str());
+	}
+}
+
+void snapshot_writer_t::put_varint(uint64_t value) {
+	uint8_t bytes[10];
+	size_t length = 0;
+	while (value >= 0x80) {
+		bytes[length++] = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	bytes[length++] = value;
+	put_bytes(bytes, length);
+}
+
+void snapshot_writer_t::put_string(const string& value) {
+	put_varint(value.length());
+	put_bytes(value.data(), value.length());
+}
+
+void snapshot_writer_t::put_bytes(const void* data, size_t length) {
+	if (fwrite(data, 1, length, file) != length) {
+		throw runtime_error("fwrite() error");
+	}
+}
+
+void snapshot_writer_t::commit() {
+	if (fflush(file) != 0 || fsync(fileno(file)) != 0) {
+		throw runtime_error("fsync() error");
+	}
+	fclose(file);
+	file = NULL;
+	if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+		unlink(tmp_path.c_str());
+		throw runtime_error("rename() error");
+	}
+	sync_parent_directory(path);
+}
+
+void sync_parent_directory(const string& path) {
+	size_t slash = path.rfind('/');
+	string directory = slash == string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+	int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		throw runtime_error("open() error");
+	}
+	bool synced = fsync(fd) == 0;
+	close(fd);
+	if (!synced) {
+		throw runtime_error("fsync() error");
+	}
+}
+
+snapshot_reader_t::snapshot_reader_t(const string& path) : data(NULL), length(0) {
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		throw runtime_error("open() error");
+	}
+	struct stat info;
+	if (fstat(fd, &info) != 0) {
+		close(fd);
+		throw runtime_error("fstat() error");
+	}
+	length = info.st_size;
+	if (length) {
+		void* map = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			close(fd);
+			throw runtime_error("mmap() error");
+		}
+		data = static_cast<const uint8_t*>(map);
+		madvise(map, length, MADV_SEQUENTIAL);
+	}
+	close(fd);
+	pos = data;
+	end = data + length;
+}
+
+snapshot_reader_t::~snapshot_reader_t() {
+	if (data) {
+		munmap(const_cast<uint8_t*>(data), length);
+	}
+}
+
+uint64_t snapshot_reader_t::get_varint() {
+	uint64_t value = 0;
+	for (size_t shift = 0; shift < 64; shift += 7) {
+		if (pos == end) {
+			throw runtime_error("truncated snapshot");
+		}
+		uint8_t byte = *pos++;
+		value |= uint64_t(byte & 0x7f) << shift;
+		if (!(byte & 0x80)) {
+			return value;
+		}
+	}
+	throw runtime_error("corrupt snapshot");
+}
+
+string snapshot_reader_t::get_string() {
+	size_t length = get_varint();
+	if (size_t(end - pos) < length) {
+		throw runtime_error("truncated snapshot");
+	}
+	string value(reinterpret_cast<const char*>(pos), length);
+	pos += length;
+	return value;
+}
+
+void snapshot_reader_t::get_bytes(void* data, size_t length) {
+	if (size_t(end - pos) < length) {
+		throw runtime_error("truncated snapshot");
+	}
+	memcpy(data, pos, length);
+	pos += length;
+}
@@ -0,0 +1,69 @@
+#ifndef SNAPSHOT_FILE_H
+#define SNAPSHOT_FILE_H
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+/**
+ * Sequential binary file of varints and strings. It's written under a temporary name and moved into
+ * place by commit(), so a crash never leaves a half written file where a good one used to be.
+ */
+class snapshot_writer_t {
+	public:
+		snapshot_writer_t(const std::string& path);
+		~snapshot_writer_t();
+
+		void put_varint(uint64_t value);
+		void put_string(const std::string& value);
+		void put_bytes(const void* data, size_t length);
+
+		/**
+		 * Flushes everything to disk and replaces the file at `path`, and syncs the directory so the
+		 * replacement survives a crash too.
+		 */
+		void commit();
+
+	private:
+		std::string path;
+		std::string tmp_path;
+		FILE* file;
+
+		// Non-copyable
+		snapshot_writer_t(const snapshot_writer_t&);
+		snapshot_writer_t& operator=(const snapshot_writer_t&);
+};
+
+/**
+ * Syncs the directory holding `path`, after a file's been renamed into place there.
+ */
+void sync_parent_directory(const std::string& path);
+
+/**
+ * Reads a file written by snapshot_writer_t. The file is mapped rather than read so loading doesn't
+ * need a second copy of it in memory. Running off the end throws.
+ */
+class snapshot_reader_t {
+	public:
+		snapshot_reader_t(const std::string& path);
+		~snapshot_reader_t();
+
+		uint64_t get_varint();
+		std::string get_string();
+		void get_bytes(void* data, size_t length);
+
+		bool at_end() const {
+			return pos == end;
+		}
+
+	private:
+		const uint8_t* data;
+		const uint8_t* pos;
+		const uint8_t* end;
+		size_t length;
+
+		// Non-copyable
+		snapshot_reader_t(const snapshot_reader_t&);
+		snapshot_reader_t& operator=(const snapshot_reader_t&);
+};
+
+#endif
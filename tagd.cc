@@ -1,10 +1,27 @@
 #include "libeti_worker.h"
+#include "posting_list.h"
+#include "bitmap.h"
+#include "compressed_posting_list.h"
+#include "kernels.h"
+#include "arena.h"
+#include "pool.h"
+#include "ordinal_map.h"
+#include "rcu.h"
+#include "snapshot_file.h"
+#include "wal.h"
+#include "result_cache.h"
 #include <stdint.h>
+#include <getopt.h>
 #include <math.h>
+#include <string.h>
 #include <sys/time.h>
 #include <set>
+#include <sstream>
 #include <boost/ptr_container/ptr_vector.hpp>
 #include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/thread_time.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
 #include <boost/foreach.hpp>
 #define foreach BOOST_FOREACH
 #define reverse_foreach BOOST_REVERSE_FOREACH
@@ -13,74 +30,363 @@ const double message_cutoff = 43200;
 const double topic_cutoff = 86400 * 5;
 const size_t inverse_req = 10000;
 
+// A tag also keeps a bitmap of its topics once it has this many and they're at least 1/ratio of the
+// index
+const size_t dense_tag_min = 1000;
+const size_t dense_tag_ratio = 64;
+
 using namespace std;
 using namespace boost;
 using namespace eti;
 
-boost::shared_mutex write_lock;
-
+/**
+ * Where a topic is filed: its timestamp, and its ordinal to tell it apart from others filed under the
+ * same one. Queries use these to say where they're up to. Ordinal 0 is never a topic, so (0, ts)
+ * comes after every topic filed under `ts`.
+ */
 struct base_topic_t {
 	typedef uint64_t id_t;
 	typedef uint32_t ts_t;
+	typedef uint32_t ord_t;
 	typedef uint32_t user_t;
 
-	id_t id;
+	ord_t ord;
 	ts_t ts;
 
-	base_topic_t(id_t id, ts_t ts) : id(id), ts(ts) {};
+	base_topic_t(ord_t ord, ts_t ts) : ord(ord), ts(ts) {};
+};
+
+/**
+ * Who posted in a topic lately, as each user's latest post time kept in an array sorted by user.
+ * Only the number of distinct posters counts towards the hot score, so posts themselves aren't kept.
+ */
+struct topic_activity_t {
+	struct poster_t {
+		base_topic_t::user_t user;
+		base_topic_t::ts_t last;
 
-	struct less {
-		bool operator() (const base_topic_t* left, const base_topic_t* right) const {
-			return left->ts > right->ts || (left->ts == right->ts && left->id > right->id);
+		bool operator< (const poster_t& other) const {
+			return user < other.user;
 		}
 	};
+	vector<poster_t> posters;
+	// No later than any poster's `last`. Exact after expire().
+	base_topic_t::ts_t oldest;
+
+	topic_activity_t() : oldest(0) {}
+
+	size_t users() const {
+		return posters.size();
+	}
+
+	bool posted(base_topic_t::user_t user) const {
+		poster_t poster = { user, 0 };
+		return binary_search(posters.begin(), posters.end(), poster);
+	}
+
+	bool empty() const {
+		return posters.empty();
+	}
+
+	/**
+	 * Records a post. Returns true if `oldest` moved back, so the topic expires sooner.
+	 */
+	bool post(base_topic_t::ts_t ts, base_topic_t::user_t user) {
+		poster_t poster = { user, ts };
+		vector<poster_t>::iterator ii = lower_bound(posters.begin(), posters.end(), poster);
+		if (ii != posters.end() && ii->user == user) {
+			ii->last = max(ii->last, ts);
+			return false;
+		}
+		posters.insert(ii, poster);
+		if (posters.size() == 1 || ts < oldest) {
+			oldest = ts;
+			return true;
+		}
+		return false;
+	}
+
+	/**
+	 * Drops users whose latest post is before `cutoff`.
+	 */
+	void expire(double cutoff) {
+		vector<poster_t>::iterator kept = posters.begin();
+		foreach (const poster_t& poster, posters) {
+			if (!(poster.last < cutoff)) {
+				*kept++ = poster;
+			}
+		}
+		posters.erase(kept, posters.end());
+		if (!posters.empty()) {
+			oldest = posters.front().last;
+			foreach (const poster_t& poster, posters) {
+				oldest = min(oldest, poster.last);
+			}
+		}
+	}
+};
+
+/**
+ * Names for the memory pools in stats.
+ */
+struct topic_pool {
+	static const char* name() { return "topics"; }
+};
+struct topic_state_pool {
+	static const char* name() { return "topic_states"; }
+};
+struct topic_tag_pool {
+	static const char* name() { return "topic_tags"; }
+};
+struct topic_word_pool {
+	static const char* name() { return "topic_words"; }
+};
+struct tag_pool {
+	static const char* name() { return "tags"; }
+};
+struct word_pool {
+	static const char* name() { return "words"; }
 };
 
-struct topic_t: public base_topic_t {
-	typedef pair<ts_t, user_t> post_t;
+/**
+ * The part of a topic queries look at besides its tags and words, as of one commit. Published states
+ * are never changed: the writer changes a copy, published when its transaction commits, which links
+ * back to the state it replaced for readers whose snapshot began before then.
+ */
+struct topic_state_t: public pooled_t<topic_state_t, topic_state_pool> {
+	base_topic_t::ts_t ts;
+	base_topic_t::ts_t created;
+	topic_activity_t activity;
+	// Transaction which made this copy, the writer may change it in place until it commits
+	uint64_t txn;
+	// Commit which published it, see write_txn_t::publishing()
+	uint64_t seq;
+	const topic_state_t* previous;
+
+	topic_state_t(base_topic_t::ts_t ts) : ts(ts), created(0), txn(write_txn_t::current()), seq(0), previous(NULL) {}
+
+	double score(time_t now, size_t users) const;
+	double score(time_t now) const;
+};
 
-	static map<id_t, base_topic_t*> topics_by_id;
+/**
+ * Topics are known by a dense ordinal, handed out in the order they're created. Posting lists hold
+ * ordinals rather than pointers, and the fields scans look at, the id and timestamp, are kept in
+ * tables indexed by ordinal instead of in the topic itself. The rest of what readers see is in a
+ * topic_state_t, and the topic_t itself is the writer's.
+ */
+struct topic_t: public pooled_t<topic_t, topic_pool> {
+	typedef base_topic_t::id_t id_t;
+	typedef base_topic_t::ts_t ts_t;
+	typedef base_topic_t::ord_t ord_t;
+	typedef base_topic_t::user_t user_t;
+	typedef posting_list_t<struct activity_posting_traits> activity_set_t;
+	typedef set<struct tag_t*, std::less<struct tag_t*>, pool_allocator_t<struct tag_t*, topic_tag_pool> > tag_set_t;
+	typedef set<struct word_t*, std::less<struct word_t*>, pool_allocator_t<struct word_t*, topic_word_pool> > word_set_t;
+
+	static ordinal_map_t topics_by_id;
+	static chunked_table_t<topic_t*> topics_by_ord;
+	static chunked_table_t<id_t> ids_by_ord;
+	// The writer's timestamps, including unpublished bumps
+	static chunked_table_t<ts_t> ts_by_ord;
+	// Published timestamps and the commits that set them. The commit is `changing` while the writer
+	// replaces the pair, see snapshot_ts().
+	static chunked_table_t<ts_t> published_ts_by_ord;
+	static chunked_table_t<uint64_t> published_seq_by_ord;
+	static const uint64_t changing = ~uint64_t(0);
+	static activity_set_t topics_by_activity;
+
+	tag_set_t tags;
+	word_set_t title;
+	word_set_t document;
+	// The writer's state, the same as the published one until it's changed
+	topic_state_t* state;
+	boost::atomic<const topic_state_t*> published_state;
+	// Where the topic is in expiry_wheel_t, see there
+	uint32_t wheel_bucket;
+	uint32_t wheel_stamp;
+	ord_t ord;
+
+	topic_t(ord_t ord, ts_t ts) : state(new topic_state_t(ts)), published_state(NULL), wheel_bucket(~uint32_t(0)), wheel_stamp(0), ord(ord) {};
+
+	id_t id() const {
+		return ids_by_ord.get(ord);
+	}
 
-	set<struct tag_t*> tags;
-	set<struct word_t*> title;
-	set<struct word_t*> document;
-	set<post_t> messages;
-	map<user_t, uint32_t> message_counts;
-	ts_t created;
+	/**
+	 * Writer only.
+	 */
+	ts_t ts() const {
+		return ts_by_ord.get(ord);
+	}
 
-	topic_t(id_t id, ts_t ts) : base_topic_t(id, ts), created(0) {};
+	/**
+	 * Timestamp of a topic as of the reader's snapshot. Usually that's the published one, which
+	 * says when it was set, so only topics bumped since the snapshot began need their state. The
+	 * commit is read on both sides of the timestamp so one caught being replaced isn't trusted.
+	 */
+	static ts_t snapshot_ts(ord_t ord) {
+		uint64_t seq = published_seq_by_ord.get(ord);
+		ts_t ts = published_ts_by_ord.get(ord);
+		if (seq != changing && snapshot_t::covers(seq) && published_seq_by_ord.get(ord) == seq) {
+			return ts;
+		}
+		return topics_by_ord.get(ord)->snapshot().ts;
+	}
 
 	static topic_t* find(id_t id);
 	static topic_t* find(id_t id, ts_t ts);
 	static topic_t& get(id_t id, ts_t ts);
+	static topic_t& create(id_t id, ts_t ts);
 	void bump(ts_t ts);
-	double score() const;
+	topic_state_t& writable();
+	const topic_state_t& snapshot() const;
+	static void publish_state(void* topic);
+};
+ordinal_map_t topic_t::topics_by_id;
+chunked_table_t<topic_t*> topic_t::topics_by_ord(1);
+chunked_table_t<topic_t::id_t> topic_t::ids_by_ord(1);
+chunked_table_t<topic_t::ts_t> topic_t::ts_by_ord(1);
+chunked_table_t<topic_t::ts_t> topic_t::published_ts_by_ord(1);
+chunked_table_t<uint64_t> topic_t::published_seq_by_ord(1);
+const uint64_t topic_t::changing;
+
+/**
+ * Posting list ordering for topics, newest first and then by id. Entries are topic ordinals, with
+ * the timestamp copied into the list so comparisons during a scan only have to look up ids when
+ * timestamps tie.
+ */
+struct topic_posting_traits {
+	typedef topic_t::ts_t key_t;
+	typedef topic_t::ord_t value_t;
+
+	static key_t key(topic_t::ord_t ord) {
+		return topic_t::ts_by_ord.get(ord);
+	}
+
+	static key_t published_key(topic_t::ord_t ord) {
+		return topic_t::snapshot_ts(ord);
+	}
+
+	static bool less(key_t left_ts, topic_t::ord_t left, key_t right_ts, topic_t::ord_t right) {
+		return left_ts > right_ts || (
+			left_ts == right_ts && left != right &&
+			topic_t::ids_by_ord.get(left) > topic_t::ids_by_ord.get(right)
+		);
+	}
+
+	static uint32_t ordinal(topic_t::ord_t ord) {
+		return ord;
+	}
+
+	static topic_t::ord_t from_ordinal(uint32_t ord) {
+		return ord;
+	}
+};
+
+/**
+ * Ordering for topic_t::topics_by_activity, most distinct posters first and then the most recently
+ * indexed. The key changes both ways, so topics are erased before it changes and inserted again
+ * after instead of being refiled.
+ */
+struct activity_posting_traits {
+	typedef uint32_t key_t;
+	typedef topic_t* value_t;
+
+	static key_t key(const topic_t* topic) {
+		return topic->state->activity.users();
+	}
+
+	static key_t published_key(const topic_t* topic) {
+		return topic->snapshot().activity.users();
+	}
+
+	static bool less(key_t left_users, const topic_t* left, key_t right_users, const topic_t* right) {
+		return left_users > right_users || (left_users == right_users && left->ord > right->ord);
+	}
 };
-map<topic_t::id_t, base_topic_t*> topic_t::topics_by_id;
+topic_t::activity_set_t topic_t::topics_by_activity;
 
-struct tag_t {
+struct tag_t: public pooled_t<tag_t, tag_pool> {
 	typedef uint32_t id_t;
-	typedef set<topic_t*, topic_t::less> topic_set_t;
-	static vector<tag_t*> tags_by_id;
+	typedef posting_list_t<topic_posting_traits> topic_set_t;
+	static chunked_table_t<tag_t*> tags_by_id;
 	static vector<tag_t*> inverse_tags;
 	static tag_t active_tag;
 	static tag_t global_tag;
 
 	topic_set_t topics;
+	bitmap_t* members;
+	boost::atomic<const bitmap_t*> published_members;
 	tag_t* inverse_tag;
+	boost::atomic<tag_t*> published_inverse_tag;
+	// Commits which published the above, they're only ever set once
+	boost::atomic<uint64_t> members_seq;
+	boost::atomic<uint64_t> inverse_seq;
 
-	tag_t() : inverse_tag(NULL) {};
+	tag_t() : members(NULL), published_members(NULL), inverse_tag(NULL), published_inverse_tag(NULL), members_seq(0), inverse_seq(0) {};
 
+	static tag_t* find(id_t id);
 	static tag_t& get(id_t id);
+	void insert(topic_t* topic);
+	void erase(topic_t* topic);
+	void clear();
+	void check_density();
+	static void publish_members(void* tag);
+	void set_inverse(tag_t* inverse);
+	static void publish_inverse(void* tag);
+
+	/**
+	 * Bitmap of the tag's topic ordinals, NULL unless the tag was dense as of the reader's snapshot.
+	 */
+	const bitmap_t* reader_members() const {
+		const bitmap_t* members = published_members.load(boost::memory_order_acquire);
+		return members && snapshot_t::covers(members_seq.load(boost::memory_order_relaxed)) ? members : NULL;
+	}
+
+	/**
+	 * Inverse tag as of the reader's snapshot.
+	 */
+	tag_t* reader_inverse_tag() const {
+		tag_t* inverse = published_inverse_tag.load(boost::memory_order_acquire);
+		return inverse && snapshot_t::covers(inverse_seq.load(boost::memory_order_relaxed)) ? inverse : NULL;
+	}
 };
-vector<tag_t*> tag_t::tags_by_id(1, NULL);
+chunked_table_t<tag_t*> tag_t::tags_by_id;
 vector<tag_t*> tag_t::inverse_tags;
 tag_t tag_t::active_tag;
 tag_t tag_t::global_tag;
 
-struct word_t {
-	typedef set<topic_t*, topic_t::less> topic_set_t;
-	static map<const string, word_t*> words_by_string;
+/**
+ * Dictionary ordering for words, kept in a posting_list_t so readers can look words up while the
+ * writer adds new ones.
+ */
+struct word_dictionary_traits {
+	typedef const char* key_t;
+	typedef struct word_t* value_t;
+
+	static key_t key(const word_t* word);
+
+	static key_t published_key(const word_t* word) {
+		return key(word);
+	}
+
+	static bool less(key_t left_str, const word_t* left, key_t right_str, const word_t* right) {
+		return strcmp(left_str, right_str) < 0;
+	}
+};
+
+struct word_t: public pooled_t<word_t, word_pool> {
+	typedef compressed_posting_list_t<topic_posting_traits> topic_set_t;
+	typedef posting_list_t<word_dictionary_traits> dictionary_t;
+	static dictionary_t words_by_string;
+
+	/**
+	 * Most words and postings, summed over its words, a wildcard may match before the query is
+	 * turned away. 0 for no limit. See --max-wildcard-words and --max-wildcard-postings.
+	 */
+	static size_t max_wildcard_words;
+	static size_t max_wildcard_postings;
 
 	const string word;
 	topic_set_t topics_titles;
@@ -91,25 +397,25 @@ struct word_t {
 	static word_t* find(const string& id);
 	static word_t& get(const string& id);
 };
-map<const string, word_t*> word_t::words_by_string;
+word_t::dictionary_t word_t::words_by_string;
+size_t word_t::max_wildcard_words = 65536;
+size_t word_t::max_wildcard_postings = 16 * 1024 * 1024;
+
+word_dictionary_traits::key_t word_dictionary_traits::key(const word_t* word) {
+	return word->word.c_str();
+}
 
 topic_t* topic_t::find(id_t id) {
-	map<id_t, base_topic_t*>::iterator ii = topics_by_id.find(id);
-	if (ii == topics_by_id.end()) {
-		return NULL;
-	}
-	return static_cast<topic_t*>(ii->second);
+	ord_t ord = topics_by_id.find(id);
+	return ord ? topics_by_ord.get(ord) : NULL;
 }
 
 topic_t* topic_t::find(id_t id, ts_t ts) {
-	map<id_t, base_topic_t*>::iterator ii = topics_by_id.find(id);
-	if (ii == topics_by_id.end()) {
-		return NULL;
+	topic_t* topic = find(id);
+	if (topic) {
+		topic->bump(ts);
 	}
-
-	topic_t& topic = *static_cast<topic_t*>(ii->second);
-	topic.bump(ts);
-	return &topic;
+	return topic;
 }
 
 topic_t& topic_t::get(id_t id, ts_t ts) {
@@ -118,93 +424,282 @@ topic_t& topic_t::get(id_t id, ts_t ts) {
 		return *topic;
 	}
 
-	topic = new topic_t(id, ts);
-	topics_by_id.insert(make_pair(id, topic));
-	tag_t::global_tag.topics.insert(topic);
+	topic = &create(id, ts);
+	tag_t::global_tag.insert(topic);
 	topic->tags.insert(&tag_t::global_tag);
 	foreach (tag_t* tag, tag_t::inverse_tags) {
-		tag->topics.insert(topic);
+		tag->insert(topic);
 		topic->tags.insert(tag);
 	}
 	return *topic;
 }
 
+/**
+ * Gives a new topic the next ordinal, without filing it anywhere.
+ */
+topic_t& topic_t::create(id_t id, ts_t ts) {
+	ord_t ord = topics_by_ord.size();
+	topic_t* topic = new topic_t(ord, ts);
+	ids_by_ord.set(ord, id);
+	ts_by_ord.set(ord, ts);
+	topics_by_ord.push_back(topic);
+	topics_by_id.insert(id, ord);
+	write_txn_t::touch(topic, &publish_state);
+	return *topic;
+}
+
 void topic_t::bump(ts_t ts) {
-	if (this->ts >= ts) {
+	ts_t old_ts = this->ts();
+	if (old_ts >= ts) {
 		return;
 	}
 
-	// Remove topic from each tag set before adjusting equality
+	// Bump the topic and file it under the new timestamp. The old entries stay behind until the list
+	// compacts itself, iterators skip them since they no longer match the topic's timestamp.
+	writable().ts = ts;
+	ts_by_ord.set(ord, ts);
 	foreach (tag_t* tag, tags) {
-		tag->topics.erase(this);
+		tag->topics.refile(ord, old_ts);
 	}
 	foreach (word_t* word, document) {
-		word->topics_documents.erase(this);
+		word->topics_documents.refile(ord, old_ts);
 	}
 	foreach (word_t* word, title) {
-		word->topics_titles.erase(this);
+		word->topics_titles.refile(ord, old_ts);
 	}
+}
 
-	// Bump the topic and add back to tag sets
-	this->ts = ts;
-	foreach (tag_t* tag, tags) {
-		tag->topics.insert(this);
+/**
+ * The topic's state for the writer to change, copied if it's been published.
+ */
+topic_state_t& topic_t::writable() {
+	if (state->txn != write_txn_t::current()) {
+		topic_state_t* copy = new topic_state_t(*state);
+		copy->txn = write_txn_t::current();
+		copy->previous = state;
+		state = copy;
+		write_txn_t::touch(this, &publish_state);
 	}
-	foreach (word_t* word, document) {
-		word->topics_documents.insert(this);
+	return *state;
+}
+
+/**
+ * State as of the reader's snapshot, for readers. The topic must have been published by then.
+ */
+const topic_state_t& topic_t::snapshot() const {
+	const topic_state_t* state = published_state.load(boost::memory_order_acquire);
+	while (!snapshot_t::covers(state->seq)) {
+		state = state->previous;
 	}
-	foreach (word_t* word, title) {
-		word->topics_titles.insert(this);
+	return *state;
+}
+
+/**
+ * Publishes the writer's state and retires the one it replaces, which readers can still reach
+ * through `previous` until their snapshots move past this commit.
+ */
+void topic_t::publish_state(void* topic) {
+	topic_t& self = *static_cast<topic_t*>(topic);
+	const topic_state_t* prev = self.published_state.load(boost::memory_order_relaxed);
+	self.state->seq = write_txn_t::publishing();
+	if (!prev || prev->ts != self.state->ts) {
+		published_seq_by_ord.set(self.ord, changing);
+		published_ts_by_ord.set(self.ord, self.state->ts);
+		published_seq_by_ord.set(self.ord, self.state->seq);
 	}
+	self.published_state.store(self.state, boost::memory_order_release);
+	epoch_t::retire(const_cast<topic_state_t*>(prev));
+}
+
+/**
+ * Hot score as of `now` with posts from `users` distinct users. It's never more than `users`, which
+ * lets a walk down topics_by_activity stop early.
+ */
+double topic_state_t::score(time_t now, size_t users) const {
+	double age = (now - created) / topic_cutoff;
+	return (1 - age * age) * users;
+}
+
+double topic_state_t::score(time_t now) const {
+	return score(now, activity.users());
 }
 
-double topic_t::score() const {
-	return (1 - pow((time(NULL) - created) / topic_cutoff, 2)) * message_counts.size();
+tag_t* tag_t::find(id_t id) {
+	return tags_by_id.get(id);
 }
 
 tag_t& tag_t::get(id_t id) {
-	if (tags_by_id.size() < id) {
-		tags_by_id.resize(id, NULL);
-	}
-	tag_t* tag = tags_by_id[id - 1];
+	tag_t* tag = tags_by_id.get(id);
 	if (tag == NULL) {
 		tag = new tag_t();
-		tags_by_id[id - 1] = tag;
+		tags_by_id.set(id, tag);
 	}
 	return *tag;
 }
 
-word_t* word_t::find(const string& str) {
-	map<const string, word_t*>::iterator ii = words_by_string.find(str);
-	if (ii != words_by_string.end()) {
-		return ii->second;
+void tag_t::insert(topic_t* topic) {
+	if (topics.insert(topic->ord)) {
+		if (members) {
+			members->set(topic->ord);
+		} else {
+			check_density();
+		}
+	}
+}
+
+void tag_t::erase(topic_t* topic) {
+	topics.erase(topic->ord);
+	if (members) {
+		members->reset(topic->ord);
+	}
+}
+
+void tag_t::clear() {
+	topics.clear();
+	if (members) {
+		members->clear();
+	}
+}
+
+/**
+ * Starts keeping a bitmap of the tag's topics once it covers enough of the index. Queries can then
+ * check whether a topic is in the tag without walking its list. The bitmap is kept from then on
+ * even if the tag shrinks again.
+ */
+void tag_t::check_density() {
+	if (members || topics.size() < dense_tag_min || topics.size() * dense_tag_ratio < topic_t::topics_by_ord.size()) {
+		return;
+	}
+	members = new bitmap_t;
+	foreach (topic_t::ord_t ord, topics) {
+		members->set(ord);
+	}
+	write_txn_t::touch(this, &publish_members);
+}
+
+void tag_t::publish_members(void* tag) {
+	tag_t& self = *static_cast<tag_t*>(tag);
+	self.members_seq.store(write_txn_t::publishing(), boost::memory_order_relaxed);
+	self.published_members.store(self.members, boost::memory_order_release);
+}
+
+void tag_t::set_inverse(tag_t* inverse) {
+	inverse_tag = inverse;
+	write_txn_t::touch(this, &publish_inverse);
+}
+
+void tag_t::publish_inverse(void* tag) {
+	tag_t& self = *static_cast<tag_t*>(tag);
+	self.inverse_seq.store(write_txn_t::publishing(), boost::memory_order_relaxed);
+	self.published_inverse_tag.store(self.inverse_tag, boost::memory_order_release);
+}
+
+/**
+ * Looks up a word in either the published dictionary or the writer's copy.
+ */
+static word_t* find_word(word_t::dictionary_t::view_t view, const string& str) {
+	word_t::dictionary_t::const_iterator ii = view.lower_bound(str.c_str(), NULL);
+	if (!ii.at_end() && str == ii.key()) {
+		return *ii;
 	}
 	return NULL;
 }
 
+word_t* word_t::find(const string& str) {
+	return find_word(words_by_string.view(), str);
+}
+
 word_t& word_t::get(const string& str) {
-	map<const string, word_t*>::iterator ii = words_by_string.find(str);
-	if (ii != words_by_string.end()) {
-		return *ii->second;
+	word_t* word = find_word(words_by_string.working_view(), str);
+	if (word) {
+		return *word;
 	}
-	word_t& word = *new word_t(str);
-	words_by_string.insert(make_pair(str, &word));
-	return word;
+	word = new word_t(str);
+	words_by_string.insert(word);
+	return *word;
 }
 
 /**
  * Abstract iterator for tagd expressions because I'm not smart enough to extend std::iterator.
+ *
+ * Topics can be bumped while a query is running, so iterators are ordered by the timestamp each
+ * topic was filed under in the snapshot being read (`ts()`) rather than the topic's current `ts`.
+ * Entries are only skipped as stale if the topic had moved on by the time the snapshot began, so
+ * a query sees every topic exactly where the snapshot has it.
  */
-struct topic_iterator_t {
+struct topic_iterator_t: public arena_object_t {
 	typedef auto_ptr<topic_iterator_t> ptr;
 	typedef ptr_vector<topic_iterator_t> ptr_vector_t;
 	virtual ~topic_iterator_t() {};
 	virtual void ff(const base_topic_t* ref) = 0;
+
+	/**
+	 * Most topics this could return, which is what the planner goes by.
+	 */
 	virtual size_t max() const = 0;
+
+	/**
+	 * Bitmap of exactly the topics this returns, if there is one. The planner checks membership in
+	 * it instead of iterating when that's cheaper.
+	 */
+	virtual const bitmap_t::view_t* members() const {
+		return NULL;
+	}
+
 	virtual topic_iterator_t& operator++ () = 0;
-	virtual const topic_t* operator* () const = 0;
-	const topic_t* operator-> () const {
-		return **this;
+
+	/**
+	 * Ordinal of the current topic, 0 at the end.
+	 */
+	virtual topic_t::ord_t operator* () const = 0;
+	virtual topic_t::ts_t ts() const = 0;
+
+	/**
+	 * Copies out up to `max` topics from the current one on, along with their timestamps, and moves
+	 * past them. Returns how many were copied, which is only 0 at the end. The block iterators below
+	 * read their inputs this way.
+	 */
+	virtual size_t read(topic_t::ts_t* ts, topic_t::ord_t* ords, size_t max) {
+		size_t count = 0;
+		for (topic_t::ord_t ord = **this; ord && count < max; ord = *++*this) {
+			ts[count] = this->ts();
+			ords[count] = ord;
+			++count;
+		}
+		return count;
+	}
+
+	/**
+	 * Orders iterators by max(), smallest first.
+	 */
+	struct fewer {
+		typedef bool result_type;
+		bool operator() (const topic_iterator_t& left, const topic_iterator_t& right) const {
+			return left.max() < right.max();
+		}
+	};
+
+	/**
+	 * Current topic as it was filed, only valid if there is a current topic.
+	 */
+	base_topic_t position() const {
+		return base_topic_t(**this, ts());
+	}
+
+	/**
+	 * True if the current topic comes before `ref`.
+	 */
+	bool before(const base_topic_t& ref) const {
+		base_topic_t pos(position());
+		return topic_posting_traits::less(pos.ts, pos.ord, ref.ts, ref.ord);
+	}
+
+	/**
+	 * True if the current topic comes after `ref`.
+	 */
+	bool after(const base_topic_t& ref) const {
+		base_topic_t pos(position());
+		return topic_posting_traits::less(ref.ts, ref.ord, pos.ts, pos.ord);
 	}
 };
 
@@ -225,28 +720,34 @@ struct null_topic_iterator_t: public topic_iterator_t {
 		return *this;
 	}
 
-	virtual topic_t* operator* () const {
-		return NULL;
+	virtual topic_t::ord_t operator* () const {
+		return 0;
+	}
+
+	virtual topic_t::ts_t ts() const {
+		assert(false);
+		return 0;
 	}
 };
 
 /**
- * Basic adapter on top of topic_set_t.
+ * Basic adapter on top of a view of tag_t::topic_set_t or word_t::topic_set_t.
  */
+template <class topic_set_t>
 struct basic_topic_iterator_t: public topic_iterator_t {
-	const tag_t::topic_set_t& topic_set;
-	tag_t::topic_set_t::const_iterator it;
+	typename topic_set_t::view_t view;
+	typename topic_set_t::const_iterator it;
 
-	basic_topic_iterator_t(const tag_t::topic_set_t& topic_set) : topic_set(topic_set), it(topic_set.begin()) {};
+	basic_topic_iterator_t(const topic_set_t& topic_set) : view(topic_set.view()), it(view.begin()) {};
 
 	virtual void ff(const base_topic_t* ref) {
-		assert(it != topic_set.end());
-		assert(topic_t::less()(*it, ref) || !topic_t::less()(ref, *it));
-		it = topic_set.lower_bound(static_cast<topic_t*>(const_cast<base_topic_t*>(ref)));
+		assert(!it.at_end());
+		assert(!after(*ref));
+		it.seek(ref->ts, ref->ord);
 	}
 
 	virtual size_t max() const {
-		return topic_set.size();
+		return view.size();
 	}
 
 	virtual basic_topic_iterator_t& operator++ () {
@@ -254,251 +755,888 @@ struct basic_topic_iterator_t: public topic_iterator_t {
 		return *this;
 	}
 
-	virtual const topic_t* operator* () const {
-		return it == topic_set.end() ? NULL : *it;
+	virtual topic_t::ord_t operator* () const {
+		return it.at_end() ? 0 : *it;
+	}
+
+	virtual topic_t::ts_t ts() const {
+		return it.key();
+	}
+
+	virtual size_t read(topic_t::ts_t* ts, topic_t::ord_t* ords, size_t max) {
+		return it.read(ts, ords, max);
 	}
 };
+typedef basic_topic_iterator_t<tag_t::topic_set_t> tag_topic_iterator_t;
+typedef basic_topic_iterator_t<word_t::topic_set_t> word_topic_iterator_t;
 
 /**
- * Union iterator, returns topics in ANY of the iterators
+ * Iterator over a dense tag, which also has its bitmap.
  */
-struct union_topic_iterator_t: public topic_iterator_t {
-	auto_ptr<topic_iterator_t::ptr_vector_t> iterators;
-	const topic_t* current;
+struct dense_tag_topic_iterator_t: public tag_topic_iterator_t {
+	bitmap_t::view_t bitmap;
 
-	union_topic_iterator_t(auto_ptr<topic_iterator_t::ptr_vector_t> iterators) : iterators(iterators) {
-		update();
-	}
+	dense_tag_topic_iterator_t(const tag_t& tag, const bitmap_t& bitmap) : tag_topic_iterator_t(tag.topics), bitmap(bitmap.view()) {}
 
-	void update() {
-		// Find first topic from iterators
-		topic_iterator_t::ptr_vector_t& iterators = *this->iterators;
-		current = *iterators[0];
-		for (size_t ii = 1; ii < iterators.size(); ++ii) {
-			if (current == NULL || (*iterators[ii] && topic_t::less()(*iterators[ii], current))) {
-				current = *iterators[ii];
-			}
-		};
+	virtual const bitmap_t::view_t* members() const {
+		return &bitmap;
 	}
+};
 
-	virtual void ff(const base_topic_t* ref) {
-		// Fast-forward each iterator individually
-		foreach (topic_iterator_t& ii, *iterators) {
-			if (*ii != NULL && topic_t::less()(*ii, ref)) {
-				ii.ff(ref);
-			}
-		}
-		update();
+/**
+ * Iterator over a tag as of the current snapshot.
+ */
+topic_iterator_t::ptr tag_iterator(const tag_t& tag) {
+	const bitmap_t* bitmap = tag.reader_members();
+	if (bitmap) {
+		return topic_iterator_t::ptr(new dense_tag_topic_iterator_t(tag, *bitmap));
 	}
+	return topic_iterator_t::ptr(new tag_topic_iterator_t(tag.topics));
+}
 
-	virtual size_t max() const {
-		size_t max = 0;
-		foreach (topic_iterator_t& iterator, *iterators) {
-			size_t my_max = iterator.max();
-			if (my_max > max) {
-				max = my_max;
-			}
-		}
-		return max;
+typedef run_t<topic_posting_traits> topic_run_t;
+typedef set_kernels_t<topic_posting_traits> topic_kernels_t;
+
+/**
+ * Where a cursor reads from: any iterator, through its virtual interface.
+ */
+struct iterator_source_t {
+	topic_iterator_t* iterator;
+
+	iterator_source_t(topic_iterator_t& iterator) : iterator(&iterator) {}
+
+	size_t read(topic_t::ts_t* ts, topic_t::ord_t* ords, size_t max) {
+		return iterator->read(ts, ords, max);
 	}
 
-	virtual union_topic_iterator_t& operator++ () {
-		// Advance iterators which are currently pointing at the current topic
-		foreach (topic_iterator_t& ii, *iterators) {
-			if (*ii == current) {
-				++ii;
-			}
+	/**
+	 * Fast-forwards to `ref`, unless it's already there.
+	 */
+	void seek(const base_topic_t& ref) {
+		if (**iterator && iterator->before(ref)) {
+			iterator->ff(&ref);
 		}
-		update();
-		return *this;
 	}
 
-	virtual const topic_t* operator* () const {
-		return current;
+	size_t max() const {
+		return iterator->max();
 	}
 };
 
 /**
- * Intersection iterator, returns topics in ALL of the iterators
+ * Where a cursor reads from: a tag or word list, straight from the list's own iterator. Used by the
+ * specialized iterators below so nothing in between is virtual.
  */
-struct intersection_topic_iterator_t: public topic_iterator_t {
-	auto_ptr<topic_iterator_t::ptr_vector_t> iterators;
-	const topic_t* current;
+template <class topic_set_t>
+struct list_source_t {
+	typename topic_set_t::view_t view;
+	typename topic_set_t::const_iterator it;
 
-	intersection_topic_iterator_t(auto_ptr<topic_iterator_t::ptr_vector_t> iterators) : iterators(iterators) {
-		update();
-	}
+	list_source_t(const basic_topic_iterator_t<topic_set_t>& iterator) : view(iterator.view), it(iterator.it) {}
 
-	void update() {
-		topic_iterator_t::ptr_vector_t& iterators = *this->iterators;
-		const topic_t* oldest = *iterators[0];
-		size_t oldest_ii = 0, ii = 1;
+	size_t read(topic_t::ts_t* ts, topic_t::ord_t* ords, size_t max) {
+		return it.read(ts, ords, max);
+	}
 
-		if (oldest == NULL) {
-			current = NULL;
-			return;
+	void seek(const base_topic_t& ref) {
+		if (!it.at_end() && topic_posting_traits::less(it.key(), *it, ref.ts, ref.ord)) {
+			it.seek(ref.ts, ref.ord);
 		}
-		do {
-			// Keep cycling through all the iterators
-			if (ii >= iterators.size()) {
-				ii = 0;
-			}
-			if (*iterators[ii] == NULL) {
-				// If we hit the end of any iterator there's no more intersections
-				current = NULL;
-				break;
-			} else if (oldest_ii == ii) {
-				// If we've made a cycle without fast forwarding then there's an intersection!
-				current = oldest;
-				break;
-			}
+	}
 
-			if (topic_t::less()(oldest, *iterators[ii])) {
-				// Found a topic older
-				oldest = *iterators[ii];
-				oldest_ii = ii;
-				++ii;
-			} else if (topic_t::less()(*iterators[ii], oldest)) {
-				// Not the same topic, fast forward and try again
-				iterators[ii].ff(oldest);
-			} else {
-				// Topic found in more than one iterators
-				++ii;
-			}
-		} while (true);
+	size_t max() const {
+		return view.size();
 	}
+};
 
-	virtual void ff(const base_topic_t* ref) {
-		// Fast-forward each iterator individually
-		foreach (topic_iterator_t& ii, *iterators) {
-			if (*ii != NULL && topic_t::less()(*ii, ref)) {
-				ii.ff(ref);
-			}
-		}
-		update();
+/**
+ * Reads ahead from a source a block at a time, for the block iterators below. What's left of the
+ * block is in `run`, which the kernels work through directly. `run` is only left empty once the
+ * source has run out too.
+ */
+template <class source_t>
+struct topic_cursor_t: public arena_object_t {
+	static const size_t block_size = 64;
+	source_t source;
+	topic_t::ts_t ts[block_size];
+	topic_t::ord_t ords[block_size];
+	topic_run_t run;
+
+	topic_cursor_t(const source_t& source) : source(source) {
+		run.keys = ts;
+		run.values = ords;
+		fill();
 	}
 
-	virtual size_t max() const {
-		size_t min = 0xffffffff;
-		foreach (topic_iterator_t& iterator, *iterators) {
-			size_t my_max = iterator.max();
-			if (my_max < min) {
-				min = my_max;
-			}
-		}
-		return min;
+	void fill() {
+		run.pos = 0;
+		run.count = source.read(ts, ords, block_size);
 	}
 
-	virtual intersection_topic_iterator_t& operator++ () {
-		// Advance all iterators
-		foreach (topic_iterator_t& ii, *iterators) {
-			++ii;
+	/**
+	 * Reads the next block if a kernel has used this one up.
+	 */
+	void refill() {
+		if (run.empty()) {
+			fill();
 		}
-		update();
-		return *this;
 	}
 
-	virtual const topic_t* operator* () const {
-		return current;
+	bool at_end() const {
+		return run.empty();
 	}
-};
 
-/**
- * Difference iterator, returns topics that appear in `left`, but not `right`
- */
-struct difference_topic_iterator_t: public topic_iterator_t {
-	auto_ptr<topic_iterator_t> left;
-	auto_ptr<topic_iterator_t> right;
-	const topic_t* current;
+	topic_t::ts_t head_ts() const {
+		return ts[run.pos];
+	}
 
-	difference_topic_iterator_t(auto_ptr<topic_iterator_t> left, auto_ptr<topic_iterator_t> right) : left(left), right(right) {
-		update();
+	topic_t::ord_t head() const {
+		return ords[run.pos];
 	}
 
-	void update() {
-		do {
-			if (!**left) {
-				// If there's no more items in `left` it's done
-				current = NULL;
-				return;
-			} else if (**right == NULL || topic_t::less()(**left , **right)) {
-				// If `right` is older than `left` then `left` does not appear in `right`
-				current = **left;
-				return;
-			} else if (topic_t::less()(**right, **left)) {
-				// If `left` is older than `right` then it's inconclusive.. fast forward
-				right->ff(**left);
-			} else {
-				// If they equal then an intersection has occured and this item in `left` should be skipped
-				++*left;
-				++*right;
-			}
-		} while (true);
+	template <class other_t>
+	bool before(const topic_cursor_t<other_t>& other) const {
+		return topic_posting_traits::less(head_ts(), head(), other.head_ts(), other.head());
 	}
 
-	virtual void ff(const base_topic_t* ref) {
-		// Fast-forward both iterators individually
-		left->ff(ref);
-		if (**right != NULL && topic_t::less()(**right, ref)) {
-			right->ff(ref);
+	template <class other_t>
+	bool same(const topic_cursor_t<other_t>& other) const {
+		return head() == other.head() && head_ts() == other.head_ts();
+	}
+
+	void next() {
+		if (++run.pos == run.count) {
+			fill();
 		}
-		update();
 	}
 
-	virtual size_t max() const {
-		return left->max();
+	/**
+	 * Moves forward to the first topic not before topic `ord` filed under `ts`. If that's past this
+	 * block the source skips ahead instead of reading everything in between.
+	 */
+	void seek(topic_t::ts_t ts, topic_t::ord_t ord) {
+		run.pos += topic_kernels_t::count_before(run, ts, ord);
+		if (run.empty()) {
+			source.seek(base_topic_t(ord, ts));
+			fill();
+		}
 	}
 
-	virtual difference_topic_iterator_t& operator++ () {
-		// Only need to advance the left iterator since right will be advanced in update()
-		++*left;
-		update();
-		return *this;
+	void seek(const base_topic_t& ref) {
+		seek(ref.ts, ref.ord);
 	}
 
-	virtual const topic_t* operator* () const {
-		return current;
+	/**
+	 * Moves forward to where `other` is.
+	 */
+	template <class other_t>
+	void seek(const topic_cursor_t<other_t>& other) {
+		if (other.at_end()) {
+			refill();
+		} else {
+			seek(other.head_ts(), other.head());
+		}
 	}
+
+	private:
+		// Non-copyable
+		topic_cursor_t(const topic_cursor_t&);
+		topic_cursor_t& operator=(const topic_cursor_t&);
 };
+typedef topic_cursor_t<iterator_source_t> iterator_cursor_t;
 
 /**
- * Message from the binlog watcher to update a topic's timestamp.
+ * Intersects two cursors into `out` until something turns up or either runs out.
  */
-void msg_bump_topic(Worker& worker, const vector<Worker::value_t>& args) {
-	boost::lock_guard<boost::shared_mutex> lock(write_lock);
-	topic_t::id_t id = args[0].get_uint64();
-	topic_t::ts_t ts = args[1].get_int();
-	topic_t::user_t user = args[2].get_int();
-
-	topic_t* topic = topic_t::find(id);
-	if (topic) {
-		topic->bump(ts);
-		if (time(NULL) - topic_cutoff < topic->created) {
-			topic->messages.insert(make_pair(ts, user));
-			++topic->message_counts[user];
-			tag_t::active_tag.topics.insert(topic);
-			topic->tags.insert(&tag_t::active_tag);
+template <class left_t, class right_t>
+void intersect_cursors(left_t& left, right_t& right, topic_run_t& out) {
+	size_t start = out.pos;
+	while (out.pos == start && !left.at_end() && !right.at_end()) {
+		topic_kernels_t::intersect(left.run, right.run, out);
+		// Catch whichever ran out of its block up with the other
+		if (left.run.empty()) {
+			right.refill();
+			left.seek(right);
+		} else if (right.run.empty()) {
+			right.seek(left);
 		}
 	}
 }
 
 /**
- * Message from the binlog watcher when a topic is created.
+ * Writes topics in `left` but not `right` to `out` until the end of a block of `left` that turned
+ * something up, or `out` fills.
  */
-void msg_created_topic(Worker& worker, const vector<Worker::value_t>& args) {
-	boost::lock_guard<boost::shared_mutex> lock(write_lock);
-	topic_t::id_t id = args[0].get_uint64();
-	topic_t::ts_t ts = args[1].get_int();
-
-	topic_t& topic = topic_t::get(id, ts);
-	topic.created = ts;
-}
+template <class left_t, class right_t>
+void subtract_cursors(left_t& left, right_t& right, topic_run_t& out) {
+	size_t start = out.pos;
+	while (!out.empty() && !left.at_end()) {
+		if (right.at_end()) {
+			// Nothing left to take out
+			topic_kernels_t::copy(left.run, out, min(left.run.remaining(), out.remaining()));
+		} else {
+			topic_kernels_t::subtract(left.run, right.run, out);
+		}
+		bool boundary = left.run.empty();
+		left.refill();
+		if (right.run.empty()) {
+			right.seek(left);
+		}
+		if (boundary && out.pos != start) {
+			return;
+		}
+	}
+}
+
+/**
+ * Base for iterators which combine their inputs a block at a time with the set kernels, instead of
+ * stepping each input one topic at a time. The current block is handed out a topic at a time, or
+ * copied out whole by read().
+ */
+struct block_topic_iterator_t: public topic_iterator_t {
+	topic_t::ts_t block_ts[topic_cursor_t<iterator_source_t>::block_size];
+	topic_t::ord_t block_ords[topic_cursor_t<iterator_source_t>::block_size];
+	topic_run_t block;
+
+	block_topic_iterator_t() {
+		block.keys = block_ts;
+		block.values = block_ords;
+		block.pos = block.count = 0;
+	}
+
+	/**
+	 * Writes the topics following the ones already worked out to `out`. Has to write at least one
+	 * unless there are none left, but may stop before `out` is full rather than read much further
+	 * ahead.
+	 */
+	virtual void fill(topic_run_t& out) = 0;
+
+	/**
+	 * Moves the inputs forward so the next fill() starts from `ref`.
+	 */
+	virtual void seek(const base_topic_t& ref) = 0;
+
+	/**
+	 * Works out the next block. Constructors of derived iterators call this for the first one.
+	 */
+	void refill() {
+		block.pos = 0;
+		block.count = topic_cursor_t<iterator_source_t>::block_size;
+		fill(block);
+		block.count = block.pos;
+		block.pos = 0;
+	}
+
+	virtual void ff(const base_topic_t* ref) {
+		assert(!block.empty());
+		assert(!after(*ref));
+		block.pos += topic_kernels_t::count_before(block, ref->ts, ref->ord);
+		if (block.empty()) {
+			seek(*ref);
+			refill();
+		}
+	}
+
+	virtual block_topic_iterator_t& operator++ () {
+		if (++block.pos == block.count) {
+			refill();
+		}
+		return *this;
+	}
+
+	virtual topic_t::ord_t operator* () const {
+		return block.empty() ? 0 : block_ords[block.pos];
+	}
+
+	virtual topic_t::ts_t ts() const {
+		return block_ts[block.pos];
+	}
+
+	virtual size_t read(topic_t::ts_t* ts, topic_t::ord_t* ords, size_t max) {
+		topic_run_t out = { ts, ords, 0, max };
+		topic_kernels_t::copy(block, out, min(block.remaining(), max));
+		if (!out.empty()) {
+			fill(out);
+		}
+		if (block.empty()) {
+			refill();
+		}
+		return out.pos;
+	}
+};
+
+/**
+ * Block iterator over any number of other iterators, read through their virtual interface.
+ */
+struct compound_topic_iterator_t: public block_topic_iterator_t {
+	auto_ptr<topic_iterator_t::ptr_vector_t> iterators;
+	ptr_vector<iterator_cursor_t> cursors;
+
+	compound_topic_iterator_t(auto_ptr<topic_iterator_t::ptr_vector_t> iterators) : iterators(iterators) {
+		foreach (topic_iterator_t& iterator, *this->iterators) {
+			cursors.push_back(new iterator_cursor_t(iterator));
+		}
+	}
+
+	virtual void seek(const base_topic_t& ref) {
+		foreach (iterator_cursor_t& cursor, cursors) {
+			cursor.seek(ref);
+		}
+	}
+};
+
+/**
+ * Wraps one or two iterators up as a list, for compound_topic_iterator_t.
+ */
+auto_ptr<topic_iterator_t::ptr_vector_t> iterator_list(auto_ptr<topic_iterator_t> first, auto_ptr<topic_iterator_t> second = auto_ptr<topic_iterator_t>()) {
+	auto_ptr<topic_iterator_t::ptr_vector_t> iterators(new topic_iterator_t::ptr_vector_t);
+	iterators->push_back(first);
+	if (second.get()) {
+		iterators->push_back(second);
+	}
+	return iterators;
+}
+
+/**
+ * Filter iterator, returns topics from `iterator` which are in all of the `include` bitmaps and none
+ * of the `exclude` ones. Stands in for intersections and differences against dense tags, which
+ * would otherwise have to step through lists covering a good part of the index.
+ */
+struct filter_topic_iterator_t: public compound_topic_iterator_t {
+	vector<bitmap_t::view_t> include;
+	vector<bitmap_t::view_t> exclude;
+
+	filter_topic_iterator_t(auto_ptr<topic_iterator_t> iterator, const vector<bitmap_t::view_t>& include, const vector<bitmap_t::view_t>& exclude) :
+		compound_topic_iterator_t(iterator_list(iterator)), include(include), exclude(exclude) {
+		refill();
+	}
+
+	bool accept(topic_t::ord_t ord) const {
+		foreach (const bitmap_t::view_t& bitmap, include) {
+			if (!bitmap.test(ord)) {
+				return false;
+			}
+		}
+		foreach (const bitmap_t::view_t& bitmap, exclude) {
+			if (bitmap.test(ord)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	virtual void fill(topic_run_t& out) {
+		iterator_cursor_t& input = cursors[0];
+		size_t start = out.pos;
+		while (!out.empty() && !input.at_end()) {
+			for (; !input.run.empty() && !out.empty(); ++input.run.pos) {
+				if (accept(input.head())) {
+					out.keys[out.pos] = input.head_ts();
+					out.values[out.pos] = input.head();
+					++out.pos;
+				}
+			}
+			input.refill();
+			if (out.pos != start) {
+				return;
+			}
+		}
+	}
+
+	virtual size_t max() const {
+		size_t max = iterators->front().max();
+		foreach (const bitmap_t::view_t& bitmap, include) {
+			if (bitmap.size() < max) {
+				max = bitmap.size();
+			}
+		}
+		return max;
+	}
+};
+
+/**
+ * Union iterator, returns topics in ANY of the iterators. A few inputs are just compared with each
+ * other, more than that are kept in a heap ordered by where they're up to.
+ */
+struct union_topic_iterator_t: public compound_topic_iterator_t {
+	static const size_t linear_fan_in = 8;
+	vector<iterator_cursor_t*> heap;
+
+	/**
+	 * Heap comparison, the input with the first topic goes on top.
+	 */
+	struct later {
+		bool operator() (const iterator_cursor_t* left, const iterator_cursor_t* right) const {
+			return right->before(*left);
+		}
+	};
+
+	union_topic_iterator_t(auto_ptr<topic_iterator_t::ptr_vector_t> iterators) : compound_topic_iterator_t(iterators) {
+		if (cursors.size() > linear_fan_in) {
+			make_heap();
+		}
+		refill();
+	}
+
+	void make_heap() {
+		heap.clear();
+		foreach (iterator_cursor_t& cursor, cursors) {
+			if (!cursor.at_end()) {
+				heap.push_back(&cursor);
+			}
+		}
+		std::make_heap(heap.begin(), heap.end(), later());
+	}
+
+	virtual void seek(const base_topic_t& ref) {
+		compound_topic_iterator_t::seek(ref);
+		if (cursors.size() > linear_fan_in) {
+			make_heap();
+		}
+	}
+
+	virtual void fill(topic_run_t& out) {
+		if (cursors.size() > linear_fan_in) {
+			fill_heap(out);
+			return;
+		}
+		while (!out.empty()) {
+			// Find the input with the first topic, and the first topic in any of the others
+			iterator_cursor_t* first = NULL;
+			foreach (iterator_cursor_t& cursor, cursors) {
+				if (!cursor.at_end() && (first == NULL || cursor.before(*first))) {
+					first = &cursor;
+				}
+			}
+			if (first == NULL) {
+				return;
+			}
+			iterator_cursor_t* next = NULL;
+			bool shared = false;
+			foreach (iterator_cursor_t& cursor, cursors) {
+				if (&cursor == first || cursor.at_end()) {
+					continue;
+				} else if (cursor.same(*first)) {
+					shared = true;
+				} else if (next == NULL || cursor.before(*next)) {
+					next = &cursor;
+				}
+			}
+
+			if (shared) {
+				// Topic found in more than one input, write it once and move them all along
+				out.keys[out.pos] = first->head_ts();
+				out.values[out.pos] = first->head();
+				++out.pos;
+				foreach (iterator_cursor_t& cursor, cursors) {
+					if (&cursor != first && !cursor.at_end() && cursor.same(*first)) {
+						cursor.next();
+					}
+				}
+				first->next();
+			} else {
+				// Everything in `first` up to where the next input is can go out as is
+				size_t count = next ?
+					topic_kernels_t::count_before(first->run, next->head_ts(), next->head()) :
+					first->run.remaining();
+				topic_kernels_t::copy(first->run, out, min(count, out.remaining()));
+				first->refill();
+			}
+		}
+	}
+
+	/**
+	 * Same as above with the inputs in a heap, so each step costs log(k) instead of k.
+	 */
+	void fill_heap(topic_run_t& out) {
+		while (!out.empty() && !heap.empty()) {
+			std::pop_heap(heap.begin(), heap.end(), later());
+			iterator_cursor_t* first = heap.back();
+			heap.pop_back();
+			if (!heap.empty() && heap.front()->same(*first)) {
+				// Topic found in more than one input, write it once and move them all along
+				out.keys[out.pos] = first->head_ts();
+				out.values[out.pos] = first->head();
+				++out.pos;
+				while (!heap.empty() && heap.front()->same(*first)) {
+					std::pop_heap(heap.begin(), heap.end(), later());
+					heap.back()->next();
+					if (heap.back()->at_end()) {
+						heap.pop_back();
+					} else {
+						std::push_heap(heap.begin(), heap.end(), later());
+					}
+				}
+				first->next();
+			} else {
+				// Everything in `first` up to where the next input is can go out as is
+				size_t count = heap.empty() ?
+					first->run.remaining() :
+					topic_kernels_t::count_before(first->run, heap.front()->head_ts(), heap.front()->head());
+				topic_kernels_t::copy(first->run, out, min(count, out.remaining()));
+				first->refill();
+			}
+			if (!first->at_end()) {
+				heap.push_back(first);
+				std::push_heap(heap.begin(), heap.end(), later());
+			}
+		}
+	}
+
+	virtual size_t max() const {
+		size_t max = 0;
+		foreach (topic_iterator_t& iterator, *iterators) {
+			max += iterator.max();
+		}
+		return max;
+	}
+};
+
+/**
+ * Union of lots of iterators, read out in full and sorted when it's built. A merge would need a
+ * cursor's worth of memory for each input, which adds up for wildcards matching lots of rare words.
+ * See --materialize-unions.
+ */
+struct materialized_topic_iterator_t: public block_topic_iterator_t {
+	struct entry_t {
+		topic_t::ts_t ts;
+		topic_t::ord_t ord;
+
+		bool operator< (const entry_t& other) const {
+			return topic_posting_traits::less(ts, ord, other.ts, other.ord);
+		}
+
+		bool operator== (const entry_t& other) const {
+			return ord == other.ord && ts == other.ts;
+		}
+	};
+	static size_t min_fan_in;
+	vector<entry_t> entries;
+	size_t pos;
+
+	materialized_topic_iterator_t(topic_iterator_t::ptr_vector_t& iterators) : pos(0) {
+		size_t max = 0;
+		foreach (topic_iterator_t& iterator, iterators) {
+			max += iterator.max();
+		}
+		entries.reserve(max);
+		topic_t::ts_t ts[iterator_cursor_t::block_size];
+		topic_t::ord_t ords[iterator_cursor_t::block_size];
+		foreach (topic_iterator_t& iterator, iterators) {
+			while (size_t count = iterator.read(ts, ords, iterator_cursor_t::block_size)) {
+				for (size_t ii = 0; ii < count; ++ii) {
+					entry_t entry = { ts[ii], ords[ii] };
+					entries.push_back(entry);
+				}
+			}
+		}
+		std::sort(entries.begin(), entries.end());
+		entries.erase(std::unique(entries.begin(), entries.end()), entries.end());
+		refill();
+	}
+
+	virtual void fill(topic_run_t& out) {
+		for (; pos < entries.size() && !out.empty(); ++pos, ++out.pos) {
+			out.keys[out.pos] = entries[pos].ts;
+			out.values[out.pos] = entries[pos].ord;
+		}
+	}
+
+	virtual void seek(const base_topic_t& ref) {
+		entry_t entry = { ref.ts, ref.ord };
+		pos = std::lower_bound(entries.begin() + pos, entries.end(), entry) - entries.begin();
+	}
+
+	virtual size_t max() const {
+		return entries.size();
+	}
+};
+size_t materialized_topic_iterator_t::min_fan_in = 4096;
+
+/**
+ * Puts together a union, sorting it up front if it has enough inputs.
+ */
+topic_iterator_t::ptr build_union(auto_ptr<topic_iterator_t::ptr_vector_t> iterators) {
+	if (materialized_topic_iterator_t::min_fan_in && iterators->size() >= materialized_topic_iterator_t::min_fan_in) {
+		return topic_iterator_t::ptr(new materialized_topic_iterator_t(*iterators));
+	}
+	return topic_iterator_t::ptr(new union_topic_iterator_t(iterators));
+}
+
+/**
+ * Intersection iterator, returns topics in ALL of the iterators
+ */
+struct intersection_topic_iterator_t: public compound_topic_iterator_t {
+	intersection_topic_iterator_t(auto_ptr<topic_iterator_t::ptr_vector_t> iterators) : compound_topic_iterator_t(iterators) {
+		assert(cursors.size() >= 2);
+		refill();
+	}
+
+	virtual void fill(topic_run_t& out) {
+		size_t start = out.pos;
+		while (out.pos == start) {
+			foreach (iterator_cursor_t& cursor, cursors) {
+				if (cursor.at_end()) {
+					// If we hit the end of any iterator there's no more intersections
+					return;
+				}
+			}
+
+			// Intersect the first two, then look for what they have in common in the rest
+			size_t found = out.pos;
+			intersect_cursors(cursors[0], cursors[1], out);
+			size_t kept = found;
+			for (size_t ii = found; ii < out.pos; ++ii) {
+				bool everywhere = true;
+				for (size_t jj = 2; everywhere && jj < cursors.size(); ++jj) {
+					iterator_cursor_t& cursor = cursors[jj];
+					cursor.seek(out.keys[ii], out.values[ii]);
+					everywhere = !cursor.at_end() && cursor.head() == out.values[ii] && cursor.head_ts() == out.keys[ii];
+				}
+				if (everywhere) {
+					out.keys[kept] = out.keys[ii];
+					out.values[kept] = out.values[ii];
+					++kept;
+				}
+			}
+			out.pos = kept;
+		}
+	}
+
+	virtual size_t max() const {
+		size_t min = 0xffffffff;
+		foreach (topic_iterator_t& iterator, *iterators) {
+			size_t my_max = iterator.max();
+			if (my_max < min) {
+				min = my_max;
+			}
+		}
+		return min;
+	}
+};
+
+/**
+ * Difference iterator, returns topics that appear in `left`, but not `right`
+ */
+struct difference_topic_iterator_t: public compound_topic_iterator_t {
+	difference_topic_iterator_t(auto_ptr<topic_iterator_t> left, auto_ptr<topic_iterator_t> right) :
+		compound_topic_iterator_t(iterator_list(left, right)) {
+		refill();
+	}
+
+	virtual void fill(topic_run_t& out) {
+		subtract_cursors(cursors[0], cursors[1], out);
+	}
+
+	virtual size_t max() const {
+		return iterators->front().max();
+	}
+};
+
+/**
+ * Intersection of two lists, the most common expression there is. Specialized for each kind of list
+ * so the kernels read the lists directly.
+ */
+template <class left_source_t, class right_source_t>
+struct pair_intersection_topic_iterator_t: public block_topic_iterator_t {
+	topic_cursor_t<left_source_t> left;
+	topic_cursor_t<right_source_t> right;
+
+	pair_intersection_topic_iterator_t(const left_source_t& left, const right_source_t& right) : left(left), right(right) {
+		refill();
+	}
+
+	virtual void fill(topic_run_t& out) {
+		intersect_cursors(left, right, out);
+	}
+
+	virtual void seek(const base_topic_t& ref) {
+		left.seek(ref);
+		right.seek(ref);
+	}
+
+	virtual size_t max() const {
+		return min(left.source.max(), right.source.max());
+	}
+};
+
+/**
+ * Difference of two lists, specialized like pair_intersection_topic_iterator_t.
+ */
+template <class left_source_t, class right_source_t>
+struct pair_difference_topic_iterator_t: public block_topic_iterator_t {
+	topic_cursor_t<left_source_t> left;
+	topic_cursor_t<right_source_t> right;
+
+	pair_difference_topic_iterator_t(const left_source_t& left, const right_source_t& right) : left(left), right(right) {
+		refill();
+	}
+
+	virtual void fill(topic_run_t& out) {
+		subtract_cursors(left, right, out);
+	}
+
+	virtual void seek(const base_topic_t& ref) {
+		left.seek(ref);
+		right.seek(ref);
+	}
+
+	virtual size_t max() const {
+		return left.source.max();
+	}
+};
+
+/**
+ * Builds `pair_t` straight over the lists if `right` is a plain tag or word list, otherwise NULL.
+ */
+template <template <class, class> class pair_t, class left_set_t>
+topic_iterator_t* specialize_right(const basic_topic_iterator_t<left_set_t>& left, topic_iterator_t& right) {
+	typedef list_source_t<left_set_t> left_source_t;
+	if (const tag_topic_iterator_t* tags = dynamic_cast<const tag_topic_iterator_t*>(&right)) {
+		return new pair_t<left_source_t, list_source_t<tag_t::topic_set_t> >(left, *tags);
+	} else if (const word_topic_iterator_t* words = dynamic_cast<const word_topic_iterator_t*>(&right)) {
+		return new pair_t<left_source_t, list_source_t<word_t::topic_set_t> >(left, *words);
+	}
+	return NULL;
+}
+
+/**
+ * Builds `pair_t` straight over the lists if both are plain tag or word lists, otherwise NULL.
+ */
+template <template <class, class> class pair_t>
+topic_iterator_t* specialize_pair(topic_iterator_t& left, topic_iterator_t& right) {
+	if (const tag_topic_iterator_t* tags = dynamic_cast<const tag_topic_iterator_t*>(&left)) {
+		return specialize_right<pair_t>(*tags, right);
+	} else if (const word_topic_iterator_t* words = dynamic_cast<const word_topic_iterator_t*>(&left)) {
+		return specialize_right<pair_t>(*words, right);
+	}
+	return NULL;
+}
+
+/**
+ * Wall clock time as of the message being applied. Messages replayed from the write-ahead log see the
+ * time they were originally applied at.
+ */
+time_t mutation_time;
+
+/**
+ * Latest timestamp each topic was bumped to so far in the batch being applied, NULL outside of
+ * batches. Topics are only refiled once at the end of the batch, since every bump before the last
+ * would just leave stale entries behind.
+ */
+map<topic_t*, topic_t::ts_t>* deferred_bumps = NULL;
+
+/**
+ * Active topics filed by when their oldest poster drops out of the hot window, in hour wide buckets
+ * going round a ring. flushCounts only has to look at topics in the buckets which have come due
+ * instead of every active topic.
+ *
+ * Topics may be filed early, they just go back in if there's nothing to expire yet. A topic which
+ * moves leaves its old entry behind, which is skipped since its stamp no longer matches.
+ */
+struct expiry_wheel_t {
+	typedef pair<topic_t*, uint32_t> entry_t;
+	static const topic_t::ts_t bucket_width = 3600;
+	vector<vector<entry_t> > buckets;
+	// Bucket the last flush got up to, in units of `bucket_width` since the epoch
+	topic_t::ts_t processed;
+
+	expiry_wheel_t() : buckets(size_t(message_cutoff) / bucket_width + 2), processed(0) {}
+
+	/**
+	 * Files a topic under when it's next due, moving it if it was already somewhere else.
+	 */
+	void file(topic_t* topic) {
+		topic_t::ts_t slot = topic_t::ts_t((topic->state->activity.oldest + message_cutoff) / bucket_width);
+		slot = min(max(slot, processed), topic_t::ts_t(processed + buckets.size() - 1));
+		uint32_t bucket = slot % buckets.size();
+		if (topic->wheel_bucket != bucket) {
+			topic->wheel_bucket = bucket;
+			buckets[bucket].push_back(entry_t(topic, ++topic->wheel_stamp));
+		}
+	}
+
+	/**
+	 * Takes out the topics with posters from before the hot window as of `now`, and files the rest
+	 * of what it looked at again.
+	 */
+	void due(topic_t::ts_t now, vector<topic_t*>& topics) {
+		topic_t::ts_t last = max(topic_t::ts_t(now / bucket_width), processed);
+		topic_t::ts_t first = last - min(last, topic_t::ts_t(buckets.size() - 1));
+		if (processed > first) {
+			first = processed;
+		}
+		processed = last;
+		for (topic_t::ts_t slot = first; slot <= last; ++slot) {
+			uint32_t bucket = slot % buckets.size();
+			vector<entry_t> entries;
+			entries.swap(buckets[bucket]);
+			foreach (const entry_t& entry, entries) {
+				topic_t* topic = entry.first;
+				if (topic->wheel_bucket != bucket || topic->wheel_stamp != entry.second) {
+					continue;
+				}
+				topic->wheel_bucket = ~uint32_t(0);
+				if (topic->state->activity.oldest < now - message_cutoff) {
+					topics.push_back(entry.first);
+				} else {
+					file(entry.first);
+				}
+			}
+		}
+	}
+};
+expiry_wheel_t expiry_wheel;
+
+/**
+ * Message from the binlog watcher to update a topic's timestamp.
+ */
+void msg_bump_topic(const vector<Worker::value_t>& args) {
+	topic_t::id_t id = args[0].get_uint64();
+	topic_t::ts_t ts = args[1].get_int();
+	topic_t::user_t user = args[2].get_int();
+
+	topic_t* topic = topic_t::find(id);
+	if (topic) {
+		if (deferred_bumps) {
+			topic_t::ts_t& deferred = (*deferred_bumps)[topic];
+			deferred = max(deferred, ts);
+		} else {
+			topic->bump(ts);
+		}
+		if (mutation_time - topic_cutoff < topic->state->created) {
+			// A new poster moves the topic up the activity ranking
+			bool new_poster = !topic->state->activity.posted(user);
+			if (new_poster) {
+				topic_t::topics_by_activity.erase(topic);
+			}
+			if (topic->writable().activity.post(ts, user)) {
+				expiry_wheel.file(topic);
+			}
+			if (new_poster) {
+				topic_t::topics_by_activity.insert(topic);
+			}
+			tag_t::active_tag.insert(topic);
+			topic->tags.insert(&tag_t::active_tag);
+		}
+	}
+}
+
+/**
+ * Message from the binlog watcher when a topic is created.
+ */
+void msg_created_topic(const vector<Worker::value_t>& args) {
+	topic_t::id_t id = args[0].get_uint64();
+	topic_t::ts_t ts = args[1].get_int();
+
+	topic_t& topic = topic_t::get(id, ts);
+	topic.writable().created = ts;
+}
 
 /**
  * Message from the binlog watcher to associate a list of tags with a topic.
  */
-void msg_add_tags(Worker& worker, const vector<Worker::value_t>& args) {
-	boost::lock_guard<boost::shared_mutex> lock(write_lock);
+void msg_add_tags(const vector<Worker::value_t>& args) {
 	topic_t::id_t id = args[0].get_uint64();
 	topic_t::ts_t ts = args[1].get_int();
 	const vector<Worker::value_t>& new_tags = args[2].get_array();
@@ -515,10 +1653,10 @@ void msg_add_tags(Worker& worker, const vector<Worker::value_t>& args) {
 				// tag
 				continue;
 			}
-			inverse.topics.erase(&topic);
+			inverse.erase(&topic);
 		}
 		// Add to tag
-		tag.topics.insert(&topic);
+		tag.insert(&topic);
 		topic.tags.insert(&tag);
 
 		// Is this tag big enough to need its inverse created?
@@ -528,13 +1666,14 @@ void msg_add_tags(Worker& worker, const vector<Worker::value_t>& args) {
 			inverse_req < tag_t::global_tag.topics.size()
 		) {
 			tag_t& inverse = *new tag_t;
-			tag.inverse_tag = &inverse;
-			inverse.inverse_tag = &tag;
+			tag.set_inverse(&inverse);
+			inverse.set_inverse(&tag);
 			tag_t::inverse_tags.push_back(&inverse);
-			foreach (topic_t* topic, tag_t::global_tag.topics) {
+			foreach (topic_t::ord_t ord, tag_t::global_tag.topics) {
+				topic_t* topic = topic_t::topics_by_ord.get(ord);
 				if (topic->tags.find(&tag) == topic->tags.end()) {
 					topic->tags.insert(&inverse);
-					inverse.topics.insert(topic);
+					inverse.insert(topic);
 				}
 			}
 		}
@@ -544,8 +1683,7 @@ void msg_add_tags(Worker& worker, const vector<Worker::value_t>& args) {
 /**
  * Message from the binlog watcher to remove a tag.
  */
-void msg_remove_tag(Worker& worker, const vector<Worker::value_t>& args) {
-	boost::lock_guard<boost::shared_mutex> lock(write_lock);
+void msg_remove_tag(const vector<Worker::value_t>& args) {
 	topic_t::id_t id = args[0].get_uint64();
 	tag_t::id_t tag_id = args[1].get_uint64();
 
@@ -561,12 +1699,12 @@ void msg_remove_tag(Worker& worker, const vector<Worker::value_t>& args) {
 		// This topic was not tagged at all, nothing else to do in this function
 		return;
 	}
-	tag.topics.erase(topic);
+	tag.erase(topic);
 
 	// Add the inverse tag if needed
 	if (tag.inverse_tag) {
 		tag_t& inverse = *tag.inverse_tag;
-		inverse.topics.insert(topic);
+		inverse.insert(topic);
 		topic->tags.insert(&inverse);
 	}
 }
@@ -575,8 +1713,7 @@ void msg_remove_tag(Worker& worker, const vector<Worker::value_t>& args) {
  * Message to remove this tag from *all* topics. This is used to start over from
  * scratch on a tag, after retraining autotag.
  */
-void msg_clear_tag(Worker& worker, const vector<Worker::value_t>& args) {
-	boost::lock_guard<boost::shared_mutex> lock(write_lock);
+void msg_clear_tag(const vector<Worker::value_t>& args) {
 	tag_t::id_t tag_id = args[0].get_uint64();
 
 	tag_t& tag = tag_t::get(tag_id);
@@ -584,25 +1721,26 @@ void msg_clear_tag(Worker& worker, const vector<Worker::value_t>& args) {
 	// First, do we need to add all these topics to the inverse?
 	if (tag.inverse_tag) {
 		tag_t& inverse = *tag.inverse_tag;
-		foreach (topic_t* topic, tag.topics) {
+		foreach (topic_t::ord_t ord, tag.topics) {
+			topic_t* topic = topic_t::topics_by_ord.get(ord);
 			topic->tags.insert(&inverse);
-			inverse.topics.insert(topic);
+			inverse.insert(topic);
 		}
 	}
 
 	// Remove tag from all topics
-	foreach (topic_t* topic, tag.topics) {
-		topic->tags.erase(&tag);
+	foreach (topic_t::ord_t ord, tag.topics) {
+		topic_t::topics_by_ord.get(ord)->tags.erase(&tag);
 	}
-	tag.topics.clear();
+	tag.clear();
 }
 
 /**
  * Sets the full-text search content of a topic.
  */
-template <set<word_t*> topic_t::*words, word_t::topic_set_t word_t::*topics>
+template <topic_t::word_set_t topic_t::*words, word_t::topic_set_t word_t::*topics>
 void update_full_text(topic_t& topic, const vector<Worker::value_t>& document) {
-	set<word_t*> original_words(topic.*words);
+	topic_t::word_set_t original_words(topic.*words);
 	(topic.*words).clear();
 	uint32_t ii = 0;
 	foreach (const Worker::value_t& token, document) {
@@ -611,33 +1749,32 @@ void update_full_text(topic_t& topic, const vector<Worker::value_t>& document) {
 		++ii;
 	}
 
-	set<word_t*>::iterator left = original_words.begin();
-	set<word_t*>::iterator right = (topic.*words).begin();
+	topic_t::word_set_t::iterator left = original_words.begin();
+	topic_t::word_set_t::iterator right = (topic.*words).begin();
 	while (left != original_words.end() && right != (topic.*words).end()) {
 		if (*left == *right) {
 			++left;
 			++right;
 		} else if (*left < *right) {
-			(*left->*topics).erase(&topic);
+			(*left->*topics).erase(topic.ord);
 			++left;
 		} else {
-			(*right->*topics).insert(&topic);
+			(*right->*topics).insert(topic.ord);
 			++right;
 		}
 	}
 	while (left != original_words.end()) {
-		(*left->*topics).erase(&topic);
+		(*left->*topics).erase(topic.ord);
 		++left;
 	}
 	while (right != (topic.*words).end()) {
-		(*right->*topics).insert(&topic);
+		(*right->*topics).insert(topic.ord);
 		++right;
 	}
 
 }
 
-void msg_full_text(Worker& worker, const vector<Worker::value_t>& args) {
-	boost::lock_guard<boost::shared_mutex> lock(write_lock);
+void msg_full_text(const vector<Worker::value_t>& args) {
 	topic_t::id_t id = args[0].get_uint64();
 	topic_t::ts_t ts = args[1].get_int();
 	const vector<Worker::value_t>& title = args[2].get_array();
@@ -649,94 +1786,533 @@ void msg_full_text(Worker& worker, const vector<Worker::value_t>& args) {
 }
 
 /**
- * Every 5 minutes or whatever this is called to go through and to pull out old messages from each
- * topic's `messages` and `message_counts` objects.
+ * Topics `expiry_wheel` found due which haven't been seen to yet. Background expiry works through
+ * them a slice at a time, see expire_slice().
+ */
+vector<topic_t*> expiring;
+
+/**
+ * Drops posters who haven't posted within the hot window as of `now` from a topic, and takes it out
+ * of the active topics if that leaves nobody.
+ */
+void expire_topic(topic_t* topic, topic_t::ts_t now) {
+	// The topic comes out of the activity ranking while its posters change, and goes back in if it's
+	// still active
+	topic_t::topics_by_activity.erase(topic);
+	topic->writable().activity.expire(now - message_cutoff);
+	if (topic->state->activity.empty()) {
+		tag_t::active_tag.erase(topic);
+		topic->tags.erase(&tag_t::active_tag);
+	} else {
+		topic_t::topics_by_activity.insert(topic);
+		expiry_wheel.file(topic);
+	}
+}
+
+/**
+ * Expires every topic which is due, all at once. Background expiry does the same thing a bit at a
+ * time, so sending this is only needed when that's turned off with --expire-interval 0.
+ */
+void msg_flush_counts(const vector<Worker::value_t>& args) {
+	topic_t::ts_t ts = mutation_time;
+	expiry_wheel.due(ts, expiring);
+	while (!expiring.empty()) {
+		expire_topic(expiring.back(), ts);
+		expiring.pop_back();
+	}
+}
+
+/**
+ * Expires the topics listed by id as of the time it's applied. Never sent by clients: background
+ * expiry logs each slice as one of these, so replaying the log drops the same posters it did.
+ */
+void msg_expire(const vector<Worker::value_t>& args) {
+	foreach (const Worker::value_t& id, args[0].get_array()) {
+		topic_t* topic = topic_t::find(id.get_uint64());
+		if (topic) {
+			expire_topic(topic, mutation_time);
+		}
+	}
+}
+
+/**
+ * Every message which changes the index. The position in this list is the opcode stored in the
+ * write-ahead log, so only ever add to the end.
+ */
+typedef void (*mutation_t)(const vector<Worker::value_t>& args);
+enum mutation_op_t {
+	op_created_topic,
+	op_bump_topic,
+	op_add_tags,
+	op_remove_tag,
+	op_clear_tag,
+	op_full_text,
+	op_flush_counts,
+	op_expire,
+	op_count
+};
+const mutation_t mutations[op_count] = {
+	msg_created_topic,
+	msg_bump_topic,
+	msg_add_tags,
+	msg_remove_tag,
+	msg_clear_tag,
+	msg_full_text,
+	msg_flush_counts,
+	msg_expire
+};
+
+/**
+ * Arguments each message takes, by opcode: `i` for an integer, `I` for an array of them and `S` for
+ * an array of strings. Messages are checked against these before they're applied, since a handler
+ * which threw half way through would leave changes behind that the write-ahead log doesn't have.
+ */
+const char* const mutation_args[op_count] = {
+	"ii",
+	"iii",
+	"iiI",
+	"ii",
+	"i",
+	"iiSS",
+	"",
+	"I"
+};
+
+/**
+ * Throws unless `args` are what message `op` takes, see mutation_args. Handlers don't throw once
+ * their arguments have been checked.
+ */
+void check_mutation(mutation_op_t op, const vector<Worker::value_t>& args) {
+	const char* kinds = mutation_args[op];
+	if (args.size() < strlen(kinds)) {
+		throw runtime_error("missing message arguments");
+	}
+	for (size_t ii = 0; kinds[ii]; ++ii) {
+		bool ok;
+		if (kinds[ii] == 'i') {
+			ok = args[ii].type() == json_spirit::int_type;
+		} else {
+			json_spirit::Value_type type = kinds[ii] == 'I' ? json_spirit::int_type : json_spirit::str_type;
+			ok = args[ii].type() == json_spirit::array_type;
+			for (size_t jj = 0; ok && jj < args[ii].get_array().size(); ++jj) {
+				ok = args[ii].get_array()[jj].type() == type;
+			}
+		}
+		if (!ok) {
+			throw runtime_error("bad message argument");
+		}
+	}
+}
+
+wal_t wal;
+
+/**
+ * Mutation messages waiting for the writer thread. They're queued straight from the connection's
+ * event loop, so they're applied in the order they were sent.
+ */
+struct queued_mutation_t {
+	mutation_op_t op;
+	vector<Worker::value_t> args;
+};
+boost::mutex mutation_lock;
+boost::condition_variable mutations_queued_cond;
+boost::condition_variable mutations_applied_cond;
+vector<queued_mutation_t> queued_mutations;
+uint64_t mutations_queued = 0;
+uint64_t mutations_applied = 0;
+uint64_t mutation_batches = 0;
+
+// Most messages applied in one write transaction, so readers still see progress during a flood
+const size_t mutation_batch_max = 1024;
+
+// Most topics expired in one write transaction by background expiry
+const size_t expiry_slice_max = 256;
+
+/**
+ * Background expiry counters, guarded by `mutation_lock`. A pass is everything that was due when
+ * it started, and its stall is the longest any one of its slices held the write transaction.
+ */
+struct expiry_stats_t {
+	uint64_t passes;
+	uint64_t slices;
+	uint64_t topics;
+	uint64_t last_pass_slices;
+	uint64_t last_pass_us;
+	uint64_t last_pass_stall_us;
+	uint64_t max_stall_us;
+
+	expiry_stats_t() : passes(0), slices(0), topics(0), last_pass_slices(0), last_pass_us(0), last_pass_stall_us(0), max_stall_us(0) {}
+};
+expiry_stats_t expiry_stats;
+
+template <mutation_op_t op>
+void msg_mutation(Worker& worker, const vector<Worker::value_t>& args) {
+	{
+		boost::lock_guard<boost::mutex> lock(mutation_lock);
+		queued_mutations.push_back(queued_mutation_t());
+		queued_mutations.back().op = op;
+		queued_mutations.back().args = args;
+		++mutations_queued;
+	}
+	mutations_queued_cond.notify_one();
+}
+
+/**
+ * fullText messages which apply_mutations() can tell apart by topic before applying them.
+ */
+bool is_keyed_full_text(const queued_mutation_t& mutation) {
+	return mutation.op == op_full_text && mutation.args.size() == 4 && mutation.args[0].type() == json_spirit::int_type;
+}
+
+/**
+ * Called when the last fullText for a topic in a batch, at `failed`, throws. Applies the latest of
+ * the ones skipped before it which goes through.
+ */
+void apply_superseded_full_text(vector<queued_mutation_t>::iterator begin, vector<queued_mutation_t>::iterator failed) {
+	topic_t::id_t id = failed->args[0].get_uint64();
+	for (vector<queued_mutation_t>::iterator ii = failed; ii != begin;) {
+		--ii;
+		if (is_keyed_full_text(*ii) && ii->args[0].get_uint64() == id) {
+			try {
+				check_mutation(op_full_text, ii->args);
+				mutations[op_full_text](ii->args);
+				return;
+			} catch (const runtime_error& err) {
+				cerr <<"message err: " <<err.what() <<"\n";
+			}
+		}
+	}
+}
+
+/**
+ * Applies a run of queued messages in a single write transaction and logs them. Each is checked
+ * before it's applied, so it either goes through in full and is logged, or is turned away without
+ * having changed anything.
+ */
+void apply_mutations(vector<queued_mutation_t>::iterator begin, vector<queued_mutation_t>::iterator end) {
+
+	// Only the last fullText for a topic in the batch needs its words indexed, the ones before it would
+	// be undone right away. If that last one fails the latest one before it which applies is indexed
+	// instead, as if they'd all been applied in order.
+	vector<bool> superseded(end - begin);
+	set<topic_t::id_t> full_text_seen;
+	for (vector<queued_mutation_t>::iterator ii = end; ii != begin;) {
+		--ii;
+		if (is_keyed_full_text(*ii)) {
+			superseded[ii - begin] = !full_text_seen.insert(ii->args[0].get_uint64()).second;
+		}
+	}
+
+	write_txn_t txn;
+	mutation_time = time(NULL);
+	map<topic_t*, topic_t::ts_t> bumps;
+	deferred_bumps = &bumps;
+	for (vector<queued_mutation_t>::iterator ii = begin; ii != end; ++ii) {
+		try {
+			check_mutation(ii->op, ii->args);
+			if (superseded[ii - begin]) {
+				topic_t::get(ii->args[0].get_uint64(), ii->args[1].get_int());
+			} else {
+				mutations[ii->op](ii->args);
+			}
+			wal.append(ii->op, mutation_time, ii->args);
+		} catch (const runtime_error& err) {
+			cerr <<"message err: " <<err.what() <<"\n";
+			if (is_keyed_full_text(*ii) && !superseded[ii - begin]) {
+				apply_superseded_full_text(begin, ii);
+			}
+		}
+	}
+	deferred_bumps = NULL;
+	for (map<topic_t*, topic_t::ts_t>::iterator ii = bumps.begin(); ii != bumps.end(); ++ii) {
+		ii->first->bump(ii->second);
+	}
+}
+
+/**
+ * One slice of background expiry: starts a pass if there isn't one under way, then expires up to
+ * `expiry_slice_max` of its topics in a write transaction of their own. Messages queued meanwhile
+ * get applied between slices. The slice is logged as an expire message with the topics it expired,
+ * stamped with the same clock as messages are. Returns true once the pass is done.
+ */
+bool expire_slice() {
+	static expiry_stats_t pass;
+	boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+	size_t count;
+	{
+		write_txn_t txn;
+		mutation_time = time(NULL);
+		topic_t::ts_t now = mutation_time;
+		if (expiring.empty()) {
+			expiry_wheel.due(now, expiring);
+		}
+		count = min(expiring.size(), expiry_slice_max);
+		vector<Worker::value_t> ids;
+		ids.reserve(count);
+		for (size_t ii = 0; ii < count; ++ii) {
+			topic_t* topic = expiring.back();
+			expire_topic(topic, now);
+			ids.push_back(Worker::value_t(topic->id()));
+			expiring.pop_back();
+		}
+		if (count) {
+			wal.append(op_expire, mutation_time, vector<Worker::value_t>(1, Worker::value_t(ids)));
+		}
+	}
+	uint64_t us = (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds();
+	++pass.slices;
+	pass.topics += count;
+	pass.last_pass_us += us;
+	pass.max_stall_us = max(pass.max_stall_us, us);
+
+	boost::lock_guard<boost::mutex> lock(mutation_lock);
+	++expiry_stats.slices;
+	expiry_stats.topics += count;
+	expiry_stats.max_stall_us = max(expiry_stats.max_stall_us, us);
+	if (!expiring.empty()) {
+		return false;
+	}
+	++expiry_stats.passes;
+	expiry_stats.last_pass_slices = pass.slices;
+	expiry_stats.last_pass_us = pass.last_pass_us;
+	expiry_stats.last_pass_stall_us = pass.max_stall_us;
+	pass = expiry_stats_t();
+	return true;
+}
+
+/**
+ * The writer thread. Takes everything queued up since it last looked and applies it in batches, so
+ * a burst of messages costs one lock handoff per batch instead of one per message. Every
+ * `expire_interval` milliseconds it also starts a background expiry pass, whose slices go in
+ * between batches.
+ */
+void run_mutations(size_t expire_interval) {
+	vector<queued_mutation_t> batch;
+	boost::system_time next_pass = boost::get_system_time() + boost::posix_time::milliseconds(expire_interval);
+	while (true) {
+		{
+			boost::unique_lock<boost::mutex> lock(mutation_lock);
+			while (queued_mutations.empty()) {
+				if (!expire_interval) {
+					mutations_queued_cond.wait(lock);
+				} else if (!expiring.empty() || boost::get_system_time() >= next_pass) {
+					break;
+				} else {
+					mutations_queued_cond.timed_wait(lock, next_pass);
+				}
+			}
+			batch.swap(queued_mutations);
+		}
+		for (size_t ii = 0; ii < batch.size(); ii += mutation_batch_max) {
+			size_t count = min(mutation_batch_max, batch.size() - ii);
+			apply_mutations(batch.begin() + ii, batch.begin() + ii + count);
+			{
+				boost::lock_guard<boost::mutex> lock(mutation_lock);
+				mutations_applied += count;
+				++mutation_batches;
+			}
+			mutations_applied_cond.notify_all();
+		}
+		batch.clear();
+		if (expire_interval && (!expiring.empty() || boost::get_system_time() >= next_pass)) {
+			if (expire_slice()) {
+				next_pass = boost::get_system_time() + boost::posix_time::milliseconds(expire_interval);
+			}
+		}
+	}
+}
+
+/**
+ * Applies a message read back from the write-ahead log. Throws, before changing anything, if it's
+ * not one that would have been applied and logged.
  */
-void msg_flush_counts(Worker& worker, const vector<Worker::value_t>& args) {
-	boost::lock_guard<boost::shared_mutex> lock(write_lock);
-	topic_t::ts_t ts = time(NULL);
-
-	// Loop through each topic with an active message
-	tag_t::topic_set_t::iterator ii = tag_t::active_tag.topics.begin();
-	while (ii != tag_t::active_tag.topics.end()) {
-		topic_t& topic = **ii;
-
-		// Loop through all messages in the topic
-		set<topic_t::post_t>::iterator jj = topic.messages.begin();
-		while (jj != topic.messages.end()) {
+void replay_mutation(uint32_t op, uint32_t time, const vector<Worker::value_t>& args) {
+	if (op >= op_count) {
+		throw runtime_error("unknown message");
+	}
+	check_mutation(mutation_op_t(op), args);
+	mutation_time = time;
+	mutations[op](args);
+}
 
-			// If this post is older than the cutoff remove it
-			if (jj->first < ts - message_cutoff) {
-				map<topic_t::user_t, uint32_t>::iterator count_iterator = topic.message_counts.find(jj->second);
-				if (count_iterator->second == 1) {
-					topic.message_counts.erase(count_iterator);
-				} else {
-					--count_iterator->second;
-				}
-				topic.messages.erase(jj++);
-			} else {
-				break;
-			}
+/**
+ * Planning pass, run over an expression before it's built. Unions and intersections nested in one of
+ * the same type are flattened into it, repeated operands are dropped, and an operation left with a
+ * single operand is replaced by it. Operands are sorted by their text so that equivalent expressions
+ * come out the same, which the slice cache relies on. Anything malformed is left as it is for
+ * build_iterator() to complain about.
+ */
+Worker::value_t normalize_expression(const Worker::value_t& expr) {
+	if (expr.type() != json_spirit::array_type) {
+		return expr;
+	}
+	const vector<Worker::value_t>& exprs = expr.get_array();
+	if (exprs.size() < 2 || exprs[0].type() != json_spirit::str_type) {
+		return expr;
+	}
+	const string& type = exprs[0].get_str();
+	if (type == "difference") {
+		if (exprs.size() != 3) {
+			return expr;
 		}
+		vector<Worker::value_t> normalized(exprs);
+		normalized[1] = normalize_expression(exprs[1]);
+		normalized[2] = normalize_expression(exprs[2]);
+		return normalized;
+	} else if (exprs.size() == 2) {
+		return normalize_expression(exprs[1]);
+	} else if (type != "union" && type != "intersection") {
+		return expr;
+	}
 
-		// No more active messages?
-		if (topic.messages.empty()) {
-			tag_t::active_tag.topics.erase(ii++);
-			topic.tags.erase(&tag_t::active_tag);
+	// Collect the operands, and those of nested operations of the same type
+	map<string, Worker::value_t> operands;
+	for (size_t ii = 1; ii < exprs.size(); ++ii) {
+		Worker::value_t operand = normalize_expression(exprs[ii]);
+		if (
+			operand.type() == json_spirit::array_type && operand.get_array().size() > 2 &&
+			operand.get_array()[0].type() == json_spirit::str_type && operand.get_array()[0].get_str() == type
+		) {
+			const vector<Worker::value_t>& nested = operand.get_array();
+			for (size_t jj = 1; jj < nested.size(); ++jj) {
+				operands.insert(make_pair(json_spirit::write(nested[jj]), nested[jj]));
+			}
 		} else {
-			++ii;
+			operands.insert(make_pair(json_spirit::write(operand), operand));
 		}
 	}
+	if (operands.size() == 1) {
+		return operands.begin()->second;
+	}
+	vector<Worker::value_t> normalized(1, exprs[0]);
+	for (map<string, Worker::value_t>::iterator ii = operands.begin(); ii != operands.end(); ++ii) {
+		normalized.push_back(ii->second);
+	}
+	return normalized;
 }
 
 /**
- * Builds an iterator from a wildcard word match. Throws if this wildcard is unreasonable.
+ * Builds an iterator from a wildcard word match. Throws if it matches more than the wildcard
+ * budgets allow, before anything is merged or read out.
  */
 template <word_t::topic_set_t word_t::*topics>
-topic_iterator_t::ptr build_wildcard_iterator(const string& word) {
-	size_t total_matches = 0;
+topic_iterator_t::ptr build_wildcard_iterator(const string& word, result_cache_t::deps_t* deps) {
 	auto_ptr<topic_iterator_t::ptr_vector_t> iterators(new topic_iterator_t::ptr_vector_t);
-	map<const string, word_t*>::iterator it = word_t::words_by_string.lower_bound(word);
-	while (it != word_t::words_by_string.end() && it->first.compare(0, word.length(), word) == 0) {
-		topic_iterator_t::ptr new_iterator(new basic_topic_iterator_t(it->second->*topics));
-		total_matches += new_iterator->max();
-		iterators->push_back(new_iterator);
-		if (total_matches > topic_t::topics_by_id.size() / 4 || iterators->size() > 1000) {
-			throw runtime_error("too many matches");
+	if (deps) {
+		deps->depend(word_t::words_by_string.version());
+	}
+	word_t::dictionary_t::view_t dictionary = word_t::words_by_string.view();
+	word_t::dictionary_t::const_iterator it = dictionary.lower_bound(word.c_str(), NULL);
+	size_t words = 0;
+	size_t postings = 0;
+	while (!it.at_end() && strncmp(it.key(), word.c_str(), word.length()) == 0) {
+		if (word_t::max_wildcard_words && ++words > word_t::max_wildcard_words) {
+			throw runtime_error("wildcard matches too many words");
+		}
+		if (deps) {
+			deps->depend(((*it)->*topics).version());
+		}
+		topic_iterator_t::ptr new_iterator(new word_topic_iterator_t((*it)->*topics));
+		if (new_iterator->max()) {
+			postings += new_iterator->max();
+			if (word_t::max_wildcard_postings && postings > word_t::max_wildcard_postings) {
+				throw runtime_error("wildcard matches too many topics");
+			}
+			iterators->push_back(new_iterator);
 		}
 		++it;
 	}
 	if (iterators->size() == 0) {
 		return topic_iterator_t::ptr(new null_topic_iterator_t);
+	} else if (iterators->size() == 1) {
+		return topic_iterator_t::ptr(iterators->pop_back().release());
 	}
-	return topic_iterator_t::ptr(new union_topic_iterator_t(iterators));
+	return build_union(iterators);
+}
+
+/**
+ * Adds a tag's list to a result's dependencies, if they're being tracked.
+ */
+static tag_t* depend(result_cache_t::deps_t* deps, tag_t* tag) {
+	if (deps) {
+		deps->depend(tag->topics.version());
+	}
+	return tag;
+}
+
+/**
+ * Puts together an intersection. The smallest list leads and the rest are fast forwarded to it,
+ * except for dense tags which are checked against their bitmaps instead.
+ */
+topic_iterator_t::ptr build_intersection(auto_ptr<topic_iterator_t::ptr_vector_t> iterators) {
+	iterators->sort(topic_iterator_t::fewer());
+	if (iterators->front().max() == 0) {
+		// If the smallest is empty there's nothing to do at all
+		return topic_iterator_t::ptr(new null_topic_iterator_t);
+	}
+	vector<bitmap_t::view_t> include;
+	for (topic_iterator_t::ptr_vector_t::iterator ii = iterators->begin() + 1; ii != iterators->end();) {
+		if (ii->members()) {
+			include.push_back(*ii->members());
+			ii = iterators->erase(ii);
+		} else {
+			++ii;
+		}
+	}
+	topic_iterator_t::ptr iterator;
+	if (iterators->size() == 1) {
+		iterator.reset(iterators->pop_back().release());
+	} else if (iterators->size() == 2) {
+		iterator.reset(specialize_pair<pair_intersection_topic_iterator_t>((*iterators)[0], (*iterators)[1]));
+	}
+	if (!iterator.get()) {
+		iterator.reset(new intersection_topic_iterator_t(iterators));
+	}
+	if (include.empty()) {
+		return iterator;
+	}
+	return topic_iterator_t::ptr(new filter_topic_iterator_t(iterator, include, vector<bitmap_t::view_t>()));
 }
 
 /**
- * Builds an iterator from a JSON expression.
+ * Builds an iterator from a JSON expression. If `deps` is given every list read is added to it.
  */
 template <word_t::topic_set_t word_t::*topics>
-topic_iterator_t::ptr build_iterator(const Worker::value_t& expr) {
+topic_iterator_t::ptr build_iterator(const Worker::value_t& expr, result_cache_t::deps_t* deps = NULL) {
 	if (expr.type() == json_spirit::int_type) {
 		int val = expr.get_int();
 		tag_t* tag;
 		if (val) {
-			tag = &tag_t::get(expr.get_int());
+			tag = tag_t::find(expr.get_int());
+			if (!tag) {
+				// Nothing to track until the tag exists
+				if (deps) {
+					deps->uncacheable();
+				}
+				return topic_iterator_t::ptr(new null_topic_iterator_t);
+			}
 		} else {
 			tag = &tag_t::global_tag;
 		}
-		return topic_iterator_t::ptr(new basic_topic_iterator_t(tag->topics));
+		return tag_iterator(*depend(deps, tag));
 	} else if (expr.type() == json_spirit::str_type) {
 		const string& word = expr.get_str();
 		if (word.length() >= 2 && word[word.length() - 1] == '*') {
 			// prefix search
 			string word = expr.get_str();
 			word.erase(word.length() - 1, 1);
-			return build_wildcard_iterator<topics>(word);
+			return build_wildcard_iterator<topics>(word, deps);
 		} else {
+			// A word that isn't in the dictionary yet shows up there first
+			if (deps) {
+				deps->depend(word_t::words_by_string.version());
+			}
 			word_t* word = word_t::find(expr.get_str());
 			if (word) {
-				return topic_iterator_t::ptr(new basic_topic_iterator_t(word->*topics));
+				if (deps) {
+					deps->depend((word->*topics).version());
+				}
+				return topic_iterator_t::ptr(new word_topic_iterator_t(word->*topics));
 			}
 			return topic_iterator_t::ptr(new null_topic_iterator_t);
 		}
@@ -747,60 +2323,97 @@ topic_iterator_t::ptr build_iterator(const Worker::value_t& expr) {
 			if (exprs.size() != 3) {
 				throw runtime_error("unknown expression");
 			}
-			// Look for things to convert from [diff, a, b] to [intersect, a, ~b]
+			// Look for things to convert from [diff, a, b] to [intersect, a, ~b]. Dense tags are better
+			// off checked against their bitmap, which the general case below does.
 			if (exprs[2].type() == json_spirit::int_type && exprs[2].get_int()) {
-				tag_t& tag = tag_t::get(exprs[2].get_int());
-				if (tag.inverse_tag) {
+				tag_t* tag = tag_t::find(exprs[2].get_int());
+				tag_t* inverse = tag && !tag->reader_members() ? tag->reader_inverse_tag() : NULL;
+				if (inverse) {
 					// Single difference expr with an inverse
 					auto_ptr<topic_iterator_t::ptr_vector_t> iterators(new topic_iterator_t::ptr_vector_t(2));
-					iterators->push_back(build_iterator<topics>(exprs[1]));
-					iterators->push_back(new basic_topic_iterator_t(tag.inverse_tag->topics));
-					return topic_iterator_t::ptr(new intersection_topic_iterator_t(iterators));
+					iterators->push_back(build_iterator<topics>(exprs[1], deps));
+					iterators->push_back(tag_iterator(*depend(deps, inverse)));
+					return build_intersection(iterators);
 				}
 			} else if (exprs[2].type() == json_spirit::array_type) {
 				const vector<Worker::value_t>& exprs2 = exprs[2].get_array();
 				if (exprs2[0].get_str() == "union") {
 					auto_ptr<topic_iterator_t::ptr_vector_t> iterators(new topic_iterator_t::ptr_vector_t(0));
 					auto_ptr<topic_iterator_t::ptr_vector_t> inverse_iterators(new topic_iterator_t::ptr_vector_t(0));
+					vector<bitmap_t::view_t> exclude;
 					for (size_t ii = 1; ii < exprs2.size(); ++ii) {
 						if (exprs2[ii].type() == json_spirit::int_type && exprs2[ii].get_int()) {
-							tag_t& tag = tag_t::get(exprs2[ii].get_int());
-							if (tag.inverse_tag) {
-								inverse_iterators->push_back(new basic_topic_iterator_t(tag.inverse_tag->topics));
+							tag_t* tag = tag_t::find(exprs2[ii].get_int());
+							const bitmap_t* bitmap = tag ? tag->reader_members() : NULL;
+							if (bitmap) {
+								depend(deps, tag);
+								exclude.push_back(bitmap->view());
+								continue;
+							}
+							tag_t* inverse = tag ? tag->reader_inverse_tag() : NULL;
+							if (inverse) {
+								inverse_iterators->push_back(tag_iterator(*depend(deps, inverse)));
 								continue;
 							}
 						}
-						iterators->push_back(build_iterator<topics>(exprs2[ii]));
+						iterators->push_back(build_iterator<topics>(exprs2[ii], deps));
 					}
-					topic_iterator_t::ptr iterator = build_iterator<topics>(exprs[1]);
+					topic_iterator_t::ptr iterator = build_iterator<topics>(exprs[1], deps);
 					if (inverse_iterators->size()) {
 						inverse_iterators->push_back(iterator);
-						iterator = topic_iterator_t::ptr(new intersection_topic_iterator_t(inverse_iterators));
+						iterator = build_intersection(inverse_iterators);
 					}
 					if (iterators->size()) {
 						iterator = topic_iterator_t::ptr(new difference_topic_iterator_t(
 							iterator,
-							topic_iterator_t::ptr(new union_topic_iterator_t(iterators))
+							build_union(iterators)
 						));
 					}
+					if (exclude.size()) {
+						iterator = topic_iterator_t::ptr(new filter_topic_iterator_t(iterator, vector<bitmap_t::view_t>(), exclude));
+					}
 					return iterator;
 				}
 			}
-			return topic_iterator_t::ptr(new difference_topic_iterator_t(build_iterator<topics>(exprs[1]), build_iterator<topics>(exprs[2])));
+			topic_iterator_t::ptr left = build_iterator<topics>(exprs[1], deps);
+			topic_iterator_t::ptr right = build_iterator<topics>(exprs[2], deps);
+			if (left->max() == 0 || right->max() == 0) {
+				return left;
+			} else if (right->members()) {
+				return topic_iterator_t::ptr(new filter_topic_iterator_t(left, vector<bitmap_t::view_t>(), vector<bitmap_t::view_t>(1, *right->members())));
+			}
+			topic_iterator_t* pair = specialize_pair<pair_difference_topic_iterator_t>(*left, *right);
+			if (pair) {
+				return topic_iterator_t::ptr(pair);
+			}
+			return topic_iterator_t::ptr(new difference_topic_iterator_t(left, right));
 		} else {
 			if (exprs.size() == 2) {
-				return build_iterator<topics>(exprs[1]);
+				return build_iterator<topics>(exprs[1], deps);
 			} else if (exprs.size() == 1) {
 				throw runtime_error("unknown expression");
 			}
 			auto_ptr<topic_iterator_t::ptr_vector_t> iterators(new topic_iterator_t::ptr_vector_t(exprs.size() - 1));
 			for (size_t ii = 1; ii < exprs.size(); ++ii) {
-				iterators->push_back(build_iterator<topics>(exprs[ii]));
+				iterators->push_back(build_iterator<topics>(exprs[ii], deps));
 			}
 			if (type == "union") {
-				return topic_iterator_t::ptr(new union_topic_iterator_t(iterators));
+				// Empty lists can't add anything
+				for (topic_iterator_t::ptr_vector_t::iterator ii = iterators->begin(); ii != iterators->end();) {
+					if (ii->max() == 0) {
+						ii = iterators->erase(ii);
+					} else {
+						++ii;
+					}
+				}
+				if (iterators->empty()) {
+					return topic_iterator_t::ptr(new null_topic_iterator_t);
+				} else if (iterators->size() == 1) {
+					return topic_iterator_t::ptr(iterators->pop_back().release());
+				}
+				return build_union(iterators);
 			} else if (type == "intersection") {
-				return topic_iterator_t::ptr(new intersection_topic_iterator_t(iterators));
+				return build_intersection(iterators);
 			} else {
 				throw runtime_error("unknown expression");
 			}
@@ -811,83 +2424,128 @@ topic_iterator_t::ptr build_iterator(const Worker::value_t& expr) {
 }
 
 /**
- * Request from a server for a slice of topics by expression
+ * Recently used slice results, see --cache-size.
  */
-void req_slice(Worker& worker, const Worker::request_handle_t& handle, const vector<Worker::value_t>& args) {
+result_cache_t slice_cache;
 
-	try {
-		// Initialize
-		boost::shared_lock<boost::shared_mutex> lock(write_lock);
-		bool search_documents = args.size() > 4 ? (args[4].type() == json_spirit::bool_type ? args[4].get_bool() : false) : false;
-		topic_iterator_t::ptr it = search_documents ?
-			build_iterator<&word_t::topics_documents>(args[0]) :
-			build_iterator<&word_t::topics_titles>(args[0]);
-		size_t count = args[1].get_int();
-		topic_t::ts_t ff = args.size() > 2 ? (args[2].type() == json_spirit::int_type ? args[2].get_int() : 0) : 0;
-		bool estimate_count = args.size() > 3 ? (args[3].type() == json_spirit::bool_type ? args[3].get_bool() : false) : false;
-
-		// Fastforward?
-		if (ff) {
-			const topic_t* first_topic = **it;
-			if (first_topic != NULL && first_topic->ts > ff) {
-				auto_ptr<base_topic_t> fake_topic(new base_topic_t(0, ff));
-				it->ff(&*fake_topic);
-			}
-		}
-
-		// Build results by id
-		vector<Worker::value_t> results;
-		topic_t::ts_t first_ts = 0;
-		for (const topic_t* ii = **it; ii && count; ii = *(++*it)) {
-			if (first_ts == 0) {
-				first_ts = ii->ts;
-			}
-			results.push_back(ii->id);
-			--count;
-		}
-
-		map<string, Worker::value_t> response;
-		response.insert(make_pair("results", results));
-
-		// Estimate count
-		if (estimate_count) {
-			if (count || **it == NULL) {
-				// Did we end up getting less than requested? No estimate required since the end was hit.
-				response.insert(make_pair("count", results.size()));
-			} else {
-				// Jump up to result #2500
-				size_t skip_forward = results.size();
-				while (skip_forward < 2500) {
-					++skip_forward;
-					++*it;
-					if (**it == NULL) {
-						response.insert(make_pair("count", skip_forward));
-						goto skip_estimate; // woohoo!
-					}
+/**
+ * Cache key for a slice request, the expression plus everything else that changes its results.
+ */
+string slice_cache_key(const vector<Worker::value_t>& args) {
+	size_t count = args[1].get_int();
+	topic_t::ts_t ff = args.size() > 2 ? (args[2].type() == json_spirit::int_type ? args[2].get_int() : 0) : 0;
+	bool estimate_count = args.size() > 3 ? (args[3].type() == json_spirit::bool_type ? args[3].get_bool() : false) : false;
+	bool search_documents = args.size() > 4 ? (args[4].type() == json_spirit::bool_type ? args[4].get_bool() : false) : false;
+	ostringstream key;
+	key <<json_spirit::write(normalize_expression(args[0])) <<" " <<count <<" " <<ff <<" " <<estimate_count <<" " <<search_documents;
+	return key.str();
+}
+
+/**
+ * Builds the iterator for a slice request. This has to happen inside a snapshot.
+ */
+topic_iterator_t::ptr build_slice_iterator(const vector<Worker::value_t>& args, result_cache_t::deps_t* deps = NULL) {
+	bool search_documents = args.size() > 4 ? (args[4].type() == json_spirit::bool_type ? args[4].get_bool() : false) : false;
+	return search_documents ?
+		build_iterator<&word_t::topics_documents>(normalize_expression(args[0]), deps) :
+		build_iterator<&word_t::topics_titles>(normalize_expression(args[0]), deps);
+}
+
+/**
+ * Runs a slice iterator and builds the response.
+ */
+Worker::value_t slice_results(topic_iterator_t* it, const vector<Worker::value_t>& args) {
+	size_t count = args[1].get_int();
+	topic_t::ts_t ff = args.size() > 2 ? (args[2].type() == json_spirit::int_type ? args[2].get_int() : 0) : 0;
+	bool estimate_count = args.size() > 3 ? (args[3].type() == json_spirit::bool_type ? args[3].get_bool() : false) : false;
+
+	// Topics are pulled out of the iterator a block at a time
+	iterator_cursor_t cursor(*it);
+
+	// Fastforward?
+	if (ff && !cursor.at_end() && cursor.head_ts() > ff) {
+		cursor.seek(base_topic_t(0, ff));
+	}
+
+	// Build results by id
+	vector<Worker::value_t> results;
+	topic_t::ts_t first_ts = 0;
+	for (; !cursor.at_end() && count; cursor.next()) {
+		if (first_ts == 0) {
+			first_ts = cursor.head_ts();
+		}
+		results.push_back(topic_t::ids_by_ord.get(cursor.head()));
+		--count;
+	}
+
+	map<string, Worker::value_t> response;
+	response.insert(make_pair("results", results));
+
+	// Estimate count
+	if (estimate_count) {
+		if (count || cursor.at_end()) {
+			// Did we end up getting less than requested? No estimate required since the end was hit.
+			response.insert(make_pair("count", results.size()));
+		} else {
+			// Jump up to result #2500
+			size_t skip_forward = results.size();
+			while (skip_forward < 2500) {
+				++skip_forward;
+				cursor.next();
+				if (cursor.at_end()) {
+					response.insert(make_pair("count", skip_forward));
+					return response;
 				}
+			}
 
-				// Skip in exponentially wider chunks to guess the order of magnitude of results
-				auto_ptr<base_topic_t> fake_topic(new base_topic_t(0, 0));
-				double magnitude = log2(skip_forward);
-				base_topic_t::ts_t last_ts = first_ts;
-				while (**it) {
-					fake_topic->ts = first_ts - (first_ts - (*it)->ts) * 2;
-					if (fake_topic->ts > last_ts) {
-						// Overflow?
-						++magnitude;
-						break;
-					} else if (fake_topic->ts == last_ts) {
-						// Same time posts
-						--fake_topic->ts;
-					}
-					it->ff(&*fake_topic);
-					last_ts = fake_topic->ts;
+			// Skip in exponentially wider chunks to guess the order of magnitude of results
+			base_topic_t fake_topic(0, 0);
+			double magnitude = log2(skip_forward);
+			base_topic_t::ts_t last_ts = first_ts;
+			while (!cursor.at_end()) {
+				fake_topic.ts = first_ts - (first_ts - cursor.head_ts()) * 2;
+				if (fake_topic.ts > last_ts) {
+					// Overflow?
 					++magnitude;
+					break;
+				} else if (fake_topic.ts == last_ts) {
+					// Same time posts
+					--fake_topic.ts;
 				}
-				response.insert(make_pair("count", round(pow(2, magnitude))));
-				response.insert(make_pair("estimated", true));
+				cursor.seek(fake_topic);
+				last_ts = fake_topic.ts;
+				++magnitude;
 			}
-skip_estimate:;
+			response.insert(make_pair("count", round(pow(2, magnitude))));
+			response.insert(make_pair("estimated", true));
+		}
+	}
+	return response;
+}
+
+/**
+ * Request from a server for a slice of topics by expression
+ */
+void req_slice(Worker& worker, const Worker::request_handle_t& handle, const vector<Worker::value_t>& args) {
+
+	try {
+		string key = slice_cache_key(args);
+		Worker::value_t response;
+		if (!slice_cache.find(key, response)) {
+			// Initialize. If a commit lands while the iterator is being built it may have picked up lists
+			// from before and after, so start over. The iterators all go in one arena, freed in one go
+			// at the end.
+			arena_t arena;
+			arena_t::scope_t scope(arena);
+			snapshot_t snapshot;
+			result_cache_t::deps_t deps;
+			topic_iterator_t::ptr it;
+			do {
+				deps.clear();
+				it = build_slice_iterator(args, &deps);
+			} while (!snapshot.validate());
+			response = slice_results(&*it, args);
+			slice_cache.insert(key, response, deps);
 		}
 		worker.respond(handle, response);
 	} catch (const runtime_error& error) {
@@ -896,61 +2554,689 @@ skip_estimate:;
 }
 
 /**
- * Request for most active topics from an expression
+ * Hot iterator for an expression with a bitmap, like the global tag or a dense tag. It's an ordinary
+ * filter over the active topics, but it also holds on to the activity ranking from the same
+ * snapshot, which hot_results() walks instead.
+ */
+struct ranked_topic_iterator_t: public filter_topic_iterator_t {
+	topic_t::activity_set_t::view_t ranking;
+
+	ranked_topic_iterator_t(const bitmap_t::view_t& members) :
+		filter_topic_iterator_t(tag_iterator(tag_t::active_tag), vector<bitmap_t::view_t>(1, members), vector<bitmap_t::view_t>()),
+		ranking(topic_t::topics_by_activity.view()) {}
+};
+
+/**
+ * Builds the iterator for a hot request, the expression limited to active topics. This has to happen
+ * inside a snapshot.
+ */
+topic_iterator_t::ptr build_hot_iterator(const vector<Worker::value_t>& args) {
+	topic_iterator_t::ptr expr = build_iterator<&word_t::topics_titles>(normalize_expression(args[0])); // build_iterator<> template doesn't really matter.
+	if (expr->members()) {
+		return topic_iterator_t::ptr(new ranked_topic_iterator_t(*expr->members()));
+	}
+	auto_ptr<topic_iterator_t::ptr_vector_t> iterators(new topic_iterator_t::ptr_vector_t);
+	iterators->push_back(tag_iterator(tag_t::active_tag));
+	iterators->push_back(expr);
+	return build_intersection(iterators);
+}
+
+/**
+ * The `count` highest scoring topics seen, kept in a heap with the lowest on top. A `count` of 0
+ * keeps everything.
  */
 typedef pair<double, const topic_t*> score_topic_pair_t;
+struct top_topics_t {
+	size_t count;
+	vector<score_topic_pair_t> heap;
+
+	top_topics_t(size_t count) : count(count) {}
+
+	bool full() const {
+		return count && heap.size() == count;
+	}
+
+	/**
+	 * Lowest score still in the running, once full.
+	 */
+	double cutoff() const {
+		return heap.front().first;
+	}
+
+	void push(double score, const topic_t* topic) {
+		score_topic_pair_t entry(score, topic);
+		if (!full()) {
+			heap.push_back(entry);
+			push_heap(heap.begin(), heap.end(), greater<score_topic_pair_t>());
+		} else if (heap.front() < entry) {
+			pop_heap(heap.begin(), heap.end(), greater<score_topic_pair_t>());
+			heap.back() = entry;
+			push_heap(heap.begin(), heap.end(), greater<score_topic_pair_t>());
+		}
+	}
+
+	/**
+	 * Topic ids, highest score first.
+	 */
+	vector<Worker::value_t> json() {
+		sort(heap.begin(), heap.end(), greater<score_topic_pair_t>());
+		vector<Worker::value_t> json;
+		json.reserve(heap.size());
+		foreach (const score_topic_pair_t& ii, heap) {
+			json.push_back(ii.second->id());
+		}
+		return json;
+	}
+};
+
+/**
+ * Runs a hot iterator and builds the response. Topics are scored by their state as of the same
+ * snapshot the iterator was built in.
+ */
+Worker::value_t hot_results(topic_iterator_t* it, const vector<Worker::value_t>& args) {
+	top_topics_t results(args[1].get_int());
+	time_t now = time(NULL);
+
+	ranked_topic_iterator_t* ranked = dynamic_cast<ranked_topic_iterator_t*>(it);
+	if (ranked && results.count) {
+		// Go down the ranking until nobody left has enough posters to beat what's been found, since a
+		// topic never scores more than its number of posters
+		const bitmap_t::view_t& members = ranked->include.front();
+		for (topic_t::activity_set_t::const_iterator ii = ranked->ranking.begin(); !ii.at_end(); ++ii) {
+			if (results.full() && ii.key() < results.cutoff()) {
+				break;
+			} else if (members.test((*ii)->ord)) {
+				results.push((*ii)->snapshot().score(now, ii.key()), *ii);
+			}
+		}
+	} else {
+		for (iterator_cursor_t cursor(*it); !cursor.at_end(); cursor.next()) {
+			const topic_t* topic = topic_t::topics_by_ord.get(cursor.head());
+			results.push(topic->snapshot().score(now), topic);
+		}
+	}
+	return results.json();
+}
+
+/**
+ * Request for most active topics from an expression
+ */
 void req_hot(Worker& worker, const Worker::request_handle_t& handle, const vector<Worker::value_t>& args) {
 
-	// Initialize
-	boost::shared_lock<boost::shared_mutex> lock(write_lock);
-	auto_ptr<topic_iterator_t::ptr_vector_t> iterators(new topic_iterator_t::ptr_vector_t);
-	iterators->push_back(topic_iterator_t::ptr(new basic_topic_iterator_t(tag_t::active_tag.topics)));
-	iterators->push_back(build_iterator<&word_t::topics_titles>(args[0])); // build_iterator<> template doesn't really matter.
-	topic_iterator_t::ptr it(new intersection_topic_iterator_t(iterators));
-	uint32_t count = args[1].get_int();
+	// Initialize. The iterators all go in one arena, freed in one go at the end.
+	arena_t arena;
+	arena_t::scope_t scope(arena);
+	snapshot_t snapshot;
+	topic_iterator_t::ptr it;
+	do {
+		it = build_hot_iterator(args);
+	} while (!snapshot.validate());
+	worker.respond(handle, hot_results(&*it, args));
+}
+
+/**
+ * One query in a batch request. Queries identical to an earlier one in the same batch point at it
+ * with `same_as` and aren't built or run again. Slices found in the cache are `done` from the start.
+ */
+struct batch_query_t {
+	bool valid;
+	bool hot;
+	bool done;
+	vector<Worker::value_t> args;
+	size_t same_as;
+	string key;
+	result_cache_t::deps_t deps;
+	topic_iterator_t::ptr it;
+	Worker::value_t result;
+	string error;
+
+	batch_query_t() : valid(false), hot(false), done(false), same_as(~size_t(0)) {}
+};
 
-	// Push results into a set to sort
-	set<pair<double, const topic_t*> > results;
-	for (const topic_t* ii = **it; ii; ii = *(++*it)) {
-		results.insert(make_pair(ii->score(), ii));
+/**
+ * Request for several slice and hot queries at once, for pages that need a bunch of them. Each
+ * argument is the name of a query followed by its usual arguments. They're all built against the
+ * same snapshot so the results are consistent with each other, and the response is an array with
+ * each query's result in order. A query that fails gets {"error": message} in its place instead of
+ * failing the whole batch.
+ */
+void req_batch(Worker& worker, const Worker::request_handle_t& handle, const vector<Worker::value_t>& args) {
+
+	// Parse the queries and match up duplicates. Their iterators all go in one arena.
+	arena_t arena;
+	arena_t::scope_t scope(arena);
+	ptr_vector<batch_query_t> queries(args.size());
+	map<string, size_t> seen;
+	for (size_t ii = 0; ii < args.size(); ++ii) {
+		queries.push_back(new batch_query_t);
+		batch_query_t& query = queries.back();
+		if (args[ii].type() != json_spirit::array_type || args[ii].get_array().size() < 3 || args[ii].get_array()[0].type() != json_spirit::str_type) {
+			query.error = "unknown query";
+			continue;
+		}
+		const vector<Worker::value_t>& query_args = args[ii].get_array();
+		const string& name = query_args[0].get_str();
+		if (name != "slice" && name != "hot") {
+			query.error = "unknown query";
+			continue;
+		}
+		query.valid = true;
+		query.hot = name == "hot";
+		query.args.assign(query_args.begin() + 1, query_args.end());
+		pair<map<string, size_t>::iterator, bool> inserted = seen.insert(make_pair(json_spirit::write(args[ii]), ii));
+		if (!inserted.second) {
+			query.same_as = inserted.first->second;
+		} else if (!query.hot) {
+			try {
+				query.key = slice_cache_key(query.args);
+				query.done = slice_cache.find(query.key, query.result);
+			} catch (const runtime_error& error) {
+				query.valid = false;
+				query.error = error.what();
+			}
+		}
 	}
 
-	// Generate payload
-	vector<Worker::value_t> json;
-	reverse_foreach(const score_topic_pair_t& ii, results) {
-		json.push_back(ii.second->id);
-		if (!--count) {
-			break;
+	// Build every iterator from the same snapshot, starting them all over if a commit lands
+	snapshot_t snapshot;
+	do {
+		foreach (batch_query_t& query, queries) {
+			if (!query.valid || query.done || query.same_as != ~size_t(0)) {
+				continue;
+			}
+			try {
+				query.deps.clear();
+				query.it = query.hot ? build_hot_iterator(query.args) : build_slice_iterator(query.args, &query.deps);
+				query.error.clear();
+			} catch (const runtime_error& error) {
+				query.it.reset();
+				query.error = error.what();
+			}
+		}
+	} while (!snapshot.validate());
+
+	// Run them
+	vector<Worker::value_t> results;
+	foreach (batch_query_t& query, queries) {
+		if (query.same_as != ~size_t(0)) {
+			results.push_back(results[query.same_as]);
+			continue;
+		} else if (query.done) {
+			results.push_back(query.result);
+			continue;
+		}
+		if (query.it.get()) {
+			try {
+				if (query.hot) {
+					results.push_back(hot_results(&*query.it, query.args));
+				} else {
+					results.push_back(slice_results(&*query.it, query.args));
+					slice_cache.insert(query.key, results.back(), query.deps);
+				}
+				continue;
+			} catch (const runtime_error& error) {
+				query.error = error.what();
+			}
 		}
+		map<string, Worker::value_t> failed;
+		failed.insert(make_pair("error", query.error));
+		results.push_back(failed);
 	}
-	worker.respond(handle, json);
+	worker.respond(handle, results);
 }
 
 /**
- * Simply lock and unlock the service. This is useful to make sure writes have caught up.
+ * Waits until every message sent before this request has been applied. This is useful to make sure
+ * writes have caught up.
  */
 void req_sync(Worker& worker, const Worker::request_handle_t& handle, const vector<Worker::value_t>& args) {
-	write_lock.lock();
-	write_lock.unlock();
+	{
+		boost::unique_lock<boost::mutex> lock(mutation_lock);
+		uint64_t target = mutations_queued;
+		while (mutations_applied < target) {
+			mutations_applied_cond.wait(lock);
+		}
+	}
 	worker.respond(handle, Worker::value_t(true));
 }
 
+/**
+ * Request for the handler pool's counters: tasks waiting, run and stolen by an idle thread from a
+ * busy one, split by lane. Also how far behind the writer is, how well the slice cache is doing,
+ * and how much memory each pool of index objects has taken.
+ */
+void req_stats(Worker& worker, const Worker::request_handle_t& handle, const vector<Worker::value_t>& args) {
+	Scheduler::stats_t stats = worker.get_server().stats();
+	static const char* lane_names[Scheduler::lane_count] = {"requests", "messages"};
+	map<string, Worker::value_t> response;
+	response.insert(make_pair("threads", stats.threads));
+	for (size_t lane = 0; lane < Scheduler::lane_count; ++lane) {
+		map<string, Worker::value_t> counters;
+		counters.insert(make_pair("queued", stats.queued[lane]));
+		counters.insert(make_pair("executed", stats.executed[lane]));
+		counters.insert(make_pair("stolen", stats.stolen[lane]));
+		response.insert(make_pair(lane_names[lane], counters));
+	}
+	{
+		boost::lock_guard<boost::mutex> lock(mutation_lock);
+		map<string, Worker::value_t> counters;
+		counters.insert(make_pair("queued", mutations_queued - mutations_applied));
+		counters.insert(make_pair("applied", mutations_applied));
+		counters.insert(make_pair("batches", mutation_batches));
+		response.insert(make_pair("writer", counters));
+		map<string, Worker::value_t> expiry;
+		expiry.insert(make_pair("passes", expiry_stats.passes));
+		expiry.insert(make_pair("slices", expiry_stats.slices));
+		expiry.insert(make_pair("topics", expiry_stats.topics));
+		expiry.insert(make_pair("last_pass_slices", expiry_stats.last_pass_slices));
+		expiry.insert(make_pair("last_pass_us", expiry_stats.last_pass_us));
+		expiry.insert(make_pair("last_pass_stall_us", expiry_stats.last_pass_stall_us));
+		expiry.insert(make_pair("max_stall_us", expiry_stats.max_stall_us));
+		response.insert(make_pair("expiry", expiry));
+	}
+	result_cache_t::stats_t cache = slice_cache.stats();
+	map<string, Worker::value_t> counters;
+	counters.insert(make_pair("entries", cache.entries));
+	counters.insert(make_pair("bytes", cache.bytes));
+	counters.insert(make_pair("budget", cache.budget));
+	counters.insert(make_pair("hits", cache.hits));
+	counters.insert(make_pair("misses", cache.misses));
+	counters.insert(make_pair("stale", cache.stale));
+	counters.insert(make_pair("evictions", cache.evictions));
+	response.insert(make_pair("cache", counters));
+	response.insert(make_pair("simd", string(kernels_isa())));
+	map<string, map<string, size_t> > pools;
+	foreach (const pool_t::stats_t& pool, pool_t::stats()) {
+		map<string, size_t>& totals = pools[pool.name];
+		totals["objects"] += pool.objects;
+		totals["bytes"] += pool.bytes;
+	}
+	pools["topics_by_id"]["objects"] += topic_t::topics_by_ord.size() - 1;
+	pools["topics_by_id"]["bytes"] += topic_t::topics_by_id.bytes();
+	map<string, Worker::value_t> memory;
+	for (map<string, map<string, size_t> >::iterator ii = pools.begin(); ii != pools.end(); ++ii) {
+		map<string, Worker::value_t> counters;
+		counters.insert(make_pair("objects", ii->second["objects"]));
+		counters.insert(make_pair("bytes", ii->second["bytes"]));
+		memory.insert(make_pair(ii->first, counters));
+	}
+	response.insert(make_pair("memory", memory));
+	worker.respond(handle, response);
+}
+
+/**
+ * Opaque binlog position of the last snapshot saved or loaded, handed back to the binlog watcher
+ * so it knows where to resume.
+ */
+string snapshot_position;
+boost::mutex snapshot_position_lock;
+boost::mutex snapshot_save_lock;
+const char snapshot_magic[] = "tagd-snapshot";
+const uint64_t snapshot_version = 2;
+
+/**
+ * Writes the live entries of a posting list as the current snapshot sees it, in order. Keys are
+ * delta-encoded like the compressed word blocks, values are topic ordinals.
+ */
+template <class topic_set_t>
+void save_postings(snapshot_writer_t& out, const topic_set_t& topics) {
+	typename topic_set_t::view_t view = topics.view();
+	out.put_varint(view.size());
+	topic_t::ts_t last_ts = 0;
+	bool first = true;
+	for (typename topic_set_t::const_iterator it = view.begin(); !it.at_end(); ++it) {
+		out.put_varint(first ? it.key() : last_ts - it.key());
+		out.put_varint(*it);
+		last_ts = it.key();
+		first = false;
+	}
+}
+
+/**
+ * Reads a posting list written by save_postings() into an empty list. Topics must already be
+ * loaded. `members` receives each topic in the list.
+ */
+template <class topic_set_t>
+void load_postings(snapshot_reader_t& in, topic_set_t& topics, vector<topic_t*>& members) {
+	size_t count = in.get_varint();
+	vector<topic_t::ts_t> keys;
+	vector<topic_t::ord_t> ords;
+	members.clear();
+	keys.reserve(count);
+	ords.reserve(count);
+	members.reserve(count);
+	topic_t::ts_t ts = 0;
+	for (size_t ii = 0; ii < count; ++ii) {
+		ts = ii ? ts - in.get_varint() : in.get_varint();
+		uint64_t ord = in.get_varint();
+		topic_t* topic = ord < topic_t::topics_by_ord.size() ? topic_t::topics_by_ord.get(ord) : NULL;
+		if (!topic || topic->ts() != ts) {
+			throw runtime_error("corrupt snapshot");
+		}
+		keys.push_back(ts);
+		ords.push_back(ord);
+		members.push_back(topic);
+	}
+	topics.assign(keys, ords);
+}
+
+/**
+ * Writes the whole index to `path` and returns the number of the last logged message it covers.
+ * The index is read from a snapshot lined up with the log, so writes carry on while it's saved.
+ */
+uint64_t save_snapshot(const string& path, const string& position) {
+	// Nothing commits while the write transaction is held, so the snapshot taken there covers exactly
+	// the messages logged so far
+	snapshot_t snapshot;
+	uint64_t wal_seq;
+	size_t topic_count;
+	{
+		write_txn_t txn;
+		snapshot.validate();
+		wal_seq = wal.last_seq();
+		topic_count = topic_t::topics_by_ord.size() - 1;
+	}
+
+	snapshot_writer_t out(path);
+	out.put_string(snapshot_magic);
+	out.put_varint(snapshot_version);
+	out.put_string(position);
+	out.put_varint(wal_seq);
+
+	// Topics, in ordinal order so loading them gives them the same ordinals
+	out.put_varint(topic_count);
+	for (size_t ord = 1; ord <= topic_count; ++ord) {
+		const topic_t& topic = *topic_t::topics_by_ord.get(ord);
+		const topic_state_t& state = topic.snapshot();
+		out.put_varint(topic.id());
+		out.put_varint(state.ts);
+		out.put_varint(state.created);
+		out.put_varint(state.activity.users());
+		foreach (const topic_activity_t::poster_t& poster, state.activity.posters) {
+			out.put_varint(poster.last);
+			out.put_varint(poster.user);
+		}
+	}
+
+	// Tags. Ones created since the snapshot are saved empty.
+	save_postings(out, tag_t::global_tag.topics);
+	save_postings(out, tag_t::active_tag.topics);
+	size_t tag_count = tag_t::tags_by_id.size();
+	size_t saved_tags = 0;
+	for (size_t id = 1; id < tag_count; ++id) {
+		if (tag_t::tags_by_id.get(id)) {
+			++saved_tags;
+		}
+	}
+	out.put_varint(saved_tags);
+	for (size_t id = 1; id < tag_count; ++id) {
+		const tag_t* tag = tag_t::tags_by_id.get(id);
+		if (tag) {
+			const tag_t* inverse_tag = tag->reader_inverse_tag();
+			out.put_varint(id);
+			save_postings(out, tag->topics);
+			out.put_varint(inverse_tag != NULL);
+			if (inverse_tag) {
+				save_postings(out, inverse_tag->topics);
+			}
+		}
+	}
+
+	// Words
+	word_t::dictionary_t::view_t dictionary = word_t::words_by_string.view();
+	out.put_varint(dictionary.size());
+	for (word_t::dictionary_t::const_iterator it = dictionary.begin(); !it.at_end(); ++it) {
+		const word_t& word = **it;
+		out.put_string(word.word);
+		save_postings(out, word.topics_titles);
+		save_postings(out, word.topics_documents);
+	}
+	out.commit();
+	return wal_seq;
+}
+
+/**
+ * Loads a snapshot written by save_snapshot() into an empty index. Returns the number of the last
+ * write-ahead log record it covers.
+ */
+uint64_t load_snapshot(const string& path) {
+	write_txn_t txn;
+	snapshot_reader_t in(path);
+	if (in.get_string() != snapshot_magic || in.get_varint() != snapshot_version) {
+		throw runtime_error("not a tagd snapshot");
+	}
+	string position = in.get_string();
+	uint64_t wal_seq = in.get_varint();
+
+	// Topics
+	size_t topic_count = in.get_varint();
+	for (size_t ii = 0; ii < topic_count; ++ii) {
+		topic_t::id_t id = in.get_varint();
+		topic_t::ts_t ts = in.get_varint();
+		topic_state_t& state = topic_t::create(id, ts).writable();
+		state.created = in.get_varint();
+		size_t message_count = in.get_varint();
+		for (size_t jj = 0; jj < message_count; ++jj) {
+			topic_t::ts_t post_ts = in.get_varint();
+			topic_t::user_t user = in.get_varint();
+			state.activity.post(post_ts, user);
+		}
+	}
+
+	// Tags
+	vector<topic_t*> members;
+	load_postings(in, tag_t::global_tag.topics, members);
+	foreach (topic_t* topic, members) {
+		topic->tags.insert(&tag_t::global_tag);
+	}
+	tag_t::global_tag.check_density();
+	load_postings(in, tag_t::active_tag.topics, members);
+	foreach (topic_t* topic, members) {
+		topic->tags.insert(&tag_t::active_tag);
+	}
+	tag_t::active_tag.check_density();
+	foreach (topic_t* topic, members) {
+		topic_t::topics_by_activity.insert(topic);
+		expiry_wheel.file(topic);
+	}
+	size_t tag_count = in.get_varint();
+	for (size_t ii = 0; ii < tag_count; ++ii) {
+		tag_t& tag = tag_t::get(in.get_varint());
+		load_postings(in, tag.topics, members);
+		foreach (topic_t* topic, members) {
+			topic->tags.insert(&tag);
+		}
+		tag.check_density();
+		if (in.get_varint()) {
+			tag_t& inverse = *new tag_t;
+			tag.set_inverse(&inverse);
+			inverse.set_inverse(&tag);
+			tag_t::inverse_tags.push_back(&inverse);
+			load_postings(in, inverse.topics, members);
+			foreach (topic_t* topic, members) {
+				topic->tags.insert(&inverse);
+			}
+			inverse.check_density();
+		}
+	}
+
+	// Words
+	size_t word_count = in.get_varint();
+	for (size_t ii = 0; ii < word_count; ++ii) {
+		word_t& word = word_t::get(in.get_string());
+		load_postings(in, word.topics_titles, members);
+		foreach (topic_t* topic, members) {
+			topic->title.insert(&word);
+		}
+		load_postings(in, word.topics_documents, members);
+		foreach (topic_t* topic, members) {
+			topic->document.insert(&word);
+		}
+	}
+	if (!in.at_end()) {
+		throw runtime_error("corrupt snapshot");
+	}
+	{
+		boost::lock_guard<boost::mutex> lock(snapshot_position_lock);
+		snapshot_position = position;
+	}
+	return wal_seq;
+}
+
+/**
+ * Request to save the index to a file. The binlog watcher passes along its current position, which
+ * is stored with the snapshot and handed back by `position` after a restart. Writes only wait while
+ * the snapshot is lined up with the log and while the log is cut down after, queries don't wait at
+ * all. Snapshots are taken one at a time.
+ */
+void req_snapshot(Worker& worker, const Worker::request_handle_t& handle, const vector<Worker::value_t>& args) {
+	try {
+		boost::lock_guard<boost::mutex> save_lock(snapshot_save_lock);
+		const string& position = args[1].get_str();
+		uint64_t wal_seq = save_snapshot(args[0].get_str(), position);
+		{
+			boost::lock_guard<boost::mutex> lock(snapshot_position_lock);
+			snapshot_position = position;
+		}
+		{
+			write_txn_t txn;
+			wal.truncate(wal_seq);
+		}
+		worker.respond(handle, Worker::value_t(true));
+	} catch (const runtime_error& error) {
+		worker.respond(handle, error.what(), true);
+	}
+}
+
+/**
+ * Request for the binlog position of the last snapshot saved or loaded, null if there wasn't one.
+ */
+void req_position(Worker& worker, const Worker::request_handle_t& handle, const vector<Worker::value_t>& args) {
+	string position;
+	{
+		boost::lock_guard<boost::mutex> lock(snapshot_position_lock);
+		position = snapshot_position;
+	}
+	if (position.empty()) {
+		worker.respond(handle, Worker::value_t());
+	} else {
+		worker.respond(handle, Worker::value_t(position));
+	}
+}
+
 int main(const int argc, const char* argv[]) {
-	if (argc != 2) {
-		cout <<"usage: " <<argv[0] <<" <socket>\n";
+	static const struct option long_options[] = {
+		{"compress-words", no_argument, NULL, 'c'},
+		{"load-snapshot", required_argument, NULL, 'l'},
+		{"wal", required_argument, NULL, 'w'},
+		{"wal-interval", required_argument, NULL, 'i'},
+		{"io-threads", required_argument, NULL, 't'},
+		{"threads", required_argument, NULL, 'p'},
+		{"max-requests", required_argument, NULL, 'r'},
+		{"max-output", required_argument, NULL, 'o'},
+		{"cache-size", required_argument, NULL, 'm'},
+		{"materialize-unions", required_argument, NULL, 'u'},
+		{"max-wildcard-words", required_argument, NULL, 'x'},
+		{"max-wildcard-postings", required_argument, NULL, 'y'},
+		{"expire-interval", required_argument, NULL, 'e'},
+		{NULL, 0, NULL, 0}
+	};
+	int opt;
+	bool usage = false;
+	const char* snapshot = NULL;
+	const char* wal_path = NULL;
+	size_t wal_interval = 100;
+	size_t io_threads = 0;
+	size_t threads = 0;
+	size_t max_requests = 1024;
+	size_t max_output = 32 * 1024 * 1024;
+	size_t cache_size = 64 * 1024 * 1024;
+	size_t expire_interval = 1000;
+	while ((opt = getopt_long(argc, const_cast<char* const*>(argv), "cl:w:i:t:p:r:o:m:u:x:y:e:", long_options, NULL)) != -1) {
+		switch (opt) {
+			case 'c':
+				word_t::topic_set_t::compress = true;
+				break;
+			case 'l':
+				snapshot = optarg;
+				break;
+			case 'w':
+				wal_path = optarg;
+				break;
+			case 'i':
+				wal_interval = atoi(optarg);
+				break;
+			case 't':
+				io_threads = atoi(optarg);
+				break;
+			case 'p':
+				threads = atoi(optarg);
+				break;
+			case 'r':
+				max_requests = atoi(optarg);
+				break;
+			case 'o':
+				max_output = atoi(optarg);
+				break;
+			case 'm':
+				cache_size = atoi(optarg);
+				break;
+			case 'u':
+				materialized_topic_iterator_t::min_fan_in = atoi(optarg);
+				break;
+			case 'x':
+				word_t::max_wildcard_words = atoi(optarg);
+				break;
+			case 'y':
+				word_t::max_wildcard_postings = atoi(optarg);
+				break;
+			case 'e':
+				expire_interval = atoi(optarg);
+				break;
+			default:
+				usage = true;
+		}
+	}
+	if (usage || optind != argc - 1) {
+		cout <<"usage: " <<argv[0] <<" [--compress-words] [--load-snapshot <file>] [--wal <file> [--wal-interval <ms>]] [--io-threads <n>] [--threads <n>] [--max-requests <n>] [--max-output <bytes>] [--cache-size <bytes>] [--materialize-unions <n>] [--max-wildcard-words <n>] [--max-wildcard-postings <n>] [--expire-interval <ms>] <socket>\n";
 		return 1;
 	}
-	Worker::Server::ptr server = Worker::listen(argv[1]);
-	server->register_handler("addTags", msg_add_tags);
-	server->register_handler("removeTag", msg_remove_tag);
-	server->register_handler("clearTag", msg_clear_tag);
-	server->register_handler("bumpTopic", msg_bump_topic);
-	server->register_handler("createTopic", msg_created_topic);
-	server->register_handler("fullText", msg_full_text);
-	server->register_handler("flushCounts", msg_flush_counts);
+	uint64_t wal_seq = 0;
+	if (snapshot) {
+		try {
+			wal_seq = load_snapshot(snapshot);
+		} catch (const runtime_error& error) {
+			cerr <<"couldn't load " <<snapshot <<": " <<error.what() <<"\n";
+			return 1;
+		}
+	}
+	if (wal_path) {
+		try {
+			write_txn_t txn;
+			wal.open(wal_path, wal_interval, wal_seq, replay_mutation);
+		} catch (const runtime_error& error) {
+			cerr <<"couldn't open " <<wal_path <<": " <<error.what() <<"\n";
+			return 1;
+		}
+	}
+	slice_cache.set_budget(cache_size);
+	boost::thread writer(run_mutations, expire_interval);
+	Worker::Server::ptr server = Worker::listen(argv[optind], io_threads, threads);
+	server->set_limits(max_requests, max_output);
+	server->register_handler("addTags", msg_mutation<op_add_tags>, Worker::Server::immediate);
+	server->register_handler("removeTag", msg_mutation<op_remove_tag>, Worker::Server::immediate);
+	server->register_handler("clearTag", msg_mutation<op_clear_tag>, Worker::Server::immediate);
+	server->register_handler("bumpTopic", msg_mutation<op_bump_topic>, Worker::Server::immediate);
+	server->register_handler("createTopic", msg_mutation<op_created_topic>, Worker::Server::immediate);
+	server->register_handler("fullText", msg_mutation<op_full_text>, Worker::Server::immediate);
+	server->register_handler("flushCounts", msg_mutation<op_flush_counts>, Worker::Server::immediate);
 	server->register_handler("slice", req_slice);
 	server->register_handler("hot", req_hot);
+	server->register_handler("batch", req_batch);
 	server->register_handler("sync", req_sync);
+	server->register_handler("snapshot", req_snapshot);
+	server->register_handler("position", req_position);
+	server->register_handler("stats", req_stats);
 	Worker::loop();
 	return 0;
 }
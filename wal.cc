@@ -0,0 +1,274 @@
+#include "wal.h"
+#include "snapshot_file.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <iostream>
+#include <stdexcept>
+#include <boost/bind.hpp>
+#include <boost/crc.hpp>
+#include <boost/foreach.hpp>
+#define foreach BOOST_FOREACH
+
+using namespace std;
+using namespace eti;
+
+// Each record is a header of the payload length and its crc, then the payload: sequence number,
+// opcode, time and the message arguments.
+static const char wal_magic[8] = {'t', 'a', 'g', 'd', 'w', 'a', 'l', '1'};
+static const size_t header_size = 2 * sizeof(uint32_t);
+
+static uint32_t checksum(const char* data, size_t length) {
+	boost::crc_32_type crc;
+	crc.process_bytes(data, length);
+	return crc.checksum();
+}
+
+/**
+ * Offset of the first record in `data` numbered after `through`, or `length` if there's none.
+ */
+static size_t skip_records(const char* data, size_t length, uint64_t through) {
+	size_t offset = 0;
+	while (length - offset >= header_size) {
+		uint32_t record_length;
+		memcpy(&record_length, data + offset, sizeof(uint32_t));
+		const char* record = data + offset + header_size;
+		if (length - offset - header_size < record_length) {
+			break;
+		}
+		uint64_t record_seq;
+		if (!pack::read_varint(record, record + record_length, record_seq) || record_seq > through) {
+			break;
+		}
+		offset += header_size + record_length;
+	}
+	return offset;
+}
+
+/**
+ * Writes all of `length` bytes, retrying after signals and short writes.
+ */
+static bool write_all(int fd, const char* data, size_t length) {
+	while (length) {
+		ssize_t wrote = ::write(fd, data, length);
+		if (wrote < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		data += wrote;
+		length -= wrote;
+	}
+	return true;
+}
+
+wal_t::wal_t() : fd(-1), interval(0), seq(0), stop(false) {}
+
+wal_t::~wal_t() {
+	if (fd >= 0) {
+		{
+			boost::lock_guard<boost::mutex> lock(pending_lock);
+			stop = true;
+		}
+		wakeup.notify_one();
+		flusher.join();
+		close(fd);
+	}
+}
+
+void wal_t::open(const string& path, size_t interval, uint64_t after, replay_t replay) {
+	this->path = path;
+	this->interval = interval;
+	seq = after;
+	fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+	if (fd < 0) {
+		throw runtime_error("open() error");
+	}
+	struct stat info;
+	if (fstat(fd, &info) != 0) {
+		throw runtime_error("fstat() error");
+	}
+	size_t length = info.st_size;
+	if (length < sizeof(wal_magic)) {
+		// New log
+		if (ftruncate(fd, 0) != 0 || ::write(fd, wal_magic, sizeof(wal_magic)) != sizeof(wal_magic) || fsync(fd) != 0) {
+			throw runtime_error("write() error");
+		}
+	} else {
+		void* map = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			throw runtime_error("mmap() error");
+		}
+		const char* data = static_cast<const char*>(map);
+		const char* end = data + length;
+		if (memcmp(data, wal_magic, sizeof(wal_magic)) != 0) {
+			munmap(map, length);
+			throw runtime_error("not a tagd write-ahead log");
+		}
+
+		// Replay everything up to the first incomplete or damaged record
+		const char* pos = data + sizeof(wal_magic);
+		vector<value_t> args;
+		while (size_t(end - pos) >= header_size) {
+			uint32_t record_length, crc;
+			memcpy(&record_length, pos, sizeof(uint32_t));
+			memcpy(&crc, pos + sizeof(uint32_t), sizeof(uint32_t));
+			const char* record = pos + header_size;
+			if (size_t(end - record) < record_length || checksum(record, record_length) != crc) {
+				break;
+			}
+			const char* record_end = record + record_length;
+			uint64_t record_seq, op, time, count;
+			if (
+				!pack::read_varint(record, record_end, record_seq) ||
+				!pack::read_varint(record, record_end, op) ||
+				!pack::read_varint(record, record_end, time) ||
+				!pack::read_varint(record, record_end, count) ||
+				count > size_t(record_end - record)
+			) {
+				break;
+			}
+			args.resize(count);
+			bool ok = true;
+			for (size_t ii = 0; ok && ii < count; ++ii) {
+				ok = pack::read(record, record_end, args[ii]);
+			}
+			if (!ok) {
+				break;
+			}
+			if (record_seq > after) {
+				// A record which can't be applied is skipped like it would have been when it came in
+				try {
+					replay(op, time, args);
+				} catch (const runtime_error& error) {
+					cerr <<"wal: skipping record " <<record_seq <<": " <<error.what() <<"\n";
+				}
+				seq = record_seq;
+			}
+			pos = record_end;
+		}
+		size_t valid = pos - data;
+		munmap(map, length);
+		if (valid != length) {
+			cerr <<"wal: discarding " <<(length - valid) <<" bytes of torn records\n";
+			if (ftruncate(fd, valid) != 0 || fsync(fd) != 0) {
+				throw runtime_error("ftruncate() error");
+			}
+		}
+	}
+	flusher = boost::thread(boost::bind(&wal_t::flush_loop, this));
+}
+
+void wal_t::append(uint32_t op, uint32_t time, const vector<value_t>& args) {
+	++seq;
+	if (fd < 0) {
+		return;
+	}
+	{
+		boost::lock_guard<boost::mutex> lock(pending_lock);
+		size_t offset = pending.size();
+		pending.append(header_size, '\0');
+		pack::write_varint(seq, pending);
+		pack::write_varint(op, pending);
+		pack::write_varint(time, pending);
+		pack::write_varint(args.size(), pending);
+		foreach (const value_t& arg, args) {
+			pack::write(arg, pending);
+		}
+		uint32_t record_length = pending.size() - offset - header_size;
+		uint32_t crc = checksum(&pending[offset + header_size], record_length);
+		memcpy(&pending[offset], &record_length, sizeof(uint32_t));
+		memcpy(&pending[offset + sizeof(uint32_t)], &crc, sizeof(uint32_t));
+	}
+	wakeup.notify_one();
+}
+
+void wal_t::truncate(uint64_t through) {
+	if (fd < 0) {
+		return;
+	}
+	boost::lock_guard<boost::mutex> file_guard(file_lock);
+	boost::lock_guard<boost::mutex> pending_guard(pending_lock);
+	pending.erase(0, skip_records(pending.data(), pending.size(), through));
+
+	struct stat info;
+	if (fstat(fd, &info) != 0) {
+		throw runtime_error("fstat() error");
+	}
+	size_t length = info.st_size;
+	void* map = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		throw runtime_error("mmap() error");
+	}
+	const char* data = static_cast<const char*>(map) + sizeof(wal_magic);
+	size_t records = length - sizeof(wal_magic);
+	size_t covered = skip_records(data, records, through);
+	if (covered == records) {
+		munmap(map, length);
+		if (ftruncate(fd, sizeof(wal_magic)) != 0 || fsync(fd) != 0) {
+			throw runtime_error("ftruncate() error");
+		}
+		return;
+	}
+
+	// Records were written out after `through`. They're copied to a new log which is then swapped in,
+	// so a crash part way leaves one log or the other whole.
+	string temp_path = path + ".tmp";
+	int temp_fd = ::open(temp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if (temp_fd < 0) {
+		munmap(map, length);
+		throw runtime_error("open() error");
+	}
+	bool ok =
+		write_all(temp_fd, wal_magic, sizeof(wal_magic)) &&
+		write_all(temp_fd, data + covered, records - covered) &&
+		fsync(temp_fd) == 0 &&
+		rename(temp_path.c_str(), path.c_str()) == 0;
+	munmap(map, length);
+	if (!ok) {
+		close(temp_fd);
+		unlink(temp_path.c_str());
+		throw runtime_error("write() error");
+	}
+	close(fd);
+	fd = temp_fd;
+	sync_parent_directory(path);
+}
+
+/**
+ * Writes out whatever was appended since the last pass with a single write and fsync, then waits out
+ * the rest of the interval so bursts get batched together.
+ */
+void wal_t::flush_loop() {
+	string batch;
+	while (true) {
+		{
+			boost::unique_lock<boost::mutex> lock(pending_lock);
+			while (pending.empty() && !stop) {
+				wakeup.wait(lock);
+			}
+			if (pending.empty()) {
+				return;
+			}
+			batch.swap(pending);
+		}
+		{
+			boost::lock_guard<boost::mutex> lock(file_lock);
+			if (!write_all(fd, batch.data(), batch.size())) {
+				cerr <<"wal: write err: " <<errno <<"\n";
+			}
+			if (fdatasync(fd) != 0) {
+				cerr <<"wal: fdatasync err: " <<errno <<"\n";
+			}
+		}
+		batch.clear();
+		if (interval) {
+			boost::this_thread::sleep(boost::posix_time::milliseconds(interval));
+		}
+	}
+}
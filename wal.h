@@ -0,0 +1,72 @@
+#ifndef WAL_H
+#define WAL_H
+#include "libeti_pack.h"
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+/**
+ * Append-only log of the messages applied to the index, used to recover what was lost since the last
+ * snapshot after a crash.
+ *
+ * Records are numbered. Appending only copies the record into a memory buffer; a background thread
+ * writes out and fsyncs whatever has piled up at most once per `interval`, so one sync covers many
+ * messages and the writer never waits on the disk. Anything appended within `interval` milliseconds
+ * of a crash can be lost.
+ */
+class wal_t {
+	public:
+		typedef json_spirit::mValue value_t;
+		typedef void (*replay_t)(uint32_t op, uint32_t time, const std::vector<value_t>& args);
+
+		wal_t();
+		~wal_t();
+
+		/**
+		 * Opens or creates the log at `path`. Records numbered after `after` are handed to `replay`, a
+		 * torn record at the end from a crash is cut off, and new records are appended after the rest.
+		 * A record `replay` throws a runtime_error for is skipped.
+		 */
+		void open(const std::string& path, size_t interval, uint64_t after, replay_t replay);
+
+		/**
+		 * Logs a message. Writer only. Without open() this just counts.
+		 */
+		void append(uint32_t op, uint32_t time, const std::vector<value_t>& args);
+
+		/**
+		 * Number of the last record appended.
+		 */
+		uint64_t last_seq() const {
+			return seq;
+		}
+
+		/**
+		 * Throws away the records numbered up to `through`, once a snapshot covers them. Anything
+		 * appended since is kept. Writer only.
+		 */
+		void truncate(uint64_t through);
+
+	private:
+		std::string path;
+		int fd;
+		size_t interval;
+		uint64_t seq;
+		bool stop;
+		std::string pending;
+		boost::mutex pending_lock;
+		boost::mutex file_lock;
+		boost::condition_variable wakeup;
+		boost::thread flusher;
+
+		void flush_loop();
+
+		// Non-copyable
+		wal_t(const wal_t&);
+		wal_t& operator=(const wal_t&);
+};
+
+#endif